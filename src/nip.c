@@ -28,6 +28,13 @@
 /** Run EM steps at least this many times */
 #define MIN_EM_ITERATIONS 3
 
+/** Transfer matrices only for interfaces with this many states */
+#define MAX_TRANSFER_SIZE 64
+
+/** Time steps per chunk of forward_inference_scan() (not per thread, 
+ * so that the results do not depend on the number of threads) */
+#define SCAN_CHUNK_LENGTH 256
+
 /*#define DEBUG_NIP*/
 
 /* External Hugin Net parser functions */
@@ -44,6 +51,12 @@ void get_parsed_node_size(int* x, int* y);
 
 
 /* Internal helper functions */
+static uncertain_series new_results(time_series ts, nip_variable vars[], 
+				    int nvars);
+static int interface_message_plan(nip_model model);
+static double prior_mass(nip_model model);
+static int prior_interface_mass(nip_model model);
+static double interface_mass(nip_model model, nip_potential alpha);
 static int start_timeslice_message_pass(nip_model model, 
 					nip_direction dir, 
 					nip_potential sepset);
@@ -52,6 +65,79 @@ static int finish_timeslice_message_pass(nip_model model,
 					 nip_potential num, 
 					 nip_potential den);
 
+
+/* Something to do with each time slice of the backward phase */
+typedef int (*timeslice_task)(nip_model model, int t, void* data);
+
+/* What forward-backward inference keeps in memory between the phases */
+typedef struct {
+  int k;                     /* time steps between checkpoints (T if none) */
+  int n;                     /* size of checkpoint ([0] is not used) */
+  nip_potential* alpha;      /* forward messages, step t in [t % k] */
+  nip_potential* checkpoint; /* forward message into step c*k in [c] */
+  nip_potential gamma;       /* the message from the future */
+  double* timeslices;        /* the join tree after each step, or NULL */
+  char* orientation;         /* the sepset tables of each step in timeslices */
+  double** table;            /* the compiled time slice of each step */
+  int* index;                /* the variables of the results (if table) */
+} fb_workspace;
+
+static int new_fb_workspace(nip_model model, int length, fb_workspace* w);
+static void free_fb_workspace(fb_workspace* w);
+static int forward_timeslice(time_series ts, int t, double* table, 
+			     nip_potential alpha_in, nip_potential alpha_out, 
+			     double* mass);
+static int backward_timeslice(time_series ts, int t, fb_workspace* w, 
+			      timeslice_task task, void* data);
+static int forward_backward(time_series ts, double* loglikelihood, 
+			    int strict, timeslice_task task, void* data);
+static int smoothed_probabilities(nip_model model, int t, void* data);
+
+/* What forward_inference_scan() keeps in memory: the compiled matrices 
+ * of each distinct row of observations, and the chunks of the scan */
+typedef struct {
+  int size;              /* number of states of the interface */
+  int width;             /* sum of the cardinalities of the results */
+  int length;            /* length of the time series */
+  int chunk;             /* time steps per chunk */
+  int num_of_chunks;     /* chunks covering the steps 1..length-1 */
+  int* row;              /* the distinct row of observations at each step */
+  double* mass;          /* size values per row */
+  double* transfer;      /* size x size matrix per row */
+  double* marginals;     /* size x width values per row */
+  double* prior;         /* prior_interface_mass of the model */
+  double* product;       /* size x size matrix per chunk */
+  double* alpha;         /* the message into each chunk (and after) */
+  double* loglikelihood; /* per chunk */
+  int* impossible;       /* per chunk: a step with zero probability */
+  uncertain_series results;
+} scan_workspace;
+
+static int distinct_rows(time_series ts, int* row, int* first);
+static int compile_timeslice(time_series ts, int t, 
+			     nip_variable vars[], int nvars, 
+			     nip_potential alpha, double* mass, 
+			     double* transfer, double* marginals);
+static int scan_chunk_transfer(void* data, int c);
+static int scan_chunk_results(void* data, int c);
+static int forward_scan(time_series ts, scan_workspace* w, int* first, 
+			int n, nip_potential alpha, double* loglikelihood);
+
+static void free_transfer_cache(nip_transfer_cache c);
+static void empty_transfer_cache(nip_transfer_cache c);
+static int variable_indices(nip_model model, nip_variable vars[], int n, 
+			    int index[]);
+static int compile_transfer(nip_model model, int* key, double* table);
+static double* cached_timeslice(nip_model model, int* key);
+static double* cached_ts_step(time_series ts, int t, int* observed);
+static double compiled_forward(nip_transfer_cache c, double* table, 
+			       double* alpha, int nvars, int* index, 
+			       double** results);
+static void compiled_backward(nip_transfer_cache c, double* table, 
+			      double* alpha_in, double* alpha_out, 
+			      double* gamma_in, double* gamma_out, 
+			      int nvars, int* index, double** results);
+
 static int e_step(time_series ts, nip_potential* parameters, 
 		  double* loglikelihood);
 static int m_step(nip_potential* results, nip_model model);
@@ -70,12 +156,20 @@ void reset_model(nip_model model){
 				 model->cliques, model->num_of_cliques);
   if(retval != NIP_NO_ERROR)
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+  model->evidence_epoch++;
 }
 
 
 void total_reset(nip_model model){
   int i;
   nip_clique c;
+  for(i = 0; i < 2; i++){
+    free(model->snapshot[i]); /* new parameters coming */
+    model->snapshot[i] = NULL;
+  }
+  model->prior_mass = -1;
+  model->prior_interface_known = 0;
+  empty_transfer_cache(model->transfer_cache);
   for(i = 0; i < model->num_of_cliques; i++){
     c = model->cliques[i];
     nip_uniform_potential(c->original_p, 1.0);
@@ -116,11 +210,61 @@ void use_priors(nip_model model, int has_history){
       }
     }
   }
+  model->evidence_epoch++;
+}
+
+
+void reset_timeslice(nip_model model, int has_history){
+  int i, k, n;
+  nip_variable v;
+
+  k = (has_history ? 1 : 0);
+  if(model->snapshot[k] != NULL){
+    for(i = 0; i < model->num_of_vars; i++){
+      v = model->variables[i];
+      nip_reset_likelihood(v);
+      /* the priors in the snapshot: see use_priors() */
+      v->prior_entered = (nip_number_of_parents(v) == 0 && 
+			  (!has_history || 
+			   !(v->interface_status & NIP_INTERFACE_OLD_OUTGOING)));
+    }
+    if(model->arena){
+      /* all the tables (also the sepsets) in one go */
+      memcpy(model->arena->data, model->snapshot[k], 
+	     model->arena->size * sizeof(double));
+      nip_forget_evidence(model->cliques, model->num_of_cliques);
+    }
+    else
+      nip_restore_potentials(model->cliques, model->num_of_cliques, 
+			     model->snapshot[k]);
+    model->evidence_epoch++;
+    return;
+  }
+
+  reset_model(model);
+  use_priors(model, has_history);
+
+  /* the first time: take a snapshot (if there is memory for it) */
+  if(model->arena){
+    n = model->arena->size;
+    model->snapshot[k] = (double*) calloc(n + 1, sizeof(double));
+    if(model->snapshot[k] != NULL)
+      memcpy(model->snapshot[k], model->arena->data, n * sizeof(double));
+    return;
+  }
+  n = 0;
+  for(i = 0; i < model->num_of_cliques; i++)
+    n += model->cliques[i]->p->size_of_data;
+  model->snapshot[k] = (double*) calloc(n + 1, sizeof(double));
+  if(model->snapshot[k] != NULL)
+    nip_save_potentials(model->cliques, model->num_of_cliques, 
+			model->snapshot[k]);
 }
 
 
 nip_model parse_model(char* file){
   int i, j, k, m, retval;
+  nip_clique ends[2];
   nip_variable temp;
   nip_variable_list vl;
   nip_model new = (nip_model) malloc(sizeof(nip_model_struct));
@@ -145,6 +289,25 @@ nip_model parse_model(char* file){
 
   /* 2. Get the parsed stuff and make a model out of them */
   new->num_of_cliques = get_cliques(&(new->cliques));
+  if(nip_order_clique_variables(new->cliques, new->num_of_cliques) != 0){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+    free(new);
+    return NULL;
+  }
+  new->root = NULL;
+  new->schedule = NULL;
+  new->pool = NULL;
+  new->prior_interface_mass = NULL;
+  new->evidence_epoch = 1; /* never consistent so far */
+  new->consistent_epoch = 0;
+  new->arena = NULL;
+  new->snapshot[0] = NULL;
+  new->snapshot[1] = NULL;
+  new->prior_mass = -1;
+  new->prior_interface_known = 0;
+  new->memory_policy = NIP_MEMORY_INTERFACES;
+  new->memory_budget = 0;
+  new->transfer_cache = NULL;
   vl = get_parsed_variables();
   new->num_of_vars = NIP_LIST_LENGTH(vl);
   new->variables = nip_variable_list_to_array(vl);
@@ -257,13 +420,56 @@ nip_model parse_model(char* file){
 				      new->outgoing_interface, 
 				      new->outgoing_interface_size);
     assert(new->out_clique != NULL);
+
+    /* The message plans between time slices: computed only once */
+    if(interface_message_plan(new) != NIP_NO_ERROR){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+      free_model(new);
+      return NULL;
+    }
   }
   else{
     new->in_clique = NULL;
     new->out_clique = NULL;
+    new->in_clique_stride = NULL;
+    new->out_clique_stride = NULL;
+    new->prior_interface_mass = nip_new_potential(NULL, 0, NULL);
+    if(!new->prior_interface_mass){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+      free_model(new);
+      return NULL;
+    }
   }
   get_parsed_node_size(&(new->node_size_x), &(new->node_size_y));
 
+  /* 3. Compile the join tree into a schedule of message passes, 
+   * rooted near the cliques where the messages of every time step 
+   * enter and leave */
+  ends[0] = new->in_clique;
+  ends[1] = new->out_clique;
+  new->root = nip_choose_root(new->cliques, new->num_of_cliques, ends, 2);
+  if(new->root || new->num_of_cliques == 0)
+    new->schedule = nip_new_schedule(new->cliques, new->num_of_cliques, 
+				     new->root);
+  if(!new->schedule){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    free_model(new);
+    return NULL;
+  }
+  /* ...and lay out the tables in that order */
+  new->arena = nip_new_join_tree_arena(new->schedule, new->cliques, 
+				       new->num_of_cliques);
+  if(!new->arena){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    free_model(new);
+    return NULL;
+  }
+  if(set_num_of_threads(new, nip_requested_threads()) != NIP_NO_ERROR){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+    free_model(new);
+    return NULL;
+  }
+
   /* Let's check one detail */
   for(i = 0; i < new->num_of_vars - new->num_of_children; i++)  
     assert(new->independent[i]->num_of_parents == 0);
@@ -505,6 +711,15 @@ void free_model(nip_model model){
   free(model->incoming_interface);
   free(model->children);
   free(model->independent);
+  free(model->in_clique_stride);
+  free(model->out_clique_stride);
+  nip_free_schedule(model->schedule);
+  nip_free_thread_pool(model->pool);
+  nip_free_potential(model->prior_interface_mass);
+  nip_free_potential_arena(model->arena);
+  free(model->snapshot[0]);
+  free(model->snapshot[1]);
+  free_transfer_cache(model->transfer_cache);
   free(model);
 }
 
@@ -949,6 +1164,20 @@ int set_observation(time_series ts, nip_variable v, int time,
 
 
 int insert_hard_evidence(nip_model model, char* varname, char* observation){
+  int ret = enter_hard_evidence(model, varname, observation);
+  make_consistent(model);
+  return ret;
+}
+
+
+int insert_soft_evidence(nip_model model, char* varname, double* distribution){
+  int ret = enter_soft_evidence(model, varname, distribution);
+  make_consistent(model);
+  return ret;
+}
+
+
+int enter_hard_evidence(nip_model model, char* varname, char* observation){
   int ret;
   nip_variable v = model_variable(model, varname);
   if(v == NULL)
@@ -959,12 +1188,12 @@ int insert_hard_evidence(nip_model model, char* varname, char* observation){
   if(ret != NIP_NO_ERROR)
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
 
-  make_consistent(model);
+  model->evidence_epoch++; /* propagate later */
   return ret;
 }
 
 
-int insert_soft_evidence(nip_model model, char* varname, double* distribution){
+int enter_soft_evidence(nip_model model, char* varname, double* distribution){
   int ret;
   nip_variable v = model_variable(model, varname);
   if(v == NULL)
@@ -972,7 +1201,7 @@ int insert_soft_evidence(nip_model model, char* varname, double* distribution){
   ret =  nip_enter_evidence(model->variables, model->num_of_vars, 
 			    model->cliques, model->num_of_cliques, 
 			    v, distribution);
-  make_consistent(model);
+  model->evidence_epoch++; /* propagate later */
   return ret;
 }
 
@@ -980,7 +1209,7 @@ int insert_soft_evidence(nip_model model, char* varname, double* distribution){
 /* Note that <model> may be different from ts->model, but the variables
  * have to be shared. */
 int insert_ts_step(time_series ts, int t, nip_model model, char mark_mask){
-  int i;
+  int i, n, m;
   nip_variable v;
 
   if(t < 0 || t >= timeseries_length(ts)){
@@ -988,15 +1217,35 @@ int insert_ts_step(time_series ts, int t, nip_model model, char mark_mask){
     return NIP_ERROR_INVALID_ARGUMENT;
   }
     
-  for(i = 0; i < ts->model->num_of_vars - ts->num_of_hidden; i++){
-    v = ts->observed[i];
-    if(NIP_MARK(v) & mark_mask){ /* Only the suitably marked variables */
-      if(ts->data[t][i] >= 0)
-	nip_enter_index_observation(model->variables, model->num_of_vars, 
-				    model->cliques, model->num_of_cliques, 
-				    v, ts->data[t][i]);
+  n = ts->model->num_of_vars - ts->num_of_hidden;
+  {
+    nip_variable vars[n + 1];
+    int states[n + 1];
+    m = 0;
+    for(i = 0; i < n; i++){
+      v = ts->observed[i];
+      if(NIP_MARK(v) & mark_mask){ /* Only the suitably marked variables */
+	vars[m] = v;
+	states[m] = ts->data[t][i];
+	m++;
+      }
     }
+    return insert_evidence_batch(model, vars, states, m);
   }
+}
+
+
+int insert_evidence_batch(nip_model model, nip_variable vars[], 
+			  int states[], int n){
+  int e;
+  e = nip_enter_index_observations(model->variables, model->num_of_vars, 
+				   model->cliques, model->num_of_cliques, 
+				   vars, states, n);
+  if(e != NIP_NO_ERROR){
+    nip_report_error(__FILE__, __LINE__, e, 1);
+    return e; /* nothing entered */
+  }
+  model->evidence_epoch++; /* propagate later */
   return NIP_NO_ERROR;
 }
 
@@ -1017,6 +1266,7 @@ int insert_ucs_step(uncertain_series ucs, int t, nip_model model, char mark_mask
       e = nip_enter_evidence(model->variables, model->num_of_vars, 
 			     model->cliques, model->num_of_cliques, 
 			     v, ucs->data[t][i]);
+      model->evidence_epoch++;
       if(e != NIP_NO_ERROR){
 	nip_report_error(__FILE__, __LINE__, e, 1);  
 	return e;
@@ -1027,14 +1277,121 @@ int insert_ucs_step(uncertain_series ucs, int t, nip_model model, char mark_mask
 }
 
 
+/* Computes the message plans between the interface cliques and 
+ * the interface potentials (alpha & gamma) */
+static int interface_message_plan(nip_model model){
+  int i;
+  int nvars = model->outgoing_interface_size;
+  int *mapping, *cardinality;
+
+  model->in_clique_stride = (int*) 
+    calloc(NIP_DIMENSIONALITY(model->in_clique->p), sizeof(int));
+  model->out_clique_stride = (int*) 
+    calloc(NIP_DIMENSIONALITY(model->out_clique->p), sizeof(int));
+  cardinality = (int*) calloc(nvars, sizeof(int));
+  if(!(model->in_clique_stride && model->out_clique_stride && cardinality)){
+    free(cardinality);
+    return NIP_ERROR_OUTOFMEMORY;
+  }
+  for(i = 0; i < nvars; i++)
+    cardinality[i] = NIP_CARDINALITY(model->outgoing_interface[i]);
+  model->prior_interface_mass = nip_new_potential(cardinality, nvars, NULL);
+  if(!model->prior_interface_mass){
+    free(cardinality);
+    return NIP_ERROR_OUTOFMEMORY;
+  }
+
+  /* I_{t-1}-> in the clique receiving messages from the past */
+  mapping = nip_mapper(model->in_clique->variables, 
+		       model->previous_outgoing_interface, 
+		       NIP_DIMENSIONALITY(model->in_clique->p), nvars);
+  if(!mapping){
+    free(cardinality);
+    return NIP_ERROR_OUTOFMEMORY;
+  }
+  nip_mapping_strides(model->in_clique->p, cardinality, mapping, nvars, 
+		      model->in_clique_stride);
+  free(mapping);
+
+  /* I_{t}-> in the clique sending messages to the future */
+  mapping = nip_mapper(model->out_clique->variables, 
+		       model->outgoing_interface, 
+		       NIP_DIMENSIONALITY(model->out_clique->p), nvars);
+  if(!mapping){
+    free(cardinality);
+    return NIP_ERROR_OUTOFMEMORY;
+  }
+  nip_mapping_strides(model->out_clique->p, cardinality, mapping, nvars, 
+		      model->out_clique_stride);
+  free(mapping);
+
+  free(cardinality);
+  return NIP_NO_ERROR;
+}
+
+
+/* Probability mass of the first time slice with only the priors 
+ * entered. One collect phase is enough to compute it. This depends only 
+ * on the model parameters: kept until total_reset(). Resets the model, 
+ * unless already known. */
+static double prior_mass(nip_model model){
+  if(model->prior_mass >= 0)
+    return model->prior_mass;
+  reset_timeslice(model, !NIP_HAD_A_PREVIOUS_TIMESLICE);
+  if(nip_collect_schedule(model->schedule) != NIP_NO_ERROR){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+    return 0;
+  }
+  model->prior_mass = nip_schedule_mass(model->schedule);
+  return model->prior_mass;
+}
+
+
+/* Computes model->prior_interface_mass: probability mass of a subsequent 
+ * time slice without evidence, for each state of I_{t-1}->. 
+ * This depends only on the model parameters: kept until total_reset(). 
+ * Resets the model, unless already known. */
+static int prior_interface_mass(nip_model model){
+  int e;
+  if(model->prior_interface_known)
+    return NIP_NO_ERROR;
+  reset_timeslice(model, NIP_HAD_A_PREVIOUS_TIMESLICE);
+  if(model->outgoing_interface_size == 0){
+    if(nip_collect_schedule(model->schedule) != NIP_NO_ERROR)
+      return nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+    model->prior_interface_mass->data[0] = 
+      nip_schedule_mass(model->schedule);
+    model->prior_interface_known = 1;
+    return NIP_NO_ERROR;
+  }
+  make_consistent(model);
+  e = nip_strided_marginalise(model->in_clique->p, 
+			      model->prior_interface_mass, 
+			      model->in_clique_stride);
+  if(e == NIP_NO_ERROR)
+    model->prior_interface_known = 1;
+  return e;
+}
+
+
+/* Probability mass of a time slice without evidence, given the 
+ * (normalised) message alpha from the previous time slice */
+static double interface_mass(nip_model model, nip_potential alpha){
+  int i;
+  double m = 0;
+  for(i = 0; i < alpha->size_of_data; i++)
+    m += alpha->data[i] * model->prior_interface_mass->data[i];
+  return m;
+}
+
+
 /* Starts a message pass between timeslices */
 static int start_timeslice_message_pass(nip_model model, 
 						   nip_direction dir,
 					 nip_potential alpha_or_gamma){
-  int* mapping;
   nip_clique c;
+  int* stride;
   int nvars = model->outgoing_interface_size;
-  nip_variable* vars;
 
   /* What if there are no subsequent time slices? */
   if(nvars == 0){
@@ -1043,20 +1400,19 @@ static int start_timeslice_message_pass(nip_model model,
   }
 
   if(dir == FORWARD){
-    vars = model->outgoing_interface;
     c = model->out_clique;
+    stride = model->out_clique_stride;
   }
   else{
-    vars = model->previous_outgoing_interface;
     c = model->in_clique;
+    stride = model->in_clique_stride;
   }
 
-  /* map the variables */
-  mapping = nip_mapper(c->variables, vars, NIP_DIMENSIONALITY(c->p), nvars);
-
-  /* the marginalisation */
-  nip_general_marginalise(c->p, alpha_or_gamma, mapping);
-  free(mapping); /* should mapping-array be a part of sepsets? */
+  /* the marginalisation (of the slice with evidence) */
+  if(c->sliced > 0)
+    nip_sliced_marginalise(c->p, alpha_or_gamma, stride, c->slice);
+  else
+    nip_parallel_marginalise(model->pool, c->p, alpha_or_gamma, stride);
 
   /* normalisation in order to avoid drifting towards zeros */
   nip_normalise_potential(alpha_or_gamma);
@@ -1070,67 +1426,332 @@ static int finish_timeslice_message_pass(nip_model model,
 						    nip_direction dir,
 						    nip_potential num, 
 						    nip_potential den){
-  int* mapping;
   nip_clique c;
+  int* stride;
   int nvars = model->outgoing_interface_size;
-  nip_variable* vars;
 
   if(nvars == 0) /* independent time slices (multiplication with 1) */
     return NIP_NO_ERROR;
 
   /* Find a suitable clique c */
   if(dir == FORWARD){
-    vars = model->previous_outgoing_interface;
     c = model->in_clique;
+    stride = model->in_clique_stride;
   }
   else{
-    vars = model->outgoing_interface;
     c = model->out_clique;
+    stride = model->out_clique_stride;
   }
 
-  /* map the variables */
-  mapping = nip_mapper(c->variables, vars, NIP_DIMENSIONALITY(c->p), nvars);
-
   /* the multiplication (and division, if den != NULL) */
-  nip_update_potential(num, den, c->p, mapping);
-  free(mapping);  
+  nip_sliced_update(num, den, c->p, stride, c->slice);
+  c->dirty = 1;
+  model->evidence_epoch++;
   return NIP_NO_ERROR;
 }
 
 
-/* forward-only inference consumes constant (1 time slice) amount of memory 
- * + the results (which is linear) */
-uncertain_series forward_inference(time_series ts, nip_variable vars[], 
-				   int nvars, double* loglikelihood){
-  int i, t;
-  int* cardinalities = NULL;
-  double m1, m2;
-  nip_variable temp;
-  nip_potential alpha = NULL;
-  nip_clique clique_of_interest;
-  uncertain_series results = NULL;
-  nip_model model = ts->model;
+static void free_transfer_cache(nip_transfer_cache c){
+  if(!c)
+    return;
+  if(c->rows && c->tables && c->hash)
+    empty_transfer_cache(c);
+  free(c->offset);
+  free(c->rows);
+  free(c->tables);
+  free(c->hash);
+  free(c);
+}
 
-  
-  /* Allocate an array */
-  if(model->outgoing_interface_size > 0){
-    cardinalities = (int*) calloc(model->outgoing_interface_size, 
-				  sizeof(int));
-    if(!cardinalities){
-      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-      return NULL;
+
+/* Forgets the compiled time slices, e.g. when the parameters change */
+static void empty_transfer_cache(nip_transfer_cache c){
+  int i;
+  if(!c)
+    return;
+  for(i = 0; i < c->num_of_rows; i++){
+    free(c->rows[i]);
+    free(c->tables[i]);
+  }
+  c->num_of_rows = 0;
+  for(i = 0; i < c->hash_size; i++)
+    c->hash[i] = -1;
+}
+
+
+/* Finds the index of each variable in model->variables, or -1. 
+ * Returns the number of variables not found. */
+static int variable_indices(nip_model model, nip_variable vars[], int n, 
+			    int index[]){
+  int i, j;
+  int missing = n;
+  for(i = 0; i < n; i++){
+    index[i] = -1;
+    for(j = 0; j < model->num_of_vars && index[i] < 0; j++){
+      if(model->variables[j] == vars[i]){
+	index[i] = j;
+	missing--;
+      }
     }
   }
+  return missing;
+}
 
-  /* Fill the array */
+
+/* Compiles a time slice (not the first one) with the observations in 
+ * key: the state of each variable, or -1. For each state i of 
+ * I_{t-1}-> and j of I_{t}->, the probability mass goes in 
+ * table[i*S + j], and the distributions of the variables multiplied 
+ * by it in table[S*S + S*width + (i*S + j)*width + ...]. The sums of 
+ * the latter over j are in table[S*S + i*width + ...], for the 
+ * forward phase. Resets the model. */
+static int compile_transfer(nip_model model, int* key, double* table){
+  int i, j, k, n, e;
+  int cardinalities[model->outgoing_interface_size + 1];
+  nip_transfer_cache c = model->transfer_cache;
+  int size = c->size;
+  double mass;
+  double* marginal = table + c->size * c->size;
+  double* joint = marginal + c->size * c->width;
+  double* distribution[model->num_of_vars + 1];
+  nip_variable vars[model->num_of_vars + 1];
+  int states[model->num_of_vars + 1];
+  nip_potential alpha, gamma;
+
+  n = 0;
+  for(k = 0; k < model->num_of_vars; k++){
+    if(key[k] >= 0){
+      vars[n] = model->variables[k];
+      states[n++] = key[k];
+    }
+  }
   for(i = 0; i < model->outgoing_interface_size; i++)
     cardinalities[i] = NIP_CARDINALITY(model->outgoing_interface[i]);
+  alpha = nip_new_potential(cardinalities, model->outgoing_interface_size, 
+			    NULL);
+  gamma = nip_new_potential(cardinalities, model->outgoing_interface_size, 
+			    NULL);
+  if(!(alpha && gamma)){
+    nip_free_potential(alpha);
+    nip_free_potential(gamma);
+    return nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+  }
+
+  e = NIP_NO_ERROR;
+  for(i = 0; i < size && e == NIP_NO_ERROR; i++){
+    for(j = 0; j < size && e == NIP_NO_ERROR; j++){
+      /* I_{t-1}-> = i and I_{t}-> = j as the messages */
+      reset_timeslice(model, NIP_HAD_A_PREVIOUS_TIMESLICE);
+      nip_uniform_potential(alpha, 0.0);
+      alpha->data[i] = 1.0;
+      nip_uniform_potential(gamma, 0.0);
+      gamma->data[j] = 1.0;
+      e = finish_timeslice_message_pass(model, FORWARD, alpha, NULL);
+      if(e == NIP_NO_ERROR)
+	e = finish_timeslice_message_pass(model, BACKWARD, gamma, NULL);
+      if(e == NIP_NO_ERROR)
+	e = insert_evidence_batch(model, vars, states, n);
+      if(e != NIP_NO_ERROR)
+	break;
+      make_consistent(model);
+
+      mass = nip_schedule_mass(model->schedule);
+      if(mass <= 0)
+	continue; /* zeros */
+      table[i * size + j] = mass;
+      for(k = 0; k < model->num_of_vars; k++)
+	distribution[k] = joint + (i * size + j) * c->width + c->offset[k];
+      e = get_probabilities(model, model->variables, model->num_of_vars, 
+			    distribution);
+      for(k = 0; k < c->width; k++){
+	distribution[0][k] *= mass;
+	marginal[i * c->width + k] += distribution[0][k];
+      }
+    }
+  }
+  nip_free_potential(alpha);
+  nip_free_potential(gamma);
+  reset_timeslice(model, NIP_HAD_A_PREVIOUS_TIMESLICE);
+  if(e != NIP_NO_ERROR)
+    return nip_report_error(__FILE__, __LINE__, e, 1);
+  return NIP_NO_ERROR;
+}
+
+
+/* The compiled time slice for the observations in key (see 
+ * compile_transfer()), compiled now if not met before. NULL if not 
+ * available: no cache, a full cache, or an error. */
+static double* cached_timeslice(nip_model model, int* key){
+  int i, r;
+  int n = model->num_of_vars;
+  unsigned int h = 0;
+  nip_transfer_cache c = model->transfer_cache;
+
+  if(!c)
+    return NULL;
+  for(i = 0; i < n; i++)
+    h = 31 * h + key[i] + 1;
+  h &= c->hash_size - 1;
+  while((r = c->hash[h]) >= 0){
+    if(memcmp(c->rows[r], key, n * sizeof(int)) == 0)
+      return c->tables[r];
+    h = (h + 1) & (c->hash_size - 1);
+  }
+  if(c->num_of_rows >= c->capacity)
+    return NULL; /* the join tree will do */
+
+  r = c->num_of_rows;
+  c->rows[r] = (int*) malloc((n + 1) * sizeof(int));
+  c->tables[r] = (double*) calloc(c->size * (c->size + c->width + 
+					     c->size * c->width), 
+				  sizeof(double));
+  if(!(c->rows[r] && c->tables[r]) || 
+     compile_transfer(model, key, c->tables[r]) != NIP_NO_ERROR){
+    free(c->rows[r]);
+    free(c->tables[r]);
+    return NULL;
+  }
+  memcpy(c->rows[r], key, n * sizeof(int));
+  c->hash[h] = r;
+  c->num_of_rows++;
+  return c->tables[r];
+}
+
+
+/* The compiled time slice for step t of ts, given the index of each 
+ * observed variable in model->variables (-1 if ignored) */
+static double* cached_ts_step(time_series ts, int t, int* observed){
+  int i;
+  int key[ts->model->num_of_vars + 1];
+
+  if(!ts->model->transfer_cache)
+    return NULL;
+  for(i = 0; i < ts->model->num_of_vars; i++)
+    key[i] = -1;
+  for(i = 0; i < ts->num_of_observed; i++)
+    if(observed[i] >= 0)
+      key[observed[i]] = ts->data[t][i];
+  return cached_timeslice(ts->model, key);
+}
+
+
+/* One step of forward inference with a compiled time slice: replaces 
+ * the (normalised) message alpha with the next one, writes the 
+ * distributions of the variables (index[k] in model->variables), and 
+ * returns the probability mass of the step */
+static double compiled_forward(nip_transfer_cache c, double* table, 
+			       double* alpha, int nvars, int* index, 
+			       double** results){
+  int i, j, k, x;
+  int size = c->size;
+  int card;
+  double m = 0;
+  double sum;
+  double* d;
+  double next[size];
+
+  for(j = 0; j < size; j++)
+    next[j] = 0;
+  for(i = 0; i < size; i++)
+    for(j = 0; j < size; j++)
+      next[j] += alpha[i] * table[i * size + j];
+  for(j = 0; j < size; j++)
+    m += next[j];
+
+  for(k = 0; k < nvars; k++){
+    card = c->offset[index[k] + 1] - c->offset[index[k]];
+    for(x = 0; x < card; x++)
+      results[k][x] = 0;
+    for(i = 0; i < size; i++){
+      d = table + size * size + i * c->width + c->offset[index[k]];
+      for(x = 0; x < card; x++)
+	results[k][x] += alpha[i] * d[x];
+    }
+    sum = 0;
+    for(x = 0; x < card; x++)
+      sum += results[k][x];
+    if(sum > 0)
+      for(x = 0; x < card; x++)
+	results[k][x] /= sum;
+  }
+
+  /* normalisation in order to avoid drifting towards zeros */
+  for(j = 0; j < size; j++)
+    alpha[j] = (m > 0) ? next[j] / m : 0;
+  return m;
+}
+
+
+/* One step of the backward phase with a compiled time slice: given 
+ * the forward messages into and out of the step, and the message 
+ * gamma_in from the future (NULL at the end), writes the smoothed 
+ * distributions of the variables and the message to the past */
+static void compiled_backward(nip_transfer_cache c, double* table, 
+			      double* alpha_in, double* alpha_out, 
+			      double* gamma_in, double* gamma_out, 
+			      int nvars, int* index, double** results){
+  int i, j, k, x;
+  int size = c->size;
+  int card;
+  double sum, weight;
+  double* d;
+  double* joint = table + size * size + size * c->width;
+  double ratio[size], past[size];
+
+  /* what the future adds to the forward message */
+  for(j = 0; j < size; j++){
+    ratio[j] = 1;
+    if(gamma_in)
+      ratio[j] = (alpha_out[j] > 0) ? gamma_in[j] / alpha_out[j] : 0;
+  }
+
+  for(k = 0; k < nvars; k++){
+    card = c->offset[index[k] + 1] - c->offset[index[k]];
+    for(x = 0; x < card; x++)
+      results[k][x] = 0;
+  }
+  for(i = 0; i < size; i++){
+    past[i] = 0;
+    for(j = 0; j < size; j++){
+      weight = alpha_in[i] * ratio[j];
+      past[i] += weight * table[i * size + j];
+      if(weight == 0)
+	continue;
+      for(k = 0; k < nvars; k++){
+	card = c->offset[index[k] + 1] - c->offset[index[k]];
+	d = joint + (i * size + j) * c->width + c->offset[index[k]];
+	for(x = 0; x < card; x++)
+	  results[k][x] += weight * d[x];
+      }
+    }
+  }
+  for(k = 0; k < nvars; k++){
+    card = c->offset[index[k] + 1] - c->offset[index[k]];
+    sum = 0;
+    for(x = 0; x < card; x++)
+      sum += results[k][x];
+    if(sum > 0)
+      for(x = 0; x < card; x++)
+	results[k][x] /= sum;
+  }
+
+  sum = 0;
+  for(i = 0; i < size; i++)
+    sum += past[i];
+  for(i = 0; i < size; i++)
+    gamma_out[i] = (sum > 0) ? past[i] / sum : 0;
+}
+
+
+/* Allocates the results of inference for each time step of ts */
+static uncertain_series new_results(time_series ts, nip_variable vars[], 
+				    int nvars){
+  int i, t;
+  uncertain_series results = NULL;
 
-  /* Allocate some space for the results */
   results = (uncertain_series) malloc(sizeof(uncertain_series_struct));
   if(!results){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-    free(cardinalities);
     return NULL;
   }
   
@@ -1138,79 +1759,127 @@ uncertain_series forward_inference(time_series ts, nip_variable vars[],
   if(!results->variables){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
     free(results);
-    free(cardinalities);
     return NULL;
   }
 
   /* Copy the references to the variables of interest */
   memcpy(results->variables, vars, nvars*sizeof(nip_variable));
   results->num_of_vars = nvars;
-  results->length = ts->length;
+  results->length = 0; /* so far */
 
   results->data = (double***) calloc(ts->length, sizeof(double**));
   if(!results->data){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
     free(results->variables);
     free(results);
-    free(cardinalities);
     return NULL;
   }
   
-  for(t = 0; t < results->length; t++){
+  for(t = 0; t < ts->length; t++){
     results->data[t] = (double**) calloc(nvars, sizeof(double*));
     if(!results->data[t]){
       nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-      while(t > 0){
-	t--;
-	for(i = 0; i < nvars; i++)
-	  free(results->data[t][i]);
-	free(results->data[t]);
-      }
-      free(results->data); /* t == -1 */
-      free(results->variables);
-      free(results);
-      free(cardinalities);
+      free_uncertainseries(results);
       return NULL;
     }
+    results->length = t + 1; /* free_uncertainseries() can handle it */
 
     for(i = 0; i < nvars; i++){
       results->data[t][i] = (double*) calloc(NIP_CARDINALITY(vars[i]),
 					     sizeof(double));
       if(!results->data[t][i]){
 	nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-	while(i > 0)
-	  free(results->data[t][--i]);
-	free(results->data[t]);
-	while(t > 0){
-	  t--;
-	  for(i = 0; i < nvars; i++)
-	    free(results->data[t][i]);
-	  free(results->data[t]);
-	}
-	free(results->data);
-	free(results->variables); /* t == -1 */
-	free(results);
-	free(cardinalities);
+	free_uncertainseries(results);
 	return NULL;
       }
     }
   }
+  return results;
+}
+
+
+/* forward-only inference consumes constant (1 time slice) amount of memory 
+ * + the results (which is linear) */
+uncertain_series forward_inference(time_series ts, nip_variable vars[], 
+				   int nvars, double* loglikelihood){
+  int i, t;
+  int* cardinalities = NULL;
+  double m1 = 0, m2;
+  double mass_first = 0;
+  double* table = NULL;
+  int compiled;
+  int observed[ts->num_of_observed + 1];
+  int index[nvars + 1];
+  nip_potential alpha = NULL;
+  uncertain_series results = NULL;
+  nip_model model = ts->model;
+
+  
+  /* Allocate some space for the results */
+  results = new_results(ts, vars, nvars);
+  if(!results)
+    return NULL;
+
+  /* Allocate an array */
+  if(model->outgoing_interface_size > 0){
+    cardinalities = (int*) calloc(model->outgoing_interface_size, 
+				  sizeof(int));
+    if(!cardinalities){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+      free_uncertainseries(results);
+      return NULL;
+    }
+  }
+
+  /* Fill the array */
+  for(i = 0; i < model->outgoing_interface_size; i++)
+    cardinalities[i] = NIP_CARDINALITY(model->outgoing_interface[i]);
 
   /* Initialise the intermediate potential */
   alpha = nip_new_potential(cardinalities, model->outgoing_interface_size, 
 			    NULL);
   free(cardinalities);
 
+  /* Probability mass before any evidence: the priors at t == 0 
+   * and the priors of the other time slices for each alpha state */
+  if(loglikelihood){
+    mass_first = prior_mass(model);
+    prior_interface_mass(model);
+  }
+
   /*****************/
   /* Forward phase */
   /*****************/
-  reset_model(model);
-  use_priors(model, !NIP_HAD_A_PREVIOUS_TIMESLICE);
+  reset_timeslice(model, !NIP_HAD_A_PREVIOUS_TIMESLICE);
   if(loglikelihood)
     *loglikelihood = 0; /* init */
 
+  /* Which variables the compiled time slices have, if any */
+  variable_indices(model, ts->observed, ts->num_of_observed, observed);
+  for(i = 0; i < ts->num_of_observed; i++)
+    if(!(NIP_MARK(ts->observed[i]) & NIP_MARK_ON))
+      observed[i] = -1;
+  compiled = (variable_indices(model, vars, nvars, index) == 0);
+
   for(t = 0; t < ts->length; t++){ /* FOR EVERY TIMESLICE */
 
+    /* Matrix-vector products instead of a propagation? */
+    if(t > 0 && compiled)
+      table = cached_ts_step(ts, t, observed);
+    if(table){
+      if(loglikelihood)
+	m1 = interface_mass(model, alpha);
+      m2 = compiled_forward(model->transfer_cache, table, alpha->data, 
+			    results->num_of_vars, index, results->data[t]);
+      if(loglikelihood){
+	if((m1 > 0) && (m2 > 0))
+	  *loglikelihood = (*loglikelihood) + (log(m2) - log(m1));
+	if(m2 == 0)
+	  *loglikelihood = -DBL_MAX;
+      }
+      continue;
+    }
+
     /* Original order (pre-10.07.2006):
      * - m1
      * - evidence in
@@ -1230,10 +1899,12 @@ uncertain_series forward_inference(time_series ts, nip_variable vars[],
       }
     }
     
-    /* Likelihood reference... */
+    /* Likelihood reference (no need for a propagation) */
     if(loglikelihood){
-      make_consistent(model);
-      m1 = model_prob_mass(model);
+      if(t > 0)
+	m1 = interface_mass(model, alpha);
+      else
+	m1 = mass_first;
     }
 
     /* Put some data in */
@@ -1246,7 +1917,7 @@ uncertain_series forward_inference(time_series ts, nip_variable vars[],
     if(loglikelihood){
       /* Q: Is this L(y(t) | y(0:t-1)) 
        * A: Yes... */
-      m2 = model_prob_mass(model);
+      m2 = nip_schedule_mass(model->schedule);
       if((m1 > 0) && (m2 > 0)){
 	*loglikelihood = (*loglikelihood) + (log(m2) - log(m1));
       }
@@ -1269,24 +1940,14 @@ uncertain_series forward_inference(time_series ts, nip_variable vars[],
 #endif
     }
 
-    /* Write the results */
-    for(i = 0; i < results->num_of_vars; i++){      
-      /* 1. Decide which variable you are interested in */
-      temp = results->variables[i];
-      
-      /* 2. Find the clique that contains the family of 
-       *    the interesting variable */
-      clique_of_interest = nip_find_family(model->cliques, 
-					   model->num_of_cliques, 
-					   temp);
-      assert(clique_of_interest != NULL);
-      
-      /* 3. Marginalisation (the memory must have been allocated) */
-      nip_marginalise_clique(clique_of_interest, temp, results->data[t][i]);
-      
-      /* 4. Normalisation */
-      nip_normalise_array(results->data[t][i], NIP_CARDINALITY(temp));
-    } 
+    /* Write the results (the memory must have been allocated) */
+    if(get_probabilities(model, results->variables, results->num_of_vars, 
+			 results->data[t]) != NIP_NO_ERROR){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+      free_uncertainseries(results);
+      nip_free_potential(alpha);
+      return NULL;
+    }
 
     /* Start a message pass between time slices (compute new alpha) */
     if(start_timeslice_message_pass(model, FORWARD, 
@@ -1306,8 +1967,7 @@ uncertain_series forward_inference(time_series ts, nip_variable vars[],
 #endif
    
     /* Forget old evidence */
-    reset_model(model);
-    use_priors(model, NIP_HAD_A_PREVIOUS_TIMESLICE);
+    reset_timeslice(model, NIP_HAD_A_PREVIOUS_TIMESLICE);
   }
   nip_free_potential(alpha); 
 
@@ -1315,268 +1975,1071 @@ uncertain_series forward_inference(time_series ts, nip_variable vars[],
 }
 
 
-/* This consumes much more memory depending on the size of the 
- * sepsets between time slices. */
-uncertain_series forward_backward_inference(time_series ts,
-					    nip_variable vars[], int nvars,
-					    double* loglikelihood){
-  int i, t;
-  int *cardinalities = NULL;
-  double m1, m2;
-  nip_variable temp;
-  nip_potential *alpha_gamma = NULL;
-  nip_clique clique_of_interest;
-  uncertain_series results = NULL;
-  nip_model model = ts->model;
-
-  /* Allocate an array for describing the dimensions of timeslice sepsets */
-  if(model->outgoing_interface_size > 0){
-    cardinalities = (int*) calloc(model->outgoing_interface_size, sizeof(int));
-    if(!cardinalities){
-      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-      return NULL;
+/* Distinct rows of (marked) observations: row[t] for t > 0 is the index 
+ * of the row in first[], which tells where the row occurred first. 
+ * Returns the number of distinct rows, or -1 if out of memory. */
+static int distinct_rows(time_series ts, int* row, int* first){
+  int i, t, n = 0;
+  unsigned int h, size = 1;
+  int* table = NULL;
+  int nobs = ts->num_of_observed;
+  char marked[nobs + 1];
+
+  for(i = 0; i < nobs; i++)
+    marked[i] = (NIP_MARK(ts->observed[i]) & NIP_MARK_ON) ? 1 : 0;
+
+  /* open addressing: a table at least twice as big as the set */
+  while(size < 2 * (unsigned int)ts->length)
+    size *= 2;
+  table = (int*) malloc(size * sizeof(int));
+  if(!table)
+    return -1;
+  for(h = 0; h < size; h++)
+    table[h] = -1;
+
+  for(t = 1; t < ts->length; t++){
+    h = 0;
+    for(i = 0; i < nobs; i++)
+      if(marked[i])
+	h = 31 * h + ts->data[t][i] + 1;
+    h &= size - 1;
+    while(table[h] >= 0){
+      for(i = 0; i < nobs; i++)
+	if(marked[i] && ts->data[t][i] != ts->data[first[table[h]]][i])
+	  break;
+      if(i == nobs)
+	break; /* the same row */
+      h = (h + 1) & (size - 1);
+    }
+    if(table[h] < 0){
+      table[h] = n;
+      first[n++] = t;
     }
+    row[t] = table[h];
   }
+  free(table);
+  return n;
+}
 
-  /* Fill the array */
-  for(i = 0; i < model->outgoing_interface_size; i++)
+
+/* Compiles time slice t of ts into a matrix: transfer[i*S + j] is the 
+ * (unnormalised) message to state j of I_{t}-> when I_{t-1}-> is in 
+ * state i, mass[i] its sum, and marginals[i*width + ...] the 
+ * unnormalised distributions of the variables of interest. 
+ * Uses alpha as a work space, and leaves evidence in the model. */
+static int compile_timeslice(time_series ts, int t, 
+			     nip_variable vars[], int nvars, 
+			     nip_potential alpha, double* mass, 
+			     double* transfer, double* marginals){
+  int i, j, k, e, width;
+  int size = alpha->size_of_data;
+  double* distribution[nvars + 1];
+  nip_model model = ts->model;
+
+  for(i = 0; i < size; i++){
+    reset_timeslice(model, NIP_HAD_A_PREVIOUS_TIMESLICE);
+    nip_uniform_potential(alpha, 0.0);
+    alpha->data[i] = 1.0;
+    e = finish_timeslice_message_pass(model, FORWARD, alpha, NULL);
+    if(e == NIP_NO_ERROR)
+      e = insert_ts_step(ts, t, model, NIP_MARK_ON);
+    if(e != NIP_NO_ERROR)
+      return nip_report_error(__FILE__, __LINE__, e, 1);
+    make_consistent(model);
+
+    mass[i] = nip_schedule_mass(model->schedule);
+    width = 0;
+    for(k = 0; k < nvars; k++){
+      distribution[k] = marginals + width;
+      width += NIP_CARDINALITY(vars[k]);
+    }
+    if(mass[i] <= 0){ /* impossible evidence given state i */
+      mass[i] = 0;
+      memset(transfer, 0, size * sizeof(double));
+      memset(marginals, 0, width * sizeof(double));
+    }
+    else{
+      e = get_probabilities(model, vars, nvars, distribution);
+      if(e == NIP_NO_ERROR)
+	e = start_timeslice_message_pass(model, FORWARD, alpha);
+      if(e != NIP_NO_ERROR)
+	return nip_report_error(__FILE__, __LINE__, e, 1);
+      for(j = 0; j < size; j++)
+	transfer[j] = mass[i] * alpha->data[j];
+      for(k = 0; k < width; k++)
+	marginals[k] *= mass[i];
+    }
+    transfer += size;
+    marginals += width;
+  }
+  return NIP_NO_ERROR;
+}
+
+
+/* Multiplies the matrices of chunk c into one, normalised in order to 
+ * avoid drifting towards zeros */
+static int scan_chunk_transfer(void* data, int c){
+  scan_workspace* w = (scan_workspace*) data;
+  int i, j, k, t;
+  int size = w->size;
+  int first = 1 + c * w->chunk;
+  int end = (first + w->chunk < w->length) ? first + w->chunk : w->length;
+  double* p = w->product + c * size * size;
+  double* m;
+  double x, sum;
+  double tmp[size * size];
+
+  memcpy(p, w->transfer + w->row[first] * size * size, 
+	 size * size * sizeof(double));
+  for(t = first + 1; t < end; t++){
+    m = w->transfer + w->row[t] * size * size;
+    sum = 0;
+    for(i = 0; i < size; i++){
+      for(j = 0; j < size; j++){
+	x = 0;
+	for(k = 0; k < size; k++)
+	  x += p[i * size + k] * m[k * size + j];
+	tmp[i * size + j] = x;
+	sum += x;
+      }
+    }
+    if(sum > 0)
+      for(i = 0; i < size * size; i++)
+	tmp[i] /= sum;
+    memcpy(p, tmp, size * size * sizeof(double));
+  }
+  return 0;
+}
+
+
+/* Computes the results of each step of chunk c, given the message 
+ * into the chunk */
+static int scan_chunk_results(void* data, int c){
+  scan_workspace* w = (scan_workspace*) data;
+  int i, j, k, n, t, width;
+  int size = w->size;
+  int first = 1 + c * w->chunk;
+  int end = (first + w->chunk < w->length) ? first + w->chunk : w->length;
+  double *mass, *m, *marginals, *result;
+  double m1, m2, x, sum;
+  double alpha[size], next[size];
+
+  memcpy(alpha, w->alpha + c * size, size * sizeof(double));
+  w->loglikelihood[c] = 0;
+  w->impossible[c] = 0;
+  for(t = first; t < end; t++){
+    mass = w->mass + w->row[t] * size;
+    m = w->transfer + w->row[t] * size * size;
+    marginals = w->marginals + w->row[t] * size * w->width;
+
+    /* L(y(t) | y(0:t-1)) as in forward_inference() */
+    m1 = 0;
+    m2 = 0;
+    for(i = 0; i < size; i++){
+      m1 += alpha[i] * w->prior[i];
+      m2 += alpha[i] * mass[i];
+    }
+    if((m1 > 0) && (m2 > 0))
+      w->loglikelihood[c] += log(m2) - log(m1);
+    if(m2 == 0){
+      w->loglikelihood[c] = 0; /* only the steps after this count */
+      w->impossible[c] = 1;
+    }
+
+    /* the mixture of the distributions given each state of alpha */
+    width = 0;
+    for(n = 0; n < w->results->num_of_vars; n++){
+      result = w->results->data[t][n];
+      sum = 0;
+      for(k = 0; k < NIP_CARDINALITY(w->results->variables[n]); k++){
+	x = 0;
+	for(i = 0; i < size; i++)
+	  x += alpha[i] * marginals[i * w->width + width + k];
+	result[k] = x;
+	sum += x;
+      }
+      if(sum > 0)
+	for(k = 0; k < NIP_CARDINALITY(w->results->variables[n]); k++)
+	  result[k] /= sum;
+      width += NIP_CARDINALITY(w->results->variables[n]);
+    }
+
+    /* the message to the next step */
+    sum = 0;
+    for(j = 0; j < size; j++){
+      x = 0;
+      for(i = 0; i < size; i++)
+	x += alpha[i] * m[i * size + j];
+      next[j] = x;
+      sum += x;
+    }
+    for(j = 0; j < size; j++)
+      alpha[j] = (sum > 0) ? next[j] / sum : 0;
+  }
+  return 0;
+}
+
+
+/* Runs the scan after compiling the distinct rows of observations 
+ * (first[i] is where row i occurs first) */
+static int forward_scan(time_series ts, scan_workspace* w, int* first, 
+			int n, nip_potential alpha, double* loglikelihood){
+  int i, j, k, c, e, compiled, card, width;
+  int size = w->size;
+  int nvars = w->results->num_of_vars;
+  int observed[ts->num_of_observed + 1];
+  int index[nvars + 1];
+  double m2, x, sum;
+  double mass_first = 0;
+  double *a, *p, *table, *marginals;
+  nip_model model = ts->model;
+  nip_transfer_cache cache = model->transfer_cache;
+  uncertain_series results = w->results;
+
+  /* Probability mass before any evidence, as in forward_inference() */
+  if(loglikelihood)
+    mass_first = prior_mass(model);
+  e = prior_interface_mass(model);
+  if(e != NIP_NO_ERROR)
+    return nip_report_error(__FILE__, __LINE__, e, 1);
+  memcpy(w->prior, model->prior_interface_mass->data, size * sizeof(double));
+
+  /* The time slices compiled by set_transfer_cache() will do, 
+   * since alpha goes through them in the same way */
+  variable_indices(model, ts->observed, ts->num_of_observed, observed);
+  for(i = 0; i < ts->num_of_observed; i++)
+    if(!(NIP_MARK(ts->observed[i]) & NIP_MARK_ON))
+      observed[i] = -1;
+  compiled = (variable_indices(model, results->variables, nvars, index) == 0);
+
+  /* Compile the time slices */
+  for(i = 0; i < n; i++){
+    table = (compiled ? cached_ts_step(ts, first[i], observed) : NULL);
+    if(table){
+      memcpy(w->transfer + i * size * size, table, 
+	     size * size * sizeof(double));
+      marginals = w->marginals + i * size * w->width;
+      for(j = 0; j < size; j++){
+	w->mass[i * size + j] = 0;
+	for(k = 0; k < size; k++)
+	  w->mass[i * size + j] += table[j * size + k];
+	width = 0;
+	for(k = 0; k < nvars; k++){
+	  card = cache->offset[index[k] + 1] - cache->offset[index[k]];
+	  memcpy(marginals + j * w->width + width, 
+		 (table + size * size + j * cache->width + 
+		  cache->offset[index[k]]), card * sizeof(double));
+	  width += card;
+	}
+      }
+      continue;
+    }
+    e = compile_timeslice(ts, first[i], 
+			  results->variables, results->num_of_vars, alpha, 
+			  w->mass + i * size, 
+			  w->transfer + i * size * size, 
+			  w->marginals + i * size * w->width);
+    if(e != NIP_NO_ERROR)
+      return nip_report_error(__FILE__, __LINE__, e, 1);
+  }
+
+  /* The first time step with the join tree */
+  reset_timeslice(model, !NIP_HAD_A_PREVIOUS_TIMESLICE);
+  e = insert_ts_step(ts, 0, model, NIP_MARK_ON);
+  if(e != NIP_NO_ERROR)
+    return nip_report_error(__FILE__, __LINE__, e, 1);
+  make_consistent(model);
+  m2 = nip_schedule_mass(model->schedule);
+  e = get_probabilities(model, results->variables, results->num_of_vars, 
+			results->data[0]);
+  if(e == NIP_NO_ERROR)
+    e = start_timeslice_message_pass(model, FORWARD, alpha);
+  if(e != NIP_NO_ERROR)
+    return nip_report_error(__FILE__, __LINE__, e, 1);
+  memcpy(w->alpha, alpha->data, size * sizeof(double));
+
+  /* 1. The product of each chunk, in parallel */
+  e = nip_parallel_for(model->pool, scan_chunk_transfer, w, w->num_of_chunks);
+  if(e != NIP_NO_ERROR)
+    return nip_report_error(__FILE__, __LINE__, e, 1);
+
+  /* 2. The messages between the chunks, in order */
+  for(c = 0; c < w->num_of_chunks; c++){
+    a = w->alpha + c * size;
+    p = w->product + c * size * size;
+    sum = 0;
+    for(j = 0; j < size; j++){
+      x = 0;
+      for(i = 0; i < size; i++)
+	x += a[i] * p[i * size + j];
+      a[size + j] = x;
+      sum += x;
+    }
+    for(j = 0; j < size; j++)
+      a[size + j] = (sum > 0) ? a[size + j] / sum : 0;
+  }
+
+  /* 3. The steps of each chunk, in parallel */
+  e = nip_parallel_for(model->pool, scan_chunk_results, w, w->num_of_chunks);
+  if(e != NIP_NO_ERROR)
+    return nip_report_error(__FILE__, __LINE__, e, 1);
+
+  /* The log. likelihood in the order of time */
+  if(loglikelihood){
+    *loglikelihood = 0;
+    if((mass_first > 0) && (m2 > 0))
+      *loglikelihood = log(m2) - log(mass_first);
+    if(m2 == 0)
+      *loglikelihood = -DBL_MAX;
+    for(c = 0; c < w->num_of_chunks; c++){
+      if(w->impossible[c])
+	*loglikelihood = -DBL_MAX;
+      *loglikelihood += w->loglikelihood[c];
+    }
+  }
+  return NIP_NO_ERROR;
+}
+
+
+/* Forward inference as a prefix scan: the first step is computed with 
+ * the join tree, and each of the others is a product of alpha and the 
+ * compiled matrix of its observations */
+uncertain_series forward_inference_scan(time_series ts, nip_variable vars[],
+					int nvars, double* loglikelihood){
+  int i, e;
+  int n = 0;
+  int size = 1;
+  int cardinalities[ts->model->outgoing_interface_size + 1];
+  int* first = NULL;
+  nip_potential alpha = NULL;
+  scan_workspace w;
+  nip_model model = ts->model;
+
+  for(i = 0; i < model->outgoing_interface_size; i++){
     cardinalities[i] = NIP_CARDINALITY(model->outgoing_interface[i]);
+    if(size <= MAX_TRANSFER_SIZE)
+      size *= cardinalities[i];
+  }
+  if(size > MAX_TRANSFER_SIZE || ts->length < 2)
+    return forward_inference(ts, vars, nvars, loglikelihood);
+
+  memset(&w, 0, sizeof(scan_workspace));
+  w.size = size;
+  w.length = ts->length;
+  w.chunk = SCAN_CHUNK_LENGTH;
+  w.num_of_chunks = (ts->length - 1 + w.chunk - 1) / w.chunk;
+  for(i = 0; i < nvars; i++)
+    w.width += NIP_CARDINALITY(vars[i]);
+
+  /* Is it worth the trouble? Compiling costs <size> propagations 
+   * per distinct row, instead of one per time step. */
+  w.row = (int*) calloc(ts->length, sizeof(int));
+  first = (int*) calloc(ts->length, sizeof(int));
+  if(w.row && first)
+    n = distinct_rows(ts, w.row, first);
+  if(n < 0 || !(w.row && first)){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    free(w.row);
+    free(first);
+    return NULL;
+  }
+  if(n * size >= ts->length - 1){
+    free(w.row);
+    free(first);
+    return forward_inference(ts, vars, nvars, loglikelihood);
+  }
 
-  /* Allocate some space for the results */
-  results = (uncertain_series) malloc(sizeof(uncertain_series_struct));
-  if(!results){
+  w.results = new_results(ts, vars, nvars);
+  alpha = nip_new_potential(cardinalities, model->outgoing_interface_size, 
+			    NULL);
+  w.mass = (double*) calloc(n * size, sizeof(double));
+  w.transfer = (double*) calloc(n * size * size, sizeof(double));
+  w.marginals = (double*) calloc(n * size * w.width + 1, sizeof(double));
+  w.prior = (double*) calloc(size, sizeof(double));
+  w.product = (double*) calloc(w.num_of_chunks * size * size, sizeof(double));
+  w.alpha = (double*) calloc((w.num_of_chunks + 1) * size, sizeof(double));
+  w.loglikelihood = (double*) calloc(w.num_of_chunks, sizeof(double));
+  w.impossible = (int*) calloc(w.num_of_chunks, sizeof(int));
+  if(w.results && alpha && w.mass && w.transfer && w.marginals && 
+     w.prior && w.product && w.alpha && w.loglikelihood && w.impossible)
+    e = forward_scan(ts, &w, first, n, alpha, loglikelihood);
+  else
+    e = nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+
+  /* Forget the evidence */
+  reset_timeslice(model, NIP_HAD_A_PREVIOUS_TIMESLICE);
+  if(e != NIP_NO_ERROR){
+    nip_report_error(__FILE__, __LINE__, e, 1);
+    free_uncertainseries(w.results);
+    w.results = NULL;
+  }
+  nip_free_potential(alpha);
+  free(first);
+  free(w.row);
+  free(w.mass);
+  free(w.transfer);
+  free(w.marginals);
+  free(w.prior);
+  free(w.product);
+  free(w.alpha);
+  free(w.loglikelihood);
+  free(w.impossible);
+  return w.results;
+}
+
+
+forward_filter new_forward_filter(nip_model model){
+  int i;
+  forward_filter f = NULL;
+
+  if(!model){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_NULLPOINTER, 1);
+    return NULL;
+  }
+
+  f = (forward_filter) malloc(sizeof(forward_filter_struct));
+  if(!f){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-    free(cardinalities);
     return NULL;
   }
-  
-  results->variables = (nip_variable*) calloc(nvars, sizeof(nip_variable));
-  if(!results->variables){
+
+  {
+    int cardinalities[model->outgoing_interface_size + 1];
+    for(i = 0; i < model->outgoing_interface_size; i++)
+      cardinalities[i] = NIP_CARDINALITY(model->outgoing_interface[i]);
+    f->alpha = nip_new_potential(cardinalities, 
+				 model->outgoing_interface_size, NULL);
+  }
+  if(!f->alpha){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-    free(results);
-    free(cardinalities);
+    free(f);
     return NULL;
   }
+  f->model = model;
 
-  /* Copy the references to the variables of interest */
-  memcpy(results->variables, vars, nvars*sizeof(nip_variable));
-  results->num_of_vars = nvars;
-  results->length = ts->length;
+  /* Probability mass before any evidence, as in forward_inference() */
+  f->mass_first = prior_mass(model);
+  if(prior_interface_mass(model) != NIP_NO_ERROR){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+    free_forward_filter(f);
+    return NULL;
+  }
 
-  results->data = (double***) calloc(ts->length, sizeof(double**));
-  if(!results->data){
+  restart_forward_filter(f);
+  return f;
+}
+
+
+void free_forward_filter(forward_filter f){
+  if(!f)
+    return;
+  nip_free_potential(f->alpha);
+  free(f);
+}
+
+
+void restart_forward_filter(forward_filter f){
+  f->t = 0;
+  f->loglikelihood = 0;
+}
+
+
+/* One iteration of forward_inference(), except that the evidence of the 
+ * previous step is forgotten only now: it can be queried until this. */
+int filter_step(forward_filter f, nip_variable vars[], int states[], int n){
+  int e;
+  double m1, m2;
+  nip_model model = f->model;
+
+  if(f->t > 0){
+    reset_timeslice(model, NIP_HAD_A_PREVIOUS_TIMESLICE);
+    /*  clique_in = clique_in * alpha  */
+    e = finish_timeslice_message_pass(model, FORWARD, f->alpha, NULL);
+    if(e != NIP_NO_ERROR){
+      nip_report_error(__FILE__, __LINE__, e, 1);
+      return e;
+    }
+    m1 = interface_mass(model, f->alpha);
+  }
+  else{
+    reset_timeslice(model, !NIP_HAD_A_PREVIOUS_TIMESLICE);
+    m1 = f->mass_first;
+  }
+
+  e = insert_evidence_batch(model, vars, states, n);
+  if(e != NIP_NO_ERROR){
+    nip_report_error(__FILE__, __LINE__, e, 1);
+    return e;
+  }
+  make_consistent(model);
+
+  /* L(y(t) | y(0:t-1)) */
+  m2 = nip_schedule_mass(model->schedule);
+  if((m1 > 0) && (m2 > 0))
+    f->loglikelihood += log(m2) - log(m1);
+  if(m2 == 0)
+    f->loglikelihood = -DBL_MAX;
+
+  /* The message to the next step */
+  e = start_timeslice_message_pass(model, FORWARD, f->alpha);
+  if(e != NIP_NO_ERROR){
+    nip_report_error(__FILE__, __LINE__, e, 1);
+    return e;
+  }
+  f->t++;
+  return NIP_NO_ERROR;
+}
+
+
+int filter_probabilities(forward_filter f, nip_variable vars[], int nvars, 
+			 double* results[]){
+  if(f->t == 0){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    return NIP_ERROR_INVALID_ARGUMENT;
+  }
+  return get_probabilities(f->model, vars, nvars, results);
+}
+
+
+double pop_filter_loglikelihood(forward_filter f){
+  double loglikelihood = f->loglikelihood;
+  f->loglikelihood = 0;
+  return loglikelihood;
+}
+
+
+fixed_lag_smoother new_fixed_lag_smoother(nip_model model, int lag){
+  int i, n;
+  fixed_lag_smoother sm = NULL;
+
+  if(lag < 0){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    return NULL;
+  }
+  sm = (fixed_lag_smoother) calloc(1, sizeof(fixed_lag_smoother_struct));
+  if(!sm){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-    free(results->variables);
-    free(results);
-    free(cardinalities);
     return NULL;
   }
-  
-  for(t = 0; t < results->length; t++){
-    results->data[t] = (double**) calloc(nvars, sizeof(double*));
-    if(!results->data[t]){
+  sm->lag = lag;
+  n = lag + 1;
+  sm->capacity = model->num_of_vars; /* grows if needed */
+  sm->filter = new_forward_filter(model);
+  sm->alpha = (nip_potential*) calloc(n, sizeof(nip_potential));
+  sm->vars = (nip_variable**) calloc(n, sizeof(nip_variable*));
+  sm->states = (int**) calloc(n, sizeof(int*));
+  sm->num_of_obs = (int*) calloc(n, sizeof(int));
+  if(!(sm->filter && sm->alpha && sm->vars && sm->states && 
+       sm->num_of_obs)){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    free_fixed_lag_smoother(sm);
+    return NULL;
+  }
+
+  /* The ring is allocated once and reused for every time step */
+  sm->gamma = nip_copy_potential(sm->filter->alpha);
+  for(i = 0; i < n; i++){
+    sm->alpha[i] = nip_copy_potential(sm->filter->alpha);
+    sm->vars[i] = (nip_variable*) calloc(sm->capacity + 1, 
+					 sizeof(nip_variable));
+    sm->states[i] = (int*) calloc(sm->capacity + 1, sizeof(int));
+    if(!(sm->alpha[i] && sm->vars[i] && sm->states[i] && sm->gamma)){
       nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-      while(t > 0){
-	t--;
-	for(i = 0; i < nvars; i++)
-	  free(results->data[t][i]);
-	free(results->data[t]);
-      }
-      free(results->data); /* t == 0 */
-      free(results->variables);
-      free(results);
-      free(cardinalities);
+      free_fixed_lag_smoother(sm);
       return NULL;
     }
+  }
 
-    for(i = 0; i < nvars; i++){
-      results->data[t][i] = (double*) calloc(NIP_CARDINALITY(vars[i]),
-					     sizeof(double));
-      if(!results->data[t][i]){
+  restart_fixed_lag_smoother(sm);
+  return sm;
+}
+
+
+void free_fixed_lag_smoother(fixed_lag_smoother sm){
+  int i;
+  if(!sm)
+    return;
+  for(i = 0; i <= sm->lag; i++){
+    if(sm->alpha)
+      nip_free_potential(sm->alpha[i]);
+    if(sm->vars)
+      free(sm->vars[i]);
+    if(sm->states)
+      free(sm->states[i]);
+  }
+  free(sm->alpha);
+  free(sm->vars);
+  free(sm->states);
+  free(sm->num_of_obs);
+  nip_free_potential(sm->gamma);
+  free_forward_filter(sm->filter);
+  free(sm);
+}
+
+
+void restart_fixed_lag_smoother(fixed_lag_smoother sm){
+  restart_forward_filter(sm->filter);
+  sm->t = -1;
+  sm->current = -1;
+}
+
+
+/* Makes the model hold time step s, given the forward message and 
+ * observations in the rings, and the message from the future if any */
+static int smoother_timeslice(fixed_lag_smoother sm, int s, 
+			      nip_potential gamma){
+  int e;
+  int i = s % (sm->lag + 1);
+  nip_model model = sm->filter->model;
+
+  reset_timeslice(model, (s > 0 ? NIP_HAD_A_PREVIOUS_TIMESLICE : 
+			  !NIP_HAD_A_PREVIOUS_TIMESLICE));
+  if(s > 0){
+    e = finish_timeslice_message_pass(model, FORWARD, 
+				      sm->alpha[(s - 1) % (sm->lag + 1)], 
+				      NULL);
+    if(e != NIP_NO_ERROR)
+      return e;
+  }
+  e = insert_evidence_batch(model, sm->vars[i], sm->states[i], 
+			    sm->num_of_obs[i]);
+  if(e != NIP_NO_ERROR)
+    return e;
+  if(gamma){
+    e = finish_timeslice_message_pass(model, BACKWARD, gamma, sm->alpha[i]);
+    if(e != NIP_NO_ERROR)
+      return e;
+  }
+  make_consistent(model);
+  sm->current = s;
+  return NIP_NO_ERROR;
+}
+
+
+/* The backward phase of forward_backward_inference() from the latest 
+ * time step back to step <first> only: at most L slices */
+static int smooth_window(fixed_lag_smoother sm, int first){
+  int s, e;
+  int t = sm->filter->t - 1; /* the latest step */
+
+  if(sm->current != t){ /* the filter left it in the model otherwise */
+    e = smoother_timeslice(sm, t, NULL);
+    if(e != NIP_NO_ERROR)
+      return e;
+  }
+  for(s = t - 1; s >= first; s--){
+    /* Pass the message to the past */
+    e = start_timeslice_message_pass(sm->filter->model, BACKWARD, sm->gamma);
+    if(e != NIP_NO_ERROR)
+      return e;
+    e = smoother_timeslice(sm, s, sm->gamma);
+    if(e != NIP_NO_ERROR)
+      return e;
+  }
+  sm->t = first;
+  return NIP_NO_ERROR;
+}
+
+
+int smoother_step(fixed_lag_smoother sm, nip_variable vars[], int states[], 
+		  int n){
+  int k, e;
+  int t = sm->filter->t;
+  int i = t % (sm->lag + 1); /* the slot of step t-L-1 until the end */
+  nip_variable* v;
+  int* x;
+
+  /* Keep the observations */
+  if(n > sm->capacity){
+    for(k = 0; k <= sm->lag; k++){
+      v = (nip_variable*) realloc(sm->vars[k], n * sizeof(nip_variable));
+      if(v)
+	sm->vars[k] = v;
+      x = (int*) realloc(sm->states[k], n * sizeof(int));
+      if(x)
+	sm->states[k] = x;
+      if(!(v && x)){
 	nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-	while(i > 0)
-	  free(results->data[t][--i]);
-	free(results->data[t]);
-	while(t > 0){
-	  t--;
-	  for(i = 0; i < nvars; i++)
-	    free(results->data[t][i]);
-	  free(results->data[t]);
-	}
-	free(results->data); /* t == 0 */
-	free(results->variables);
-	free(results);
-	free(cardinalities);
-	return NULL;
+	return NIP_ERROR_OUTOFMEMORY;
       }
     }
+    sm->capacity = n;
+  }
+  memcpy(sm->vars[i], vars, n * sizeof(nip_variable));
+  memcpy(sm->states[i], states, n * sizeof(int));
+  sm->num_of_obs[i] = n;
+
+  /* The forward phase */
+  e = filter_step(sm->filter, vars, states, n);
+  if(e != NIP_NO_ERROR){
+    nip_report_error(__FILE__, __LINE__, e, 1);
+    return e;
+  }
+  sm->current = t;
+
+  /* The backward phase for step t-L (needs alpha of step t-L-1) */
+  sm->t = -1;
+  if(t >= sm->lag){
+    e = smooth_window(sm, t - sm->lag);
+    if(e != NIP_NO_ERROR){
+      nip_report_error(__FILE__, __LINE__, e, 1);
+      return e;
+    }
   }
 
-  /* Allocate some space for the intermediate potentials */
-  alpha_gamma = (nip_potential *) calloc(ts->length + 1, 
-					 sizeof(nip_potential));
+  /* Step t-L-1 is forgotten */
+  return nip_retract_potential(sm->alpha[i], sm->filter->alpha);
+}
+
+
+int smoother_flush(fixed_lag_smoother sm){
+  int e;
+  if(sm->t >= sm->filter->t - 1)
+    return NIP_NO_ERROR; /* nothing left */
+  e = smooth_window(sm, sm->t + 1);
+  if(e != NIP_NO_ERROR)
+    nip_report_error(__FILE__, __LINE__, e, 1);
+  return e;
+}
+
 
-  /* Initialise intermediate potentials */
-  for(t = 0; t <= ts->length; t++){
-    alpha_gamma[t] = nip_new_potential(cardinalities, 
-				       model->outgoing_interface_size, 
-				       NULL);
+int smoother_probabilities(fixed_lag_smoother sm, nip_variable vars[], 
+			   int nvars, double* results[]){
+  if(sm->t < 0){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    return NIP_ERROR_INVALID_ARGUMENT;
+  }
+  return get_probabilities(sm->filter->model, vars, nvars, results);
+}
+
+
+/* Allocates the memory according to model->memory_policy */
+static int new_fb_workspace(nip_model model, int length, fb_workspace* w){
+  int i, n;
+  int cardinalities[model->outgoing_interface_size + 1];
+  nip_memory_policy policy = get_memory_policy(model, length);
+
+  for(i = 0; i < model->outgoing_interface_size; i++)
+    cardinalities[i] = NIP_CARDINALITY(model->outgoing_interface[i]);
+
+  w->k = (length > 0 ? length : 1);
+  w->n = 0;
+  w->alpha = NULL;
+  w->checkpoint = NULL;
+  w->gamma = NULL;
+  w->timeslices = NULL;
+  w->orientation = NULL;
+  w->table = NULL;
+  w->index = NULL;
+  if(policy == NIP_MEMORY_CHECKPOINTS)
+    w->k = (int) ceil(sqrt(w->k));
+  if(policy == NIP_MEMORY_TIMESLICES && model->arena){
+    /* the messages are enough if there is no room for this */
+    w->timeslices = (double*) malloc((size_t) length * model->arena->size * 
+				     sizeof(double));
+    w->orientation = (char*) malloc((size_t) length * 
+				    model->schedule->num_of_messages + 1);
+    if(!(w->timeslices && w->orientation)){
+      free(w->timeslices);
+      free(w->orientation);
+      w->timeslices = NULL;
+      w->orientation = NULL;
+    }
+  }
+
+  n = (length + w->k - 1) / w->k; /* the first one is not needed */
+  w->n = n;
+  w->alpha = (nip_potential*) calloc(w->k, sizeof(nip_potential));
+  w->checkpoint = (nip_potential*) calloc(n + 1, sizeof(nip_potential));
+  w->gamma = nip_new_potential(cardinalities, 
+			       model->outgoing_interface_size, NULL);
+  if(!(w->alpha && w->checkpoint && w->gamma)){
+    free_fb_workspace(w);
+    return nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+  }
+  for(i = 0; i < w->k; i++){
+    w->alpha[i] = nip_new_potential(cardinalities, 
+				    model->outgoing_interface_size, NULL);
+    if(!w->alpha[i]){
+      free_fb_workspace(w);
+      return nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    }
+  }
+  for(i = 1; i < n; i++){
+    w->checkpoint[i] = nip_new_potential(cardinalities, 
+					 model->outgoing_interface_size, NULL);
+    if(!w->checkpoint[i]){
+      free_fb_workspace(w);
+      return nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    }
+  }
+  return NIP_NO_ERROR;
+}
+
+
+static void free_fb_workspace(fb_workspace* w){
+  int i;
+  if(w->alpha)
+    for(i = 0; i < w->k; i++)
+      nip_free_potential(w->alpha[i]);
+  if(w->checkpoint)
+    for(i = 1; i < w->n; i++)
+      nip_free_potential(w->checkpoint[i]);
+  free(w->alpha);
+  free(w->checkpoint);
+  nip_free_potential(w->gamma);
+  free(w->timeslices);
+  free(w->orientation);
+  free(w->table);
+  free(w->index);
+}
+
+
+/* Propagates the evidence of time step t given the message from the 
+ * past (if t > 0), and computes the message to the future and the 
+ * probability mass of the step. With a compiled time slice (table), 
+ * the join tree is not used. */
+static int forward_timeslice(time_series ts, int t, double* table, 
+			     nip_potential alpha_in, nip_potential alpha_out, 
+			     double* mass){
+  int e;
+  nip_model model = ts->model;
+
+  if(table){
+    memcpy(alpha_out->data, alpha_in->data, 
+	   alpha_in->size_of_data * sizeof(double));
+    *mass = compiled_forward(model->transfer_cache, table, alpha_out->data, 
+			     0, NULL, NULL);
+    return NIP_NO_ERROR;
+  }
+
+  reset_timeslice(model, (t > 0 ? NIP_HAD_A_PREVIOUS_TIMESLICE : 
+			  !NIP_HAD_A_PREVIOUS_TIMESLICE));
+  if(t > 0){
+    e = finish_timeslice_message_pass(model, FORWARD, alpha_in, NULL);
+    if(e != NIP_NO_ERROR)
+      return e;
+  }
+  insert_ts_step(ts, t, model, NIP_MARK_ON); /* only marked variables */
+  make_consistent(model);
+  *mass = nip_schedule_mass(model->schedule);
+  return start_timeslice_message_pass(model, FORWARD, alpha_out);
+}
+
+
+/* Propagates time step t given the whole time series, does the task, 
+ * and computes the message to the past in w->gamma */
+static int backward_timeslice(time_series ts, int t, fb_workspace* w, 
+			      timeslice_task task, void* data){
+  int e;
+  nip_model model = ts->model;
+  nip_potential alpha = w->alpha[t % w->k];
+  uncertain_series results = (uncertain_series) data;
+
+  if(w->table && w->table[t]){
+    /* the results of smoothed_probabilities() without the join tree */
+    compiled_backward(model->transfer_cache, w->table[t], 
+		      (t % w->k == 0 ? 
+		       w->checkpoint[t / w->k]->data : 
+		       w->alpha[(t - 1) % w->k]->data), alpha->data, 
+		      (t < ts->length - 1 ? w->gamma->data : NULL), 
+		      w->gamma->data, results->num_of_vars, w->index, 
+		      results->data[t]);
+    return NIP_NO_ERROR;
+  }
+
+  if(w->timeslices){
+    /* the forward phase left it consistent with the past */
+    memcpy(model->arena->data, 
+	   w->timeslices + (size_t) t * model->arena->size, 
+	   model->arena->size * sizeof(double));
+    nip_restore_orientation(model->schedule, w->orientation + 
+			    (size_t) t * model->schedule->num_of_messages);
+    nip_mark_consistent(model->schedule, model->cliques, 
+			model->num_of_cliques);
+  }
+  else{
+    reset_timeslice(model, (t > 0 ? NIP_HAD_A_PREVIOUS_TIMESLICE : 
+			    !NIP_HAD_A_PREVIOUS_TIMESLICE));
+    /* Pass the message from the past */
+    if(t > 0){
+      e = finish_timeslice_message_pass(model, FORWARD, 
+					(t % w->k == 0 ? 
+					 w->checkpoint[t / w->k] : 
+					 w->alpha[(t - 1) % w->k]), NULL);
+      if(e != NIP_NO_ERROR)
+	return e;
+    }
+    insert_ts_step(ts, t, model, NIP_MARK_ON);
+  }
+
+  /* Pass the message from the future */
+  if(t < ts->length - 1){
+    e = finish_timeslice_message_pass(model, BACKWARD, w->gamma, alpha);
+    if(e != NIP_NO_ERROR)
+      return e;
+  }
+  make_consistent(model);
+
+  e = task(model, t, data);
+  if(e != NIP_NO_ERROR)
+    return e;
+
+  /* Pass the message to the past */
+  if(t > 0)
+    return start_timeslice_message_pass(model, BACKWARD, w->gamma);
+  return NIP_NO_ERROR;
+}
+
+
+/* The forward and backward phases for a time series, according to 
+ * model->memory_policy. If <strict>, impossible data or a positive 
+ * log. likelihood is an error (NIP_ERROR_BAD_LUCK). */
+static int forward_backward(time_series ts, double* loglikelihood, 
+			    int strict, timeslice_task task, void* data){
+  int i, s, t, e;
+  double m1 = 0, m2;
+  double mass_first = 0;
+  fb_workspace w;
+  nip_model model = ts->model;
+  nip_potential alpha_in;
+  uncertain_series results = (uncertain_series) data;
+  int observed[ts->num_of_observed + 1];
+
+  e = new_fb_workspace(model, ts->length, &w);
+  if(e != NIP_NO_ERROR)
+    return e;
+
+  /* The compiled time slices give the distributions of the variables, 
+   * but not the clique potentials e.g. em_learn() needs */
+  if(model->transfer_cache && task == smoothed_probabilities){
+    w.table = (double**) calloc(ts->length, sizeof(double*));
+    w.index = (int*) calloc(results->num_of_vars + 1, sizeof(int));
+    if(!(w.table && w.index)){
+      free_fb_workspace(&w);
+      return nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    }
+    if(variable_indices(model, results->variables, results->num_of_vars, 
+			w.index) != 0){
+      free(w.table);
+      w.table = NULL;
+    }
+    variable_indices(model, ts->observed, ts->num_of_observed, observed);
+    for(i = 0; i < ts->num_of_observed; i++)
+      if(!(NIP_MARK(ts->observed[i]) & NIP_MARK_ON))
+	observed[i] = -1;
+  }
+
+  /* Probability mass before any evidence */
+  if(loglikelihood){
+    mass_first = prior_mass(model);
+    if(ts->length > 1)
+      prior_interface_mass(model);
+    *loglikelihood = 0; /* init */
   }
-  free(cardinalities);
 
   /*****************/
   /* Forward phase */
   /*****************/
-  reset_model(model);
-  use_priors(model, !NIP_HAD_A_PREVIOUS_TIMESLICE);
-  if(loglikelihood)
-    *loglikelihood = 0; /* init */
-
   for(t = 0; t < ts->length; t++){ /* FOR EVERY TIMESLICE */
-    
-    if(t > 0)
-      if(finish_timeslice_message_pass(model, FORWARD, 
-				       alpha_gamma[t-1], NULL) != NIP_NO_ERROR){
-	nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
-	free_uncertainseries(results);
-	for(i = 0; i <= ts->length; i++)
-	  nip_free_potential(alpha_gamma[i]);
-	free(alpha_gamma);
-	return NULL;
-      }
+    alpha_in = (t > 0 ? w.alpha[(t - 1) % w.k] : NULL);
 
-    /* Likelihood reference... */
-    if(loglikelihood){
-      make_consistent(model);
-      m1 = model_prob_mass(model);
-    }
+    /* Likelihood reference (no need for a propagation) */
+    if(loglikelihood)
+      m1 = (t > 0 ? interface_mass(model, alpha_in) : mass_first);
 
-    /* Put some data in (Q: should this be AFTER message passing?) */
-    insert_ts_step(ts, t, model, NIP_MARK_ON);
-    
-    /* Do the inference */
-    make_consistent(model);
+    if(w.table && t > 0)
+      w.table[t] = cached_ts_step(ts, t, observed);
+    e = forward_timeslice(ts, t, (w.table ? w.table[t] : NULL), 
+			  alpha_in, w.alpha[t % w.k], &m2);
+    if(e != NIP_NO_ERROR){
+      nip_report_error(__FILE__, __LINE__, e, 1);
+      free_fb_workspace(&w);
+      return e;
+    }
 
-    /* Compute loglikelihood if required */
+    /* L(y(t) | y(0:t-1)) */
     if(loglikelihood){
-      /* Q: Is this L(y(t) | y(0:t-1)) 
-       * A: Yes... */
-      m2 = model_prob_mass(model);
-      if((m1 > 0) && (m2 > 0)){
+      if((m1 > 0) && (m2 > 0))
 	*loglikelihood = (*loglikelihood) + (log(m2) - log(m1));
+      if(strict && (m1 <= 0 || m2 <= 0 || *loglikelihood > 0)){
+	/* e.g. an invalid initial guess for parameters */
+	free_fb_workspace(&w);
+	return NIP_ERROR_BAD_LUCK;
       }
-      /* Check for anomalies */
-      /*assert(*loglikelihood <= 0.0);*/
       assert(m2 >= 0.0);
-      if(m2 == 0.0){
+      if(m2 == 0.0)
 	*loglikelihood = -DBL_MAX; /* -infinity, does this underflow ? */
-      }
     }
 
-    /* Start a message pass between timeslices */
-    if(start_timeslice_message_pass(model, FORWARD,
-				    alpha_gamma[t]) != NIP_NO_ERROR){
-      nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
-      free_uncertainseries(results);
-      for(i = 0; i <= ts->length; i++)
-	nip_free_potential(alpha_gamma[i]);
-      free(alpha_gamma);
-      return NULL;
+    /* Keep what the backward phase needs */
+    if(w.timeslices && !(w.table && w.table[t])){
+      memcpy(w.timeslices + (size_t) t * model->arena->size, 
+	     model->arena->data, model->arena->size * sizeof(double));
+      nip_save_orientation(model->schedule, w.orientation + 
+			   (size_t) t * model->schedule->num_of_messages);
     }
-
-    /* Forget old evidence */
-    reset_model(model);
-    if(ts->length > 1)
-      use_priors(model, NIP_HAD_A_PREVIOUS_TIMESLICE);
-    else
-      use_priors(model, !NIP_HAD_A_PREVIOUS_TIMESLICE);
+    if((t + 1) % w.k == 0 && t + 1 < ts->length)
+      nip_retract_potential(w.checkpoint[(t + 1) / w.k], w.alpha[t % w.k]);
   }
-  
+
   /******************/
   /* Backward phase */
   /******************/
   for(t = ts->length - 1; t >= 0; t--){ /* FOR EVERY TIMESLICE */
-    
-    /* Pass the message from the past */
-    if(t > 0)
-      if(finish_timeslice_message_pass(model, FORWARD, 
-				       alpha_gamma[t-1], 
-				       NULL)                   != NIP_NO_ERROR){
-	
-	nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
-	free_uncertainseries(results);
-	for(i = 0; i <= ts->length; i++)
-	  nip_free_potential(alpha_gamma[i]);
-	free(alpha_gamma);
-	return NULL;
-      }
-    
-    /* Put some evidence in */
-    insert_ts_step(ts, t, model, NIP_MARK_ON);
-
-    /* Pass the message from the future */
-    if(t < ts->length - 1)
-      if(finish_timeslice_message_pass(model, BACKWARD, 
-				       alpha_gamma[t+1], /* gamma */
-				       alpha_gamma[t]  ) /* alpha */
-	 != NIP_NO_ERROR){
-	nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
-	free_uncertainseries(results);
-	for(i = 0; i <= ts->length; i++)
-	  nip_free_potential(alpha_gamma[i]);
-	free(alpha_gamma);
-	return NULL;
-      }
 
-    /* Do the inference */
-    make_consistent(model);
+    /* Recompute the forward messages since the previous checkpoint */
+    if((t + 1) % w.k == 0 && t + 1 < ts->length){
+      for(s = t + 1 - w.k; s <= t && e == NIP_NO_ERROR; s++)
+	e = forward_timeslice(ts, s, (w.table ? w.table[s] : NULL), 
+			      (s % w.k == 0 ? 
+			       w.checkpoint[s / w.k] : 
+			       w.alpha[(s - 1) % w.k]), w.alpha[s % w.k], &m2);
+    }
 
-    /* THE CORE: Write the results */
-    for(i = 0; i < results->num_of_vars; i++){
-      
-      /* 1. Decide which variable you are interested in */
-      temp = results->variables[i];
-      
-      /* 2. Find the clique that contains the family of 
-       *    the interesting variable */
-      clique_of_interest = nip_find_family(model->cliques, 
-					   model->num_of_cliques, 
-					   temp);
-      assert(clique_of_interest != NULL);
-      
-      /* 3. Marginalisation (the memory must have been allocated) */
-      nip_marginalise_clique(clique_of_interest, temp, results->data[t][i]);
-      
-      /* 4. Normalisation */
-      nip_normalise_array(results->data[t][i], NIP_CARDINALITY(temp));
+    if(e == NIP_NO_ERROR)
+      e = backward_timeslice(ts, t, &w, task, data);
+    if(e != NIP_NO_ERROR){
+      nip_report_error(__FILE__, __LINE__, e, 1);
+      free_fb_workspace(&w);
+      return e;
     }
-    /* End of the CORE */
+  }
 
-    /* Pass the message to the past */
-    if(t > 0)
-      if(start_timeslice_message_pass(model, BACKWARD, 
-				      alpha_gamma[t]) != NIP_NO_ERROR){
-	nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
-	free_uncertainseries(results);
-	for(i = 0; i <= ts->length; i++)
-	  nip_free_potential(alpha_gamma[i]);
-	free(alpha_gamma);
-	return NULL;
-      }
+  /* forget old evidence */
+  reset_timeslice(model, !NIP_HAD_A_PREVIOUS_TIMESLICE);
+  free_fb_workspace(&w);
+  return NIP_NO_ERROR;
+}
+
+
+/* Writes the results of forward_backward_inference() for time step t */
+static int smoothed_probabilities(nip_model model, int t, void* data){
+  uncertain_series results = (uncertain_series) data;
+  return get_probabilities(model, results->variables, results->num_of_vars, 
+			   results->data[t]);
+}
 
-    /* forget old evidence */
-    reset_model(model);
-    if(t > 1)
-      use_priors(model, NIP_HAD_A_PREVIOUS_TIMESLICE);
-    else
-      use_priors(model, !NIP_HAD_A_PREVIOUS_TIMESLICE);
-  }
 
-  /* free the intermediate potentials */
-  for(t = 0; t <= ts->length; t++)
-    nip_free_potential(alpha_gamma[t]);
-  free(alpha_gamma);
+/* This consumes much more memory depending on the size of the 
+ * sepsets between time slices. */
+uncertain_series forward_backward_inference(time_series ts,
+					    nip_variable vars[], int nvars,
+					    double* loglikelihood){
+  uncertain_series results = NULL;
+
+  /* Allocate some space for the results */
+  results = new_results(ts, vars, nvars);
+  if(!results)
+    return NULL;
 
+  /* The inference: results for each time slice of the backward phase */
+  if(forward_backward(ts, loglikelihood, 0, 
+		      smoothed_probabilities, results) != NIP_NO_ERROR){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+    free_uncertainseries(results);
+    return NULL;
+  }
   return results;
 }
 
@@ -1597,22 +3060,122 @@ nip_variable model_variable(nip_model model, char* symbol){
 }
 
 
-void make_consistent(nip_model model){
+int set_num_of_threads(nip_model model, int n){
+  nip_thread_pool pool = NULL;
+
+  if(!model)
+    return nip_report_error(__FILE__, __LINE__, NIP_ERROR_NULLPOINTER, 1);
+  if(n < 1)
+    return nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+
+  if(n > 1){
+    pool = nip_new_thread_pool(n);
+    if(!pool)
+      return nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+  }
+  nip_schedule_threads(model->schedule, pool);
+  nip_free_thread_pool(model->pool);
+  model->pool = pool;
+  return NIP_NO_ERROR;
+}
+
+
+int set_memory_policy(nip_model model, nip_memory_policy policy, 
+		      size_t budget){
+  if(!model)
+    return nip_report_error(__FILE__, __LINE__, NIP_ERROR_NULLPOINTER, 1);
+  if(policy < NIP_MEMORY_INTERFACES || policy > NIP_MEMORY_AUTO)
+    return nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+  model->memory_policy = policy;
+  model->memory_budget = budget;
+  return NIP_NO_ERROR;
+}
+
+
+nip_memory_policy get_memory_policy(nip_model model, int length){
   int i;
-  for (i = 0; i < model->num_of_cliques; i++)
-    nip_unmark_clique(model->cliques[i]);
+  double size = 1; /* doubles in a message */
+  double budget = (double) model->memory_budget / sizeof(double);
+
+  if(model->memory_policy != NIP_MEMORY_AUTO)
+    return model->memory_policy;
+  for(i = 0; i < model->outgoing_interface_size; i++)
+    size *= NIP_CARDINALITY(model->outgoing_interface[i]);
+
+  /* The fastest one that fits */
+  if(model->arena && 
+     (double) length * (size + model->arena->size) <= budget)
+    return NIP_MEMORY_TIMESLICES;
+  if((double) length * size <= budget)
+    return NIP_MEMORY_INTERFACES;
+  return NIP_MEMORY_CHECKPOINTS;
+}
+
+
+int set_transfer_cache(nip_model model, int capacity){
+  int i, n;
+  int size = 1;
+  nip_transfer_cache c = NULL;
+
+  if(!model)
+    return nip_report_error(__FILE__, __LINE__, NIP_ERROR_NULLPOINTER, 1);
+  for(i = 0; i < model->outgoing_interface_size && size <= MAX_TRANSFER_SIZE; 
+      i++)
+    size *= NIP_CARDINALITY(model->outgoing_interface[i]);
+  if(capacity < 0 || (capacity > 0 && size > MAX_TRANSFER_SIZE))
+    return nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
 
-  if(nip_collect_evidence(NULL, NULL, model->cliques[0]) != NIP_NO_ERROR){
+  free_transfer_cache(model->transfer_cache);
+  model->transfer_cache = NULL;
+  if(capacity == 0)
+    return NIP_NO_ERROR;
+
+  c = (nip_transfer_cache) calloc(1, sizeof(nip_transfer_cache_struct));
+  if(!c)
+    return nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+  c->capacity = capacity;
+  c->size = size;
+  c->hash_size = 1;
+  while(c->hash_size < 2 * capacity)
+    c->hash_size *= 2;
+  n = model->num_of_vars;
+  c->offset = (int*) calloc(n + 1, sizeof(int));
+  c->rows = (int**) calloc(capacity, sizeof(int*));
+  c->tables = (double**) calloc(capacity, sizeof(double*));
+  c->hash = (int*) calloc(c->hash_size, sizeof(int));
+  if(!(c->offset && c->rows && c->tables && c->hash)){
+    free_transfer_cache(c);
+    return nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+  }
+  for(i = 0; i < n; i++)
+    c->offset[i + 1] = c->offset[i] + NIP_CARDINALITY(model->variables[i]);
+  c->width = c->offset[n];
+  for(i = 0; i < c->hash_size; i++)
+    c->hash[i] = -1;
+  model->transfer_cache = c;
+  return NIP_NO_ERROR;
+}
+
+
+void make_consistent(nip_model model){
+  if(nip_collect_schedule(model->schedule) != NIP_NO_ERROR){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
     return;
   }
 
-  for (i = 0; i < model->num_of_cliques; i++)
-    nip_unmark_clique(model->cliques[i]);
-
-  if(nip_distribute_evidence(model->cliques[0]) != NIP_NO_ERROR)
+  if(nip_distribute_schedule(model->schedule) != NIP_NO_ERROR){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+    return;
+  }
+
+  model->consistent_epoch = model->evidence_epoch;
+  return;
+}
+
 
+void update_consistency(nip_model model){
+  if(model->consistent_epoch != model->evidence_epoch)
+    make_consistent(model);
   return;
 }
 
@@ -1705,305 +3268,107 @@ time_series mlss(nip_variable vars[], int nvars, time_series ts){
  *   because they can't deliver the results without global variables
  * - some parts of the code could be (and have been) transformed into 
  *   separate procedures */
-static int e_step(time_series ts, nip_potential* parameters, 
-			     double* loglikelihood){
-  int i, t;
+/* Adds the expected counts of time step t to the sums: 
+ * data is {parameters, results} of e_step() */
+static int expected_counts(nip_model model, int t, void* data){
+  int i;
 #ifdef DEBUG_NIP
   int j;
 #endif
-  int* cardinalities = NULL;
-  int nobserved;
-  int* data = NULL;
   int* mapping;
-  nip_variable* observed = NULL;
-  nip_variable v;
-  nip_potential* alpha_gamma = NULL;
-  nip_potential* results = NULL;
+  nip_potential* parameters = ((nip_potential**) data)[0];
+  nip_potential* results = ((nip_potential**) data)[1];
   nip_potential p;
+  nip_variable v;
   nip_clique c = NULL;
-  nip_model model = ts->model;
-  double m1, m2;
-  int error;
 
-  /* Reserve some memory for computation */
-  nobserved = ts->num_of_observed;
-  observed = (nip_variable*) calloc(nobserved, sizeof(nip_variable));
-  data     = (int*) calloc(nobserved, sizeof(int));
-  results = (nip_potential*) calloc(model->num_of_vars, sizeof(nip_potential));
-  if(!(results && data && observed && loglikelihood)){
-    if(loglikelihood){
-      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-      error = NIP_ERROR_OUTOFMEMORY;
-    }
-    else{
-      nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
-      error = NIP_ERROR_INVALID_ARGUMENT;
-    }
-    free(data);
-    free(observed);
-    free(results);
-    return error;
-  }
+  /*** THE CORE: Write the results of inference ***/
   for(i = 0; i < model->num_of_vars; i++){
-    p = parameters[i];
-    results[i] = nip_new_potential(NIP_CARDINALITY(p), 
-				   NIP_DIMENSIONALITY(p), 
-				   NULL);
-    /* in principle, new_potential can return NULL */
-  }  
-
-  /* Allocate some space for the intermediate potentials between timeslices */
-  alpha_gamma = (nip_potential *) calloc(ts->length + 1, 
-					 sizeof(nip_potential));
-
-  /* Allocate an array for describing the dimensions of alpha & gamma */
-  if(model->outgoing_interface_size > 0){
-    cardinalities = (int*) calloc(model->outgoing_interface_size, 
-				  sizeof(int));
-    if(!cardinalities){
-      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
-      for(i = 0; i < model->num_of_vars; i++)
-	nip_free_potential(results[i]);
-      free(results);
-      free(data);
-      free(observed);
-      free(alpha_gamma);
-      return NIP_ERROR_OUTOFMEMORY;
-    }
-  }
-
-  for(i = 0; i < model->outgoing_interface_size; i++)
-    cardinalities[i] = NIP_CARDINALITY(model->outgoing_interface[i]);
+    p = results[i];
 
-  /* Initialise intermediate potentials */
-  for(t = 0; t <= ts->length; t++)
-    alpha_gamma[t] = nip_new_potential(cardinalities, 
-				       model->outgoing_interface_size, 
-				       NULL);
-  free(cardinalities);
+    /* 1. Decide which variable you are interested in */
+    v = model->variables[i];
 
-  /*****************/
-  /* Forward phase */
-  /*****************/
-  reset_model(model);
-  use_priors(model, !NIP_HAD_A_PREVIOUS_TIMESLICE);
-  *loglikelihood = 0; /* init */
-  
-  for(t = 0; t < ts->length; t++){ /* FOR EVERY TIMESLICE */
+    /* JJT 02.11.2006: Skip old interface variables for t > 0 */
+    if(t > 0 && (v->interface_status & NIP_INTERFACE_OLD_OUTGOING))
+      continue;
     
-    if(t > 0){
-      if(finish_timeslice_message_pass(model, FORWARD, 
-				       alpha_gamma[t-1], NULL) != NIP_NO_ERROR){
-	nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
-	/* i is useless at this point */
-	for(i = 0; i < model->num_of_vars; i++)
-	  nip_free_potential(results[i]);
-	free(results);
-	free(data);
-	free(observed);
-	for(i = 0; i <= ts->length; i++)
-	  nip_free_potential(alpha_gamma[i]);
-	free(alpha_gamma);
-	return NIP_ERROR_GENERAL;
-      }
-    }
-
-    /* Propagate message and make sure sepsets have correct weight */
-    make_consistent(model); 
-
-    m1 = model_prob_mass(model);
-
-    insert_ts_step(ts, t, model, NIP_MARK_ON); /* Put some data in */
-
-    make_consistent(model); /* Do the inference */
-
-    /* This computes the log likelihood (ratio of probability masses) */
-    m2 = model_prob_mass(model);
-    if((m1 > 0) && (m2 > 0)){
-      *loglikelihood = (*loglikelihood) + (log(m2) - log(m1));
-    }
-
-    /* Check for anomalies like invalid initial guess for parameters */
-    if((m1 <= 0) || 
-       (m2 <= 0) || 
-       (*loglikelihood > 0)){
-      for(i = 0; i < model->num_of_vars; i++)
-	nip_free_potential(results[i]);
-      free(results);
-      free(data);
-      free(observed);
-      for(i = 0; i <= ts->length; i++)
-	nip_free_potential(alpha_gamma[i]);
-      free(alpha_gamma);
+    /* 2. Find the clique that contains the family of 
+     *    the interesting variable */
+    c = nip_find_family(model->cliques, model->num_of_cliques, v);
+    assert(c != NULL);
+    
+    /* 3. General Marginalisation from the timeslice */
+    mapping = nip_find_family_mapping(c, v);
+    nip_general_marginalise(c->p, p, mapping);
 
 
-      /* DEBUG */
 #ifdef DEBUG_NIP
-      printf("t  = %d\n", t);
-      printf("m1 = %g\n", m1);
-      printf("m2 = %g\n", m2);
-      printf("ll = %g\n", *loglikelihood);
-      for(i = 0; i < model->num_of_cliques; i++){
-	nip_fprintf_clique(stdout, model->cliques[i]);
-	nip_fprintf_potential(stdout, model->cliques[i]->original_p);
-      }
+    /* DEBUG */
+    printf("Marginalising the family of %s ", v->symbol);
+    for(j = 0; j < NIP_DIMENSIONALITY(p) - 1; j++)
+      printf("%s ", v->parents[j]->symbol);
+    printf("from \n");
+    nip_fprintf_clique(stdout, c);
+    printf("with mapping [");
+    for(j = 0; j < NIP_DIMENSIONALITY(p); j++)
+      printf("%d,", mapping[j]);
+    printf("]\n");
+    /* FIXME: correct mapping??? */
 #endif
 
-
-      return NIP_ERROR_BAD_LUCK;
-    }
     
-    /* Start a message pass between timeslices */
-    if(start_timeslice_message_pass(model, FORWARD,
-				    alpha_gamma[t]) != NIP_NO_ERROR){
-      nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
-      for(i = 0; i < model->num_of_vars; i++)
-	nip_free_potential(results[i]);
-      free(results);
-      free(data);
-      free(observed);
-      for(i = 0; i <= ts->length; i++)
-	nip_free_potential(alpha_gamma[i]);
-      free(alpha_gamma);
-      return NIP_ERROR_GENERAL;
-    }
+    /********************/
+    /* 4. Normalisation */
+    /********************/
+    nip_normalise_potential(p); /* Does this cause numerical problems? */
 
-    /* Forget old evidence */
-    reset_model(model);
-    if(ts->length > 1)
-      use_priors(model, NIP_HAD_A_PREVIOUS_TIMESLICE);
-    else
-      use_priors(model, !NIP_HAD_A_PREVIOUS_TIMESLICE);
+    /* 5. THE SUM of expected counts over time */
+    nip_sum_potential(parameters[i], p); /* "parameters[i] += p" */
   }
-  
-  /******************/
-  /* Backward phase */
-  /******************/
-  for(t = ts->length - 1; t >= 0; t--){ /* FOR EVERY TIMESLICE */
-
-    /* Pass the message from the past */
-    if(t > 0)
-      if(finish_timeslice_message_pass(model, FORWARD, 
-				       alpha_gamma[t-1], 
-				       NULL)            != NIP_NO_ERROR){
-	nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
-	for(i = 0; i < model->num_of_vars; i++)
-	  nip_free_potential(results[i]);
-	free(results);
-	free(data);
-	free(observed);
-	for(i = 0; i <= ts->length; i++)
-	  nip_free_potential(alpha_gamma[i]);
-	free(alpha_gamma);
-	return NIP_ERROR_GENERAL;
-      }
-    
-    /* Put some evidence in */
-    insert_ts_step(ts, t, model, NIP_MARK_ON); /* only marked variables */
-    
-    /* Pass the message from the future */
-    if(t < ts->length - 1)
-      if(finish_timeslice_message_pass(model, BACKWARD, 
-				       alpha_gamma[t+1], 
-				       alpha_gamma[t]) != NIP_NO_ERROR){
-	nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
-	for(i = 0; i < model->num_of_vars; i++)
-	  nip_free_potential(results[i]);
-	free(results);
-	free(data);
-	free(observed);
-	for(i = 0; i <= ts->length; i++)
-	  nip_free_potential(alpha_gamma[i]);
-	free(alpha_gamma);
-	return NIP_ERROR_GENERAL;
-      }
-
-    /* Do the inference */
-    make_consistent(model);
-
-    /*** THE CORE: Write the results of inference ***/
-    for(i = 0; i < model->num_of_vars; i++){
-      p = results[i];
-
-      /* 1. Decide which variable you are interested in */
-      v = model->variables[i];
-
-      /* JJT 02.11.2006: Skip old interface variables for t > 0 */
-      if(t > 0 && (v->interface_status & NIP_INTERFACE_OLD_OUTGOING))
-	continue;
-      
-      /* 2. Find the clique that contains the family of 
-       *    the interesting variable */
-      c = nip_find_family(model->cliques, model->num_of_cliques, v);
-      assert(c != NULL);
-      
-      /* 3. General Marginalisation from the timeslice */
-      mapping = nip_find_family_mapping(c, v);
-      nip_general_marginalise(c->p, p, mapping);
-
-
-#ifdef DEBUG_NIP
-      /* DEBUG */
-      printf("Marginalising the family of %s ", v->symbol);
-      for(j = 0; j < NIP_DIMENSIONALITY(p) - 1; j++)
-	printf("%s ", v->parents[j]->symbol);
-      printf("from \n");
-      nip_fprintf_clique(stdout, c);
-      printf("with mapping [");
-      for(j = 0; j < NIP_DIMENSIONALITY(p); j++)
-	printf("%d,", mapping[j]);
-      printf("]\n");
-      /* FIXME: correct mapping??? */
-#endif
+/*** Finished writing results for this timestep ***/
+  return NIP_NO_ERROR;
+}
 
-      
-      /********************/
-      /* 4. Normalisation */
-      /********************/
-      nip_normalise_potential(p); /* Does this cause numerical problems? */
 
-      /* 5. THE SUM of expected counts over time */
-      nip_sum_potential(parameters[i], p); /* "parameters[i] += p" */
-    }
-    /*** Finished writing results for this timestep ***/
+static int e_step(time_series ts, nip_potential* parameters, 
+			     double* loglikelihood){
+  int i;
+  int error;
+  nip_potential* results = NULL;
+  nip_potential* counts[2];
+  nip_model model = ts->model;
+  nip_potential p;
 
-    /* Pass the message to the past */
-    if(t > 0)
-      if(start_timeslice_message_pass(model, BACKWARD, 
-				      alpha_gamma[t]) != NIP_NO_ERROR){
-	nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
-	for(i = 0; i < model->num_of_vars; i++)
-	  nip_free_potential(results[i]);
-	free(results);
-	free(data);
-	free(observed);
-	for(i = 0; i <= ts->length; i++)
-	  nip_free_potential(alpha_gamma[i]);
-	free(alpha_gamma);
-	return NIP_ERROR_GENERAL;
-      }
+  if(!loglikelihood){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    return NIP_ERROR_INVALID_ARGUMENT;
+  }
 
-    /* forget old evidence */
-    reset_model(model);
-    if(t > 1) /* Q: Or t > 0 ?  A: No, t will be t-1 soon... */
-      use_priors(model, NIP_HAD_A_PREVIOUS_TIMESLICE);
-    else
-      use_priors(model, !NIP_HAD_A_PREVIOUS_TIMESLICE);
+  /* Reserve some memory for computation */
+  results = (nip_potential*) calloc(model->num_of_vars, sizeof(nip_potential));
+  if(!results){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    return NIP_ERROR_OUTOFMEMORY;
   }
+  for(i = 0; i < model->num_of_vars; i++){
+    p = parameters[i];
+    results[i] = nip_new_potential(NIP_CARDINALITY(p), 
+				   NIP_DIMENSIONALITY(p), 
+				   NULL);
+    /* in principle, new_potential can return NULL */
+  }  
+
+  /* The inference: counts for each time slice of the backward phase */
+  counts[0] = parameters;
+  counts[1] = results;
+  error = forward_backward(ts, loglikelihood, 1, expected_counts, counts);
 
   /* free the space for calculations */
   for(i = 0; i < model->num_of_vars; i++)
     nip_free_potential(results[i]);
   free(results);
-  free(data);
-  free(observed);
-
-  /* free the intermediate potentials */
-  for(t = 0; t <= ts->length; t++)
-    nip_free_potential(alpha_gamma[t]);
-  free(alpha_gamma);
-
-  return NIP_NO_ERROR;
+  return error;
 }
 
 
@@ -2051,6 +3416,7 @@ static int m_step(nip_potential* parameters, nip_model model){
 
       /* Update the conditional probability distributions (dependencies) */
       j = nip_init_potential(parameters[i], fam_clique->p, fam_map);
+      fam_clique->dirty = 1;
       k = nip_init_potential(parameters[i], fam_clique->original_p, fam_map);
       if(j != NIP_NO_ERROR || k != NIP_NO_ERROR){
 	nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
@@ -2253,6 +3619,7 @@ int em_learn(time_series* ts, int n_ts, double threshold,
 /* a little wrapper */
 double model_prob_mass(nip_model model){
   double m;
+  update_consistency(model);
   m = nip_probability_mass(model->cliques, model->num_of_cliques);
   return m;
 }
@@ -2287,8 +3654,18 @@ double* get_probability(nip_model model, nip_variable v){
     return NULL;
   }
 
+  /* 0. Collect the latest evidence to the clique, if not done already 
+   * (the rest of the join tree may remain inconsistent) */
+  if(model->consistent_epoch != model->evidence_epoch &&
+     nip_collect_schedule_to(model->schedule, clique_of_interest) != 0){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+    free(result);
+    return NULL;
+  }
+
   /* 2. Marginalisation (the memory must have been allocated) */
-  nip_marginalise_clique(clique_of_interest, v, result);
+  nip_marginalise_clique_variables(model->pool, clique_of_interest, 
+				   &v, 1, &result);
 
   /* 3. Normalisation */
   nip_normalise_array(result, cardinality);
@@ -2298,17 +3675,91 @@ double* get_probability(nip_model model, nip_variable v){
 }
 
 
+int get_probabilities(nip_model model, nip_variable vars[], int nvars, 
+		      double* results[]){
+  int i, j, n;
+  nip_clique* family;
+  nip_variable* group_vars;
+  double** group_results;
+
+  if(!model || (nvars > 0 && (!vars || !results)))
+    return nip_report_error(__FILE__, __LINE__, NIP_ERROR_NULLPOINTER, 1);
+  if(nvars < 1)
+    return NIP_NO_ERROR;
+
+  family = (nip_clique*) calloc(nvars, sizeof(nip_clique));
+  group_vars = (nip_variable*) calloc(nvars, sizeof(nip_variable));
+  group_results = (double**) calloc(nvars, sizeof(double*));
+  if(!family || !group_vars || !group_results){
+    free(family);
+    free(group_vars);
+    free(group_results);
+    return nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+  }
+
+  /* 1. Find the cliques that contain the interesting variables */
+  for(i = 0; i < nvars; i++){
+    family[i] = nip_find_family(model->cliques, model->num_of_cliques, 
+				vars[i]);
+    if(!family[i]){
+      free(family);
+      free(group_vars);
+      free(group_results);
+      return nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+    }
+  }
+
+  /* 2. Propagate the latest evidence, if not done already */
+  update_consistency(model);
+
+  /* 3. Marginalisation: one sweep per clique for all its variables */
+  for(i = 0; i < nvars; i++){
+    if(!family[i])
+      continue; /* done already */
+    n = 0;
+    for(j = i; j < nvars; j++){
+      if(family[j] == family[i]){
+	group_vars[n] = vars[j];
+	group_results[n++] = results[j];
+      }
+    }
+    if(nip_marginalise_clique_variables(model->pool, family[i], 
+					group_vars, n, group_results) != 0){
+      free(family);
+      free(group_vars);
+      free(group_results);
+      return nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+    }
+    for(j = nvars - 1; j >= i; j--)
+      if(family[j] == family[i])
+	family[j] = NULL;
+  }
+
+  /* 4. Normalisation */
+  for(i = 0; i < nvars; i++)
+    nip_normalise_array(results[i], NIP_CARDINALITY(vars[i]));
+
+  free(family);
+  free(group_vars);
+  free(group_results);
+  return NIP_NO_ERROR;
+}
+
+
 nip_potential get_joint_probability(nip_model model, nip_variable *vars, 
 				    int nvars){
   nip_potential p;
   int i;
 
+  /* Propagate the latest evidence, if not done already */
+  update_consistency(model);
+
   /* Unmark all cliques */
   for (i = 0; i < model->num_of_cliques; i++)
     nip_unmark_clique(model->cliques[i]);
 
   /* Make a DFS in the tree... */
-  p = nip_gather_joint_probability(model->cliques[0], 
+  p = nip_gather_joint_probability(model->root, 
 				   vars, nvars, NULL, 0);
   if(p == NULL){
     nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
@@ -2428,8 +3879,7 @@ time_series generate_data(nip_model model, int length){
   
   /* new seed number for rand and clear the previous evidence */
   /*random_seed(NULL);*/
-  reset_model(model);
-  use_priors(model, !NIP_HAD_A_PREVIOUS_TIMESLICE);
+  reset_timeslice(model, !NIP_HAD_A_PREVIOUS_TIMESLICE);
 
   /* for each time step */
   for(t = 0; t < ts->length; t++){
@@ -2470,8 +3920,7 @@ time_series generate_data(nip_model model, int length){
     }
 
     /* Forget old evidence */
-    reset_model(model);
-    use_priors(model, NIP_HAD_A_PREVIOUS_TIMESLICE);
+    reset_timeslice(model, NIP_HAD_A_PREVIOUS_TIMESLICE);
   }
   nip_free_potential(alpha);
   return ts;
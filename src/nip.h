@@ -63,6 +63,42 @@
 enum nip_direction_type {BACKWARD, FORWARD};
 typedef enum nip_direction_type nip_direction; ///< hide enum notation
 
+/**
+ * What forward-backward inference keeps in memory between the phases: 
+ * the messages between time slices (recomputing each time slice in the 
+ * backward phase), checkpoints only every sqrt(T) time steps (also 
+ * recomputing the forward messages between them), or the whole time 
+ * slice of each step (only the message from the future is propagated 
+ * in the backward phase). NIP_MEMORY_AUTO picks the fastest one that 
+ * fits in a given budget.
+ */
+enum nip_memory_policy_type {NIP_MEMORY_INTERFACES, NIP_MEMORY_CHECKPOINTS,
+			     NIP_MEMORY_TIMESLICES, NIP_MEMORY_AUTO};
+typedef enum nip_memory_policy_type nip_memory_policy; ///< hide enum
+
+/**
+ * Time slices compiled into transfer matrices, one for each row of 
+ * observations met so far: the probability mass of a time slice for 
+ * each pair of states of I_{t-1}-> and I_{t}->, and the (unnormalised) 
+ * distributions of all the variables given the pair. 
+ * @see set_transfer_cache()
+ */
+typedef struct {
+  int capacity;    ///< max number of rows to compile
+  int num_of_rows; ///< number of rows compiled so far
+  int size;        ///< S: number of states of the interface
+  int width;       ///< sum of the cardinalities of all the variables
+  int* offset;     ///< where each variable starts within the width
+  int** rows;      ///< observed state (or -1) of each variable, for each row
+  double** tables; /**< for each row: S x S masses, and then the 
+		      distributions given I_{t-1}-> (S x width values) 
+		      and given both (S x S x width values) */
+  int hash_size;   ///< size of the hash table, a power of two
+  int* hash;       ///< index of a row, or -1 (open addressing)
+} nip_transfer_cache_struct;
+
+typedef nip_transfer_cache_struct* nip_transfer_cache; ///< cache reference
+
 /**
  * Data structure containing all necessary stuff for running 
  * probabilistic inference with a model for a single time step, 
@@ -71,6 +107,21 @@ typedef enum nip_direction_type nip_direction; ///< hide enum notation
 typedef struct {
   int num_of_cliques;  ///< number of cliques/potentials in the join tree
   nip_clique *cliques; ///< the actual cliques/potentials
+  nip_clique root;       ///< the clique where evidence is collected to
+  nip_schedule schedule; ///< the order of message passes in the join tree
+  nip_thread_pool pool;  ///< worker threads for propagation, or NULL
+  int evidence_epoch;   ///< incremented whenever evidence etc. changes
+  int consistent_epoch; ///< evidence_epoch at the latest make_consistent()
+  nip_potential_arena arena; ///< the tables of the cliques and sepsets
+  double* snapshot[2]; /**< the tables right after reset_timeslice() 
+			  without and with history, or NULL if not taken */
+  double prior_mass; /**< mass of the first time slice without evidence, 
+			or negative if not computed since total_reset() */
+  int prior_interface_known; /**< prior_interface_mass computed since 
+				total_reset() */
+  nip_memory_policy memory_policy; ///< for forward-backward inference
+  size_t memory_budget; ///< bytes for NIP_MEMORY_AUTO
+  nip_transfer_cache transfer_cache; ///< compiled time slices, or NULL
 
   int num_of_vars;         ///< number of random variables in the model
   nip_variable *variables; ///< the actual variables (names of values etc.)
@@ -92,6 +143,13 @@ typedef struct {
 			    from the past timeslices */
   nip_clique out_clique; /**< The clique which handles the connection to the 
 			    future timeslices */
+  int* in_clique_stride;  /**< Message plan between in_clique and 
+			     I_{t-1}-> (precomputed strides) */
+  int* out_clique_stride; /**< Message plan between out_clique and 
+			     I_{t}-> (precomputed strides) */
+  nip_potential prior_interface_mass; /**< Probability mass of a time slice 
+					 without evidence, for each state 
+					 of I_{t-1}-> */
 
   int num_of_children;       ///< number of children < num_of_vars
   nip_variable *children;    ///< all the variables that have parents
@@ -123,7 +181,38 @@ typedef struct {
 
 typedef time_series_struct* time_series; ///< Reference to a time series
 
-/* TODO: Should there be something else for streams / online inference? */
+/**
+ * State of an online forward filter: only the message from the latest 
+ * time step is kept, so the memory needed does not grow with the stream
+ */
+typedef struct {
+  nip_model model;      ///< The model (used by this filter only)
+  nip_potential alpha;  ///< Message from the latest time step to the next
+  int t;                ///< Number of time steps pushed so far
+  double mass_first;    ///< Probability mass of the first step without data
+  double loglikelihood; ///< Log. likelihood of the steps not popped yet
+} forward_filter_struct;
+
+typedef forward_filter_struct* forward_filter; ///< Reference to a filter
+
+/**
+ * State of an online fixed-lag smoother: the filter and rings of the 
+ * latest L+1 forward messages and observations, reused step after step
+ */
+typedef struct {
+  forward_filter filter;  ///< The forward pass (and the log. likelihood)
+  int lag;                ///< L: delay of the smoothed results
+  nip_potential* alpha;   ///< Forward messages, step s in [s % (L+1)]
+  nip_variable** vars;    ///< Observed variables, step s in [s % (L+1)]
+  int** states;           ///< Observed states, step s in [s % (L+1)]
+  int* num_of_obs;        ///< Number of observations of each step
+  int capacity;           ///< Allocated size of each vars[i] and states[i]
+  nip_potential gamma;    ///< Message from the future within the lag
+  int t;                  ///< Time step of the smoothed results, or -1
+  int current;            ///< Time step held in the model, or -1
+} fixed_lag_smoother_struct;
+
+typedef fixed_lag_smoother_struct* fixed_lag_smoother; ///< Reference
 
 /**
  * Structure for storing "soft" uncertain observations or inference results
@@ -154,6 +243,8 @@ void reset_model(nip_model model);
  * In other words, the model will be as if it was never initialised with 
  * any parameters at all. 
  * (All the variables and the join tree will be there, of course)
+ * Also discards the snapshots taken by reset_timeslice(), the prior 
+ * probability masses, and the time slices compiled by set_transfer_cache().
  * @param model Your pointer to the whole probabilistic model */
 void total_reset(nip_model model);
 
@@ -173,6 +264,19 @@ void total_reset(nip_model model);
 void use_priors(nip_model model, int has_history);
 
 
+/**
+ * Same as reset_model() followed by use_priors(), but much faster 
+ * after the first time: the resulting clique potentials are saved 
+ * (separately for each value of \p has_history) and then just copied 
+ * back. The snapshots are discarded by total_reset(), which should be 
+ * called if the parameters or priors of the model are changed.
+ * @param model Your pointer to the whole probabilistic model
+ * @param has_history Non-zero (true) when considering incoming
+ * evidence from a previous time slice instead of priors
+ * @see use_priors() */
+void reset_timeslice(nip_model model, int has_history);
+
+
 /**
  * Creates a model according to a net file. 
  * Remember to free the model when done with it.
@@ -300,26 +404,54 @@ int set_observation(time_series ts, nip_variable v, int time,
 
 
 /**
- * Tells the model about observations in current time step. 
+ * Tells the model about observations in current time step, and 
+ * makes the join tree consistent right away. 
  * @param model Your pointer to the whole probabilistic model
  * @param varname Name of the observed model variable
  * @param observation The observed state
  * @return In case of an error, a non-zero value is returned. 
+ * @see enter_hard_evidence()
  */
 int insert_hard_evidence(nip_model model, char* varname, char* observation);
 
 
 /**
  * If an observation has some uncertainty, the evidence can be inserted 
- * with this procedure. 
+ * with this procedure. Makes the join tree consistent right away.
  * @param model Your pointer to the whole probabilistic model
  * @param varname Name of the variable
  * @param distribution Array of probabilities [0.0, 1.0] of each state
  * @return NIP_NO_ERROR if everything went well. 
+ * @see enter_soft_evidence()
  */
 int insert_soft_evidence(nip_model model, char* varname, double* distribution);
 
 
+/**
+ * Like insert_hard_evidence(), but without the propagation: the model 
+ * is just marked out of date, and the join tree is made consistent 
+ * only when needed by get_probability(), get_joint_probability(), or 
+ * model_prob_mass(). Entering many observations this way costs only 
+ * one propagation.
+ * @param model Your pointer to the whole probabilistic model
+ * @param varname Name of the observed model variable
+ * @param observation The observed state
+ * @return In case of an error, a non-zero value is returned. 
+ */
+int enter_hard_evidence(nip_model model, char* varname, char* observation);
+
+
+/**
+ * Like insert_soft_evidence(), but without the propagation.
+ * @param model Your pointer to the whole probabilistic model
+ * @param varname Name of the variable
+ * @param distribution Array of probabilities [0.0, 1.0] of each state
+ * @return NIP_NO_ERROR if everything went well. 
+ * @see enter_hard_evidence()
+ */
+int enter_soft_evidence(nip_model model, char* varname, double* distribution);
+
+
 /**
  * Method for inserting part of the evidence at a specified step \p t in a
  * time series \p ts into the (time slice) \p model. 
@@ -339,6 +471,24 @@ int insert_soft_evidence(nip_model model, char* varname, double* distribution);
 int insert_ts_step(time_series ts, int t, nip_model model, char mark_mask);
 
 
+/**
+ * Tells the model about many observations at once, e.g. all of a 
+ * time step: does the same as enter_hard_evidence() for each, but 
+ * the clique potentials are updated in one sweep each, and with at 
+ * most one retraction of the earlier evidence. The join tree is made 
+ * consistent only when needed. 
+ * @param model The inference engine
+ * @param vars The observed variables
+ * @param states For each variable, the index of the observed state, 
+ *   or a negative value if missing
+ * @param n Size of the arrays \p vars and \p states
+ * @return In case of an error, a non-zero value is returned, 
+ *   and none of the observations is entered. 
+ * @see insert_ts_step() */
+int insert_evidence_batch(nip_model model, nip_variable vars[], 
+			  int states[], int n);
+
+
 /**
  * Method for inserting part of the evidence at a specified step \p t
  * in an uncertain time series \p ucs into \p model. 
@@ -383,6 +533,157 @@ uncertain_series forward_inference(time_series ts, nip_variable vars[],
 				   int nvars, double* loglikelihood);
 
 
+/**
+ * The same as forward_inference(), but parallel in time: for each
+ * distinct row of observations, the time slice is compiled once into
+ * a matrix from the message of the previous step to the next one 
+ * (or taken from the cache of set_transfer_cache()), and
+ * the series of matrices is processed as a prefix scan in chunks by
+ * the threads given by set_num_of_threads(). This pays off for long
+ * series with a small interface between time slices and a modest
+ * number of distinct observation rows; otherwise this falls back to
+ * forward_inference(). The results are the same up to rounding
+ * errors, and do not depend on the number of threads.
+ * @param ts The input data
+ * @param vars Variables of interest
+ * @param nvars Length of \p vars
+ * @param loglikelihood A pointer where the log. likelihood is written
+ * @return Marginal probability distributions of each variable of
+ * interest for each time step given the past evidence
+ * @see forward_inference()
+ */
+uncertain_series forward_inference_scan(time_series ts, nip_variable vars[],
+					int nvars, double* loglikelihood);
+
+
+/**
+ * Creates an online forward filter: the same inference as 
+ * forward_inference(), but one time step at a time as the data arrives. 
+ * The model must not be used for anything else while filtering. 
+ * @param model The model
+ * @return a new filter at the beginning of a time series, or NULL 
+ * @see filter_step()
+ */
+forward_filter new_forward_filter(nip_model model);
+
+
+/**
+ * Frees the filter, but not the model.
+ * @param f The filter
+ */
+void free_forward_filter(forward_filter f);
+
+
+/**
+ * Makes the filter start a new time series, forgetting the old one 
+ * and its unpopped log. likelihood.
+ * @param f The filter
+ */
+void restart_forward_filter(forward_filter f);
+
+
+/**
+ * Pushes the observations of the next time step through the filter. 
+ * The other variables are unobserved at this step.
+ * @param f The filter
+ * @param vars Observed variables
+ * @param states Observed state of each variable (negative if missing)
+ * @param n Length of \p vars and \p states
+ * @return an error code, or 0 if successful
+ */
+int filter_step(forward_filter f, nip_variable vars[], int states[], int n);
+
+
+/**
+ * Computes the filtered distributions of the variables of interest 
+ * at the latest time step, given all the steps pushed so far.
+ * @param f The filter, after at least one filter_step()
+ * @param vars Variables of interest
+ * @param nvars Length of \p vars
+ * @param results Arrays of size NIP_CARDINALITY(vars[i]) for the results
+ * @return an error code, or 0 if successful
+ * @see get_probabilities()
+ */
+int filter_probabilities(forward_filter f, nip_variable vars[], int nvars, 
+			 double* results[]);
+
+
+/**
+ * Tells the log. likelihood of the time steps pushed after the 
+ * previous call, and starts accumulating again from zero.
+ * @param f The filter
+ * @return ln(p(y(s:t) | y(0:s-1))) of the steps s..t since the last call
+ */
+double pop_filter_loglikelihood(forward_filter f);
+
+
+/**
+ * Creates an online fixed-lag smoother: when time step t arrives, 
+ * the distributions of step t-L are computed given the steps 0..t. 
+ * Memory and the work per step grow with L, not with the length of 
+ * the time series. The model must not be used for anything else 
+ * while smoothing.
+ * @param model The model
+ * @param lag L >= 0, the delay in time steps (0 means filtering)
+ * @return a new smoother at the beginning of a time series, or NULL
+ * @see smoother_step()
+ */
+fixed_lag_smoother new_fixed_lag_smoother(nip_model model, int lag);
+
+
+/**
+ * Frees the smoother, but not the model.
+ * @param sm The smoother
+ */
+void free_fixed_lag_smoother(fixed_lag_smoother sm);
+
+
+/**
+ * Makes the smoother start a new time series.
+ * @param sm The smoother
+ */
+void restart_fixed_lag_smoother(fixed_lag_smoother sm);
+
+
+/**
+ * Pushes the observations of the next time step t through the 
+ * smoother, and smooths step t-L if t >= L: then sm->t == t-L.
+ * The log. likelihood is available through sm->filter.
+ * @param sm The smoother
+ * @param vars Observed variables
+ * @param states Observed state of each variable (negative if missing)
+ * @param n Length of \p vars and \p states
+ * @return an error code, or 0 if successful
+ * @see pop_filter_loglikelihood()
+ */
+int smoother_step(fixed_lag_smoother sm, nip_variable vars[], int states[], 
+		  int n);
+
+
+/**
+ * At the end of a time series, smooths the next of the last L steps 
+ * given the whole series: sm->t is incremented. Does nothing when 
+ * sm->t already is the last step. Continue with 
+ * restart_fixed_lag_smoother() after this.
+ * @param sm The smoother
+ * @return an error code, or 0 if successful
+ */
+int smoother_flush(fixed_lag_smoother sm);
+
+
+/**
+ * Computes the smoothed distributions of the variables of interest 
+ * at time step sm->t.
+ * @param sm The smoother, with sm->t >= 0
+ * @param vars Variables of interest
+ * @param nvars Length of \p vars
+ * @param results Arrays of size NIP_CARDINALITY(vars[i]) for the results
+ * @return an error code, or 0 if successful
+ */
+int smoother_probabilities(fixed_lag_smoother sm, nip_variable vars[], 
+			   int nvars, double* results[]);
+
+
 /**
  * This one computes the probability distributions for every variable
  * of interest and for every time step according to the timeseries.
@@ -422,12 +723,84 @@ nip_variable model_variable(nip_model model, char* symbol);
 /**
  * Makes the join tree consistent i.e. does the inference on a single
  * timeslice. Useful after inserting evidence, which does not include
- * this.
+ * this. The message passes follow the precompiled model->schedule.
  * @param model The inference engine
  */
 void make_consistent(nip_model model);
 
 
+/**
+ * Sets the number of threads used for propagating evidence in the 
+ * join tree: the independent branches are processed in parallel, and 
+ * the largest tables split among the threads. The results are exactly 
+ * the same as with a single thread, whatever the number of threads. 
+ * The default is given by the environment variable NIP_NUM_THREADS.
+ * @param model The inference engine
+ * @param n Number of threads, 1 for serial propagation
+ * @return an error code, or 0 if successful
+ */
+int set_num_of_threads(nip_model model, int n);
+
+
+/**
+ * Chooses what forward_backward_inference() and em_learn() keep in 
+ * memory for the backward phase. The default is NIP_MEMORY_INTERFACES. 
+ * NIP_MEMORY_TIMESLICES is the fastest, but needs memory for the whole 
+ * join tree for each time step. NIP_MEMORY_CHECKPOINTS needs the 
+ * least memory, O(sqrt(T)) messages, but propagates each time slice 
+ * once more than NIP_MEMORY_INTERFACES. The results are the same 
+ * up to rounding errors.
+ * @param model The inference engine
+ * @param policy The policy, or NIP_MEMORY_AUTO for choosing for each 
+ * time series the fastest one that fits in \p budget
+ * @param budget Bytes available for NIP_MEMORY_AUTO
+ * @return an error code, or 0 if successful
+ */
+int set_memory_policy(nip_model model, nip_memory_policy policy, 
+		      size_t budget);
+
+
+/**
+ * Tells which policy forward_backward_inference() and em_learn() use 
+ * for a time series of the given length: the one set with 
+ * set_memory_policy(), or the one NIP_MEMORY_AUTO chooses.
+ * @param model The inference engine
+ * @param length Number of time steps
+ * @return the policy, never NIP_MEMORY_AUTO
+ */
+nip_memory_policy get_memory_policy(nip_model model, int length);
+
+
+/**
+ * Makes forward_inference(), forward_backward_inference(), and 
+ * forward_inference_scan() compile each time slice into dense transfer 
+ * matrices, once for each distinct row of (marked) observations, and 
+ * then use matrix-vector products instead of propagating the join tree. 
+ * A row costs S x S propagations to compile, where S is the number of 
+ * states of the interface between time slices, and S x (S + W + S x W)
+ * numbers of memory, where W is the sum of the cardinalities of all the 
+ * variables. 
+ * The rows beyond \p capacity, and the first time step, use the join 
+ * tree as usual. The cache is emptied by total_reset(), i.e. when the 
+ * parameters change, but em_learn() itself does not use it. 
+ * The results are the same up to rounding errors.
+ * @param model The inference engine (with S <= 64)
+ * @param capacity Max number of rows to compile, 0 for none
+ * @return an error code, or 0 if successful
+ */
+int set_transfer_cache(nip_model model, int capacity);
+
+
+/**
+ * Makes the join tree consistent only if evidence has changed 
+ * (through the functions of this interface) after the latest 
+ * make_consistent(). 
+ * @param model The inference engine
+ * @see make_consistent()
+ */
+void update_consistency(nip_model model);
+
+
 /**
  * Computes the most likely state sequence of the variables of
  * interest, given the time series observations. In other words, this
@@ -467,7 +840,7 @@ int em_learn(time_series* ts, int n_ts, double threshold,
 /**
  * Tells the likelihood of observations (not normalised). 
  * You must normalise the result with the mass computed before 
- * the evidence was put in. 
+ * the evidence was put in. Propagates the evidence if necessary.
  * @param model The inference engine
  * @return Relative sum over all cliques of the join tree
  */
@@ -476,7 +849,8 @@ double model_prob_mass(nip_model model);
 
 /**
  * Calculates the marginal probability distribution of a variable.
- * The join tree MUST be consistent before calling this.
+ * Propagates the evidence if necessary, but only towards the clique 
+ * containing the variable and its parents: a single inward pass.
  * @param model NIP model that contains the variable
  * @param v Random variable of interest
  * @return an array of doubles (remember to free the result when not needed).
@@ -486,10 +860,27 @@ double model_prob_mass(nip_model model);
  */
 double* get_probability(nip_model model, nip_variable v);
 
+/**
+ * Calculates the marginal probability distributions of several variables 
+ * at once. Propagates the evidence if necessary. The variables sharing 
+ * a family clique are marginalised in a single sweep over its potential, 
+ * which is much faster than get_probability() for each variable when 
+ * asking e.g. all the hidden variables.
+ * @param model NIP model that contains the variables
+ * @param vars Array of \p nvars random variables of interest
+ * @param nvars Number of variables
+ * @param results Array of \p nvars arrays where the distributions 
+ * get written: results[i] must be of size vars[i]->cardinality
+ * @return an error code, or 0 if successful
+ * @see get_probability()
+ */
+int get_probabilities(nip_model model, nip_variable vars[], int nvars, 
+		      double* results[]);
+
 
 /**
  * Calculates the joint probability distribution of a set of variables.
- * The join tree MUST be consistent before calling this.
+ * Propagates the evidence if necessary.
  * @param model The model that contains the variables
  * @param vars  The variables whose distribution we want
  * @param num_of_vars The number of variables (size of "vars")
@@ -21,6 +21,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "niperrorhandler.h"
@@ -36,9 +37,20 @@
 /**
  * Spreading evidence from one clique to another.
  * The message goes from clique \p c1 through sepset \p s to clique \p c2.
+ * Large potentials are processed in parallel by \p pool, unless NULL.
  * @return an error code, or 0 if successful
  */
-static int nip_message_pass(nip_clique c1, nip_sepset s, nip_clique c2);
+static int nip_message_pass(nip_thread_pool pool, 
+			    nip_clique c1, nip_sepset s, nip_clique c2);
+
+/* The two halves of message passes: clique c projects its potential 
+ * into the n sepsets s[] (swapping their old and new potentials first), 
+ * or absorbs the news in them. Several sepsets are done in one sweep 
+ * over the clique potential, unless it is large enough for the pool. */
+static int nip_project_messages(nip_thread_pool pool, nip_clique c, 
+				nip_sepset s[], int n);
+static int nip_absorb_messages(nip_thread_pool pool, nip_clique c, 
+			       nip_sepset s[], int n);
 
 /* Tells which variable v is in clique c */
 static int nip_clique_var_index(nip_clique c, nip_variable v);
@@ -68,9 +80,55 @@ static int nip_retract_sepset(nip_sepset s, double* ptr);
 static int nip_clique_mass(nip_clique c, double* ptr);
 static int nip_neg_sepset_mass(nip_sepset s, double* ptr);
 
+/**
+ * Recursive helpers for nip_new_schedule(): these mimic 
+ * nip_collect_evidence() and nip_distribute_evidence(), but only record 
+ * the message passes into \p sch->collect or \p sch->distribute. 
+ * The collect also links each message to the next one (\p sch->parent), 
+ * and the distribute reverses the collect messages received by the 
+ * sender of message \p k (the root, if k is the number of messages). */
+static void nip_schedule_collect(nip_schedule sch, nip_clique c1, 
+				 nip_sepset s12, nip_clique c2);
+static void nip_schedule_distribute(nip_schedule sch, int k, 
+				    int first[], int next[], int* n);
+
+/* Groups the messages of a schedule into levels for parallel propagation. 
+ * The messages sent to each receiver k of the collect (k = n for the 
+ * root) are first[k], next[first[k]] and so on, in ascending order. */
+static int nip_schedule_levels(nip_schedule sch, int first[], int next[]);
+
+/* Arguments for the parallel tasks: the tasks of one level */
+typedef struct {
+  nip_schedule s;
+  int first; /* index of the first task of the level */
+  nip_thread_pool kernel_pool; /* for the potentials, if a single task */
+} nip_schedule_level_struct;
+
+/* Parallel tasks: all the messages to one clique in collect, 
+ * and in distribute all the messages from one clique (projection) 
+ * or one message (absorption) */
+static int nip_collect_group(void* data, int i);
+static int nip_distribute_group(void* data, int i);
+static int nip_distribute_message(void* data, int i);
+
 /* Internal function for removing s from c */
 static void nip_remove_sepset(nip_clique c, nip_sepset s);
 
+/* Permutes the dimensions of clique c: new dimension i is old order[i]. 
+ * Updates the mappings that depend on the order of the variables. */
+static int nip_reorder_clique(nip_clique c, int order[]);
+
+/* Records that the potential of c is zero except where its var:th 
+ * variable has the given state. */
+static void nip_slice_clique(nip_clique c, int var, int index);
+
+/* Returns the only nonzero index of likelihood, or -1 */
+static int nip_single_state(double likelihood[], int n);
+
+/* Copies potential p with its dimensions permuted: 
+ * new dimension i is old order[i] */
+static nip_potential nip_permute_potential(nip_potential p, int order[]);
+
 
 nip_clique nip_new_clique(nip_variable vars[], int nvars){
   nip_clique c;
@@ -150,15 +208,17 @@ nip_clique nip_new_clique(nip_variable vars[], int nvars){
   
   c->p = nip_new_potential(cardinality, nvars, NULL);
   c->original_p = nip_new_potential(cardinality, nvars, NULL);
+  c->slice = (int *) calloc(nvars, sizeof(int));
 
   /* Propagation of error */
-  if(c->p == NULL || c->original_p == NULL){
+  if(c->p == NULL || c->original_p == NULL || c->slice == NULL){
     free(cardinality);
     free(indices);
     free(reorder);
     free(c->variables);
     nip_free_potential(c->p);
     nip_free_potential(c->original_p);
+    free(c->slice);
     free(c);
     nip_report_error(__FILE__, __LINE__, EFAULT, 1);
     return NULL;
@@ -169,6 +229,10 @@ nip_clique nip_new_clique(nip_variable vars[], int nvars){
   free(reorder);
   c->sepsets = NULL;
   c->mark = NIP_MARK_OFF;
+  c->dirty = 1; /* never propagated */
+  for(i = 0; i < nvars; i++)
+    c->slice[i] = -1; /* no evidence yet */
+  c->sliced = 0;
 
   return c;
 }
@@ -203,6 +267,7 @@ void nip_free_clique(nip_clique c){
   nip_free_potential(c->p);
   nip_free_potential(c->original_p);
   free(c->variables);
+  free(c->slice);
   free(c);
   return;
 }
@@ -284,6 +349,12 @@ nip_sepset nip_new_sepset(nip_clique neighbour_a, nip_clique neighbour_b){
   /* Take the intersection of two cliques. */
   s->first_neighbour = neighbour_a;
   s->second_neighbour = neighbour_b;
+  s->first_mapping = NULL;
+  s->second_mapping = NULL;
+  s->first_stride = NULL;
+  s->second_stride = NULL;
+  s->old = NULL;
+  s->new = NULL;
   s->variables = nip_variable_isect(neighbour_a->variables, 
 				    neighbour_b->variables, 
 				    NIP_DIMENSIONALITY(neighbour_a->p),
@@ -321,6 +392,31 @@ nip_sepset nip_new_sepset(nip_clique neighbour_a, nip_clique neighbour_b){
     return NULL;
   }
 
+  /* The message plan: mappings and strides are computed only once here, 
+   * so that message passes don't need to search or allocate anything */
+  s->first_stride = (int *) calloc(NIP_DIMENSIONALITY(neighbour_a->p), 
+				   sizeof(int));
+  s->second_stride = (int *) calloc(NIP_DIMENSIONALITY(neighbour_b->p), 
+				    sizeof(int));
+  if(isect_size > 0){
+    s->first_mapping = nip_mapper(neighbour_a->variables, s->variables, 
+				  NIP_DIMENSIONALITY(neighbour_a->p), 
+				  isect_size);
+    s->second_mapping = nip_mapper(neighbour_b->variables, s->variables, 
+				   NIP_DIMENSIONALITY(neighbour_b->p), 
+				   isect_size);
+  }
+  if(!s->first_stride || !s->second_stride || 
+     (isect_size > 0 && (!s->first_mapping || !s->second_mapping))){
+    nip_free_sepset(s);
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    return NULL;
+  }
+  nip_mapping_strides(neighbour_a->p, s->new->cardinality, s->first_mapping, 
+		      isect_size, s->first_stride);
+  nip_mapping_strides(neighbour_b->p, s->new->cardinality, s->second_mapping, 
+		      isect_size, s->second_stride);
+
   return s;
 }
 
@@ -330,6 +426,10 @@ void nip_free_sepset(nip_sepset s){
     nip_free_potential(s->old);
     nip_free_potential(s->new);
     free(s->variables);
+    free(s->first_mapping);
+    free(s->second_mapping);
+    free(s->first_stride);
+    free(s->second_stride);
     free(s);
   }
   return;
@@ -578,7 +678,7 @@ int nip_cliques_connected(nip_clique one, nip_clique two){
 
 
 int nip_distribute_evidence(nip_clique c){
-  int err;
+  int i, n, err;
   nip_sepset_link l;
   nip_sepset s;
 
@@ -590,21 +690,34 @@ int nip_distribute_evidence(nip_clique c){
   /* mark */
   c->mark = NIP_MARK_ON;
 
-  /* pass the messages */
-  l = c->sepsets;
-  while (l != 0){
-    s = l->data;
-    if(!nip_clique_marked(s->first_neighbour)){
-      err = nip_message_pass(c, s, s->first_neighbour); /* pass a message */
-      if(err != 0)
-	return nip_report_error(__FILE__, __LINE__, err, 1);
+  /* pass the messages: project into all the sepsets at once... */
+  n = 0;
+  for(l = c->sepsets; l != NULL; l = l->fwd)
+    n++;
+  {
+    nip_sepset out[n + 1];
+    nip_clique to[n + 1];
+    n = 0;
+    for(l = c->sepsets; l != NULL; l = l->fwd){
+      s = l->data;
+      if(!nip_clique_marked(s->first_neighbour))
+	to[n] = s->first_neighbour;
+      else if(!nip_clique_marked(s->second_neighbour))
+	to[n] = s->second_neighbour;
+      else
+	continue;
+      out[n++] = s;
     }
-    else if(!nip_clique_marked(s->second_neighbour)){
-      err = nip_message_pass(c, s, s->second_neighbour); /* pass a message */
+    err = nip_project_messages(NULL, c, out, n);
+    if(err != 0)
+      return nip_report_error(__FILE__, __LINE__, err, 1);
+
+    /* ...and let the neighbours absorb them */
+    for(i = 0; i < n; i++){
+      err = nip_absorb_messages(NULL, to[i], &(out[i]), 1);
       if(err != 0)
 	return nip_report_error(__FILE__, __LINE__, err, 1);
     }
-    l = l->fwd;
   }
 
   /* call neighboring cliques */
@@ -655,7 +768,7 @@ int nip_collect_evidence(nip_clique c1, nip_sepset s12, nip_clique c2){
 
   /* pass the message to c1 */
   if((c1 != NULL) && (s12 != NULL)){
-    err = nip_message_pass(c2, s12, c1);
+    err = nip_message_pass(NULL, c2, s12, c1);
     if(err != 0)
       return nip_report_error(__FILE__, __LINE__, err, 1);
   }
@@ -673,35 +786,21 @@ int nip_collect_evidence(nip_clique c1, nip_sepset s12, nip_clique c2){
 }
 
 
-static int nip_message_pass(nip_clique c1, nip_sepset s, nip_clique c2){
+static int nip_message_pass(nip_thread_pool pool, 
+			    nip_clique c1, nip_sepset s, nip_clique c2){
   int err;
-  int *mapping;
-
-  /* save the newer potential as old by switching the pointers */
-  nip_potential temp;
-  temp = s->old;
-  s->old = s->new;
-  s->new = temp;
 
   /*
    * Marginalise (projection). Information flows from clique c1 to sepset s.
    */
-  mapping = nip_mapper(c1->variables, s->variables, 
-		       NIP_DIMENSIONALITY(c1->p), 
-		       NIP_DIMENSIONALITY(s->new));
-  err = nip_general_marginalise(c1->p, s->new, mapping);
-  free(mapping);
+  err = nip_project_messages(pool, c1, &s, 1);
   if(err != 0)
     return nip_report_error(__FILE__, __LINE__, err, 1);
 
   /*
    * Update (absorption). Information flows from sepset s to clique c2.
    */
-  mapping = nip_mapper(c2->variables, s->variables, 
-		       NIP_DIMENSIONALITY(c2->p), 
-		       NIP_DIMENSIONALITY(s->new));
-  err = nip_update_potential(s->new, s->old, c2->p, mapping);
-  free(mapping);
+  err = nip_absorb_messages(pool, c2, &s, 1);
   if(err != 0)
     return nip_report_error(__FILE__, __LINE__, err, 1);
 
@@ -709,6 +808,636 @@ static int nip_message_pass(nip_clique c1, nip_sepset s, nip_clique c2){
 }
 
 
+static int nip_project_messages(nip_thread_pool pool, nip_clique c, 
+				nip_sepset s[], int n){
+  int i, err;
+  nip_potential temp;
+  nip_potential dst[n + 1];
+  int* stride[n + 1];
+
+  for(i = 0; i < n; i++){
+    /* the message plan precomputed for this direction */
+    if(c == s[i]->first_neighbour)
+      stride[i] = s[i]->first_stride;
+    else
+      stride[i] = s[i]->second_stride;
+
+    /* save the newer potential as old by switching the pointers */
+    temp = s[i]->old;
+    s[i]->old = s[i]->new;
+    s[i]->new = temp;
+    dst[i] = s[i]->new;
+  }
+
+  if(c->sliced > 0){
+    /* the rest of c->p is zeros: skip them */
+    err = nip_fused_sliced_marginalise(c->p, dst, stride, n, c->slice);
+    if(err != 0)
+      return nip_report_error(__FILE__, __LINE__, err, 1);
+    return 0;
+  }
+
+  if(n > 1 && 
+     (pool == NULL || pool->num_of_threads < 2 || 
+      c->p->size_of_data < NIP_PARALLEL_KERNEL_SIZE))
+    return nip_fused_marginalise(c->p, dst, stride, n);
+
+  for(i = 0; i < n; i++){
+    err = nip_parallel_marginalise(pool, c->p, dst[i], stride[i]);
+    if(err != 0)
+      return nip_report_error(__FILE__, __LINE__, err, 1);
+  }
+  return 0;
+}
+
+
+static int nip_absorb_messages(nip_thread_pool pool, nip_clique c, 
+			       nip_sepset s[], int n){
+  int i, j, err;
+  nip_clique from;
+  int *from_mapping, *to_mapping;
+  nip_potential num[n + 1];
+  nip_potential den[n + 1];
+  int* stride[n + 1];
+
+  for(i = 0; i < n; i++){
+    if(c == s[i]->first_neighbour)
+      stride[i] = s[i]->first_stride;
+    else
+      stride[i] = s[i]->second_stride;
+    num[i] = s[i]->new;
+    den[i] = s[i]->old;
+  }
+
+  if(c->sliced > 0){
+    err = nip_fused_sliced_update(num, den, c->p, stride, n, c->slice);
+    if(err != 0)
+      return nip_report_error(__FILE__, __LINE__, err, 1);
+  }
+  else if(n > 1 && 
+	  (pool == NULL || pool->num_of_threads < 2 || 
+	   c->p->size_of_data < NIP_PARALLEL_KERNEL_SIZE)){
+    err = nip_fused_update(num, den, c->p, stride, n);
+    if(err != 0)
+      return nip_report_error(__FILE__, __LINE__, err, 1);
+  }
+  else{
+    for(i = 0; i < n; i++){
+      err = nip_parallel_update(pool, num[i], den[i], c->p, stride[i]);
+      if(err != 0)
+	return nip_report_error(__FILE__, __LINE__, err, 1);
+    }
+  }
+
+  /* A message from a sliced clique is zero outside the slice, 
+   * and so is c->p now */
+  for(i = 0; i < n; i++){
+    if(c == s[i]->first_neighbour){
+      from = s[i]->second_neighbour;
+      from_mapping = s[i]->second_mapping;
+      to_mapping = s[i]->first_mapping;
+    }
+    else{
+      from = s[i]->first_neighbour;
+      from_mapping = s[i]->first_mapping;
+      to_mapping = s[i]->second_mapping;
+    }
+    if(from->sliced == 0)
+      continue;
+    for(j = 0; j < NIP_DIMENSIONALITY(s[i]->new); j++)
+      if(from->slice[from_mapping[j]] >= 0)
+	nip_slice_clique(c, to_mapping[j], from->slice[from_mapping[j]]);
+  }
+  return 0;
+}
+
+
+nip_schedule nip_new_schedule(nip_clique* cliques, int ncliques, 
+			      nip_clique root){
+  int i, j, n;
+  int* first;
+  int* next;
+  nip_schedule sch;
+
+  sch = (nip_schedule) malloc(sizeof(nip_schedule_struct));
+  if(!sch){
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    return NULL;
+  }
+  sch->root = root;
+  sch->num_of_messages = 0;
+  sch->pool = NULL;
+  sch->num_of_levels = 0;
+
+  /* a tree of n cliques has n-1 sepsets (+1 to avoid calloc(0,...)) */
+  sch->collect = (nip_message_struct*) 
+    calloc(ncliques + 1, sizeof(nip_message_struct));
+  sch->distribute = (nip_message_struct*) 
+    calloc(ncliques + 1, sizeof(nip_message_struct));
+  sch->parent = (int*) calloc(ncliques + 1, sizeof(int));
+  sch->collect_index = (int*) calloc(ncliques + 1, sizeof(int));
+  sch->dirty_count = (int*) calloc(ncliques + 1, sizeof(int));
+  sch->collect_stale = (int*) calloc(ncliques + 1, sizeof(int));
+  sch->distribute_stale = (int*) calloc(ncliques + 1, sizeof(int));
+  sch->collect_order = (int*) calloc(ncliques + 1, sizeof(int));
+  sch->collect_group = (int*) calloc(ncliques + 1, sizeof(int));
+  sch->collect_level = (int*) calloc(ncliques + 1, sizeof(int));
+  sch->distribute_order = (int*) calloc(ncliques + 1, sizeof(int));
+  sch->distribute_group = (int*) calloc(ncliques + 1, sizeof(int));
+  sch->distribute_level = (int*) calloc(ncliques + 1, sizeof(int));
+  if(!sch->collect || !sch->distribute || 
+     !sch->parent || !sch->collect_index || !sch->dirty_count ||
+     !sch->collect_stale || !sch->distribute_stale || 
+     !sch->collect_order || !sch->collect_group || !sch->collect_level ||
+     !sch->distribute_order || !sch->distribute_group || 
+     !sch->distribute_level){
+    nip_free_schedule(sch);
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    return NULL;
+  }
+
+  if(root == NULL)
+    return sch; /* nothing to do */
+
+  for(i = 0; i < ncliques; i++)
+    nip_unmark_clique(cliques[i]);
+  nip_schedule_collect(sch, NULL, NULL, root);
+  n = sch->num_of_messages;
+
+  /* the messages sent to each clique, in the order of the collect */
+  first = (int*) malloc((n + 1) * sizeof(int));
+  next = (int*) malloc((n + 1) * sizeof(int));
+  if(!first || !next){
+    free(first);
+    free(next);
+    nip_free_schedule(sch);
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    return NULL;
+  }
+  for(i = 0; i <= n; i++)
+    first[i] = -1;
+  for(i = n - 1; i >= 0; i--){
+    j = (sch->parent[i] < 0) ? n : sch->parent[i];
+    next[i] = first[j];
+    first[j] = i;
+  }
+
+  /* the distribute sends the same messages backwards */
+  j = 0;
+  nip_schedule_distribute(sch, n, first, next, &j);
+  assert(j == n);
+
+  i = nip_schedule_levels(sch, first, next);
+  free(first);
+  free(next);
+  if(i != 0){
+    nip_free_schedule(sch);
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    return NULL;
+  }
+
+  return sch;
+}
+
+
+static int nip_schedule_levels(nip_schedule sch, int first[], int next[]){
+  int i, j, d, k, g, n;
+  int* depth;
+  int* order;
+  int* start;
+
+  n = sch->num_of_messages;
+  depth = (int*) calloc(n + 1, sizeof(int));
+  order = (int*) calloc(n + 1, sizeof(int));
+  start = (int*) calloc(n + 2, sizeof(int));
+  if(!depth || !order || !start){
+    free(depth);
+    free(order);
+    free(start);
+    return ENOMEM;
+  }
+
+  /* depth of the sender of each collect message 
+   * (the receivers are later in the schedule) */
+  sch->num_of_levels = 0;
+  for(i = n - 1; i >= 0; i--){
+    depth[i] = (sch->parent[i] < 0) ? 1 : depth[sch->parent[i]] + 1;
+    if(depth[i] > sch->num_of_levels)
+      sch->num_of_levels = depth[i];
+  }
+
+  /* the messages sorted by depth, otherwise in their original order */
+  for(i = 0; i < n; i++)
+    start[depth[i] + 1]++;
+  for(d = 1; d <= sch->num_of_levels; d++)
+    start[d + 1] += start[d];
+  for(i = 0; i < n; i++)
+    order[start[depth[i]]++] = i;
+  for(d = sch->num_of_levels; d > 0; d--)
+    start[d] = start[d - 1];
+  start[0] = 0;
+
+  /* collect: the deepest level first, and the messages to the same 
+   * clique in one group in their original order */
+  k = 0;
+  g = 0;
+  for(d = sch->num_of_levels; d > 0; d--){
+    sch->collect_level[sch->num_of_levels - d] = g;
+    for(i = start[d]; i < start[d + 1]; i++){
+      j = (sch->parent[order[i]] < 0) ? n : sch->parent[order[i]];
+      if(first[j] != order[i])
+	continue; /* already in the group of its first sibling */
+      sch->collect_group[g++] = k;
+      for(j = first[j]; j >= 0; j = next[j])
+	sch->collect_order[k++] = j;
+    }
+  }
+  sch->collect_group[g] = k;
+  sch->collect_level[sch->num_of_levels] = g;
+
+  /* distribute: the messages from the root first, and the messages 
+   * from the same clique (consecutive in the schedule) in one group */
+  for(i = 0; i <= sch->num_of_levels + 1; i++)
+    start[i] = 0;
+  for(i = 0; i < n; i++)
+    start[depth[sch->collect_index[i]] + 1]++;
+  for(d = 1; d <= sch->num_of_levels; d++)
+    start[d + 1] += start[d];
+  for(i = 0; i < n; i++)
+    order[start[depth[sch->collect_index[i]]]++] = i;
+  k = 0;
+  g = 0;
+  for(d = 1; d <= sch->num_of_levels; d++){
+    sch->distribute_level[d - 1] = g;
+    for(; k < start[d]; k++){
+      i = order[k];
+      if(k == 0 || sch->distribute[sch->distribute_order[k - 1]].from != 
+	 sch->distribute[i].from)
+	sch->distribute_group[g++] = k;
+      sch->distribute_order[k] = i;
+    }
+  }
+  sch->distribute_group[g] = k;
+  sch->distribute_level[sch->num_of_levels] = g;
+
+  free(depth);
+  free(order);
+  free(start);
+  return 0;
+}
+
+
+void nip_schedule_threads(nip_schedule s, nip_thread_pool pool){
+  s->pool = pool;
+  return;
+}
+
+
+void nip_free_schedule(nip_schedule s){
+  if(s){
+    free(s->collect);
+    free(s->distribute);
+    free(s->parent);
+    free(s->collect_index);
+    free(s->dirty_count);
+    free(s->collect_stale);
+    free(s->distribute_stale);
+    free(s->collect_order);
+    free(s->collect_group);
+    free(s->collect_level);
+    free(s->distribute_order);
+    free(s->distribute_group);
+    free(s->distribute_level);
+    free(s);
+  }
+  return;
+}
+
+
+nip_potential_arena nip_new_join_tree_arena(nip_schedule s, 
+					    nip_clique* cliques, int ncliques){
+  int i, n;
+  nip_message_struct* m;
+  nip_potential_arena a;
+  nip_potential* p;
+
+  /* a tree of n cliques has n-1 sepsets with two potentials each */
+  p = (nip_potential*) calloc(3 * ncliques + 1, sizeof(nip_potential));
+  if(!p){
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    return NULL;
+  }
+  for(i = 0; i < ncliques; i++)
+    nip_unmark_clique(cliques[i]);
+
+  n = 0;
+  for(i = 0; i < s->num_of_messages; i++){
+    m = &(s->collect[i]);
+    if(!nip_clique_marked(m->from)){
+      m->from->mark = NIP_MARK_ON;
+      p[n++] = m->from->p;
+    }
+    p[n++] = m->sepset->old;
+    p[n++] = m->sepset->new;
+  }
+  for(i = 0; i < ncliques; i++) /* the root (and any strays) */
+    if(!nip_clique_marked(cliques[i]))
+      p[n++] = cliques[i]->p;
+
+  a = nip_new_potential_arena(p, n);
+  free(p);
+  if(!a)
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+  return a;
+}
+
+
+static void nip_schedule_collect(nip_schedule sch, nip_clique c1, 
+				 nip_sepset s12, nip_clique c2){
+  int i, n;
+  nip_sepset_link l;
+  nip_sepset s;
+  nip_message_struct* m;
+
+  /* mark */
+  c2->mark = NIP_MARK_ON;
+
+  n = 0;
+  for(l = c2->sepsets; l != NULL; l = l->fwd)
+    n++;
+
+  {
+    int in[n + 1]; /* the messages sent to c2 */
+
+    /* visit neighboring cliques (same order as nip_collect_evidence) */
+    n = 0;
+    l = c2->sepsets;
+    while (l != NULL){
+      s = l->data;
+      if(!nip_clique_marked(s->first_neighbour)){
+	nip_schedule_collect(sch, c2, s, s->first_neighbour);
+	in[n++] = sch->num_of_messages - 1;
+      }
+      if(!nip_clique_marked(s->second_neighbour)){
+	nip_schedule_collect(sch, c2, s, s->second_neighbour);
+	in[n++] = sch->num_of_messages - 1;
+      }
+      l = l->fwd;
+    }
+
+    /* the message to c1, or none from the root */
+    for(i = 0; i < n; i++)
+      sch->parent[in[i]] = (c1 != NULL) ? sch->num_of_messages : -1;
+  }
+
+  if((c1 != NULL) && (s12 != NULL)){
+    m = &(sch->collect[sch->num_of_messages++]);
+    m->from = c2;
+    m->sepset = s12;
+    m->to = c1;
+  }
+  return;
+}
+
+
+static void nip_schedule_distribute(nip_schedule sch, int k, 
+				    int first[], int next[], int* n){
+  int i;
+  nip_message_struct* m;
+
+  /* the messages from the receiver of k (same order as 
+   * nip_distribute_evidence) */
+  for(i = first[k]; i >= 0; i = next[i]){
+    m = &(sch->distribute[*n]);
+    m->from = sch->collect[i].to;
+    m->sepset = sch->collect[i].sepset;
+    m->to = sch->collect[i].from;
+    sch->collect_index[(*n)++] = i;
+  }
+
+  /* visit neighboring cliques */
+  for(i = first[k]; i >= 0; i = next[i])
+    nip_schedule_distribute(sch, i, first, next, n);
+  return;
+}
+
+
+/* Turns the dirty cliques into stale messages: a message needs to be 
+ * passed, if any clique behind it has changed since it was last passed. 
+ * Finally all the cliques are marked clean (not dirty). */
+static void nip_schedule_news(nip_schedule s){
+  int i, total;
+
+  for(i = 0; i < s->num_of_messages; i++)
+    s->dirty_count[i] = 0;
+  total = s->root ? s->root->dirty : 0;
+  for(i = 0; i < s->num_of_messages; i++){
+    /* messages from the children were earlier in the schedule */
+    s->dirty_count[i] += s->collect[i].from->dirty;
+    if(s->parent[i] >= 0)
+      s->dirty_count[s->parent[i]] += s->dirty_count[i];
+    else
+      total += s->dirty_count[i];
+  }
+  if(total == 0)
+    return;
+
+  for(i = 0; i < s->num_of_messages; i++){
+    if(s->dirty_count[i] > 0)
+      s->collect_stale[i] = 1;
+    /* any news from outside the subtree of the receiver? */
+    if(total - s->dirty_count[s->collect_index[i]] > 0)
+      s->distribute_stale[i] = 1;
+  }
+
+  s->root->dirty = 0;
+  for(i = 0; i < s->num_of_messages; i++)
+    s->collect[i].from->dirty = 0;
+  return;
+}
+
+
+static int nip_collect_group(void* data, int i){
+  int j, k, n, err;
+  nip_schedule_level_struct* level = data;
+  nip_schedule s = level->s;
+  nip_message_struct* m = NULL;
+
+  i += level->first;
+  {
+    nip_sepset in[s->collect_group[i + 1] - s->collect_group[i] + 1];
+
+    /* the senders project their messages... */
+    n = 0;
+    for(j = s->collect_group[i]; j < s->collect_group[i + 1]; j++){
+      k = s->collect_order[j];
+      m = &(s->collect[k]);
+      if(s->collect_stale[k]){
+	err = nip_project_messages(level->kernel_pool, 
+				   m->from, &(m->sepset), 1);
+	if(err != 0)
+	  return err;
+	in[n++] = m->sepset;
+	s->collect_stale[k] = 0;
+      }
+    }
+
+    /* ...and the receiver absorbs all of them in one go */
+    if(n > 0)
+      return nip_absorb_messages(level->kernel_pool, m->to, in, n);
+  }
+  return 0;
+}
+
+
+static int nip_distribute_group(void* data, int i){
+  int j, k, n;
+  nip_schedule_level_struct* level = data;
+  nip_schedule s = level->s;
+  nip_message_struct* m = NULL;
+
+  i += level->first;
+  {
+    nip_sepset out[s->distribute_group[i + 1] - s->distribute_group[i] + 1];
+
+    n = 0;
+    for(j = s->distribute_group[i]; j < s->distribute_group[i + 1]; j++){
+      k = s->distribute_order[j];
+      m = &(s->distribute[k]);
+      if(s->distribute_stale[k])
+	out[n++] = m->sepset;
+    }
+    if(n > 0)
+      return nip_project_messages(level->kernel_pool, m->from, out, n);
+  }
+  return 0;
+}
+
+
+static int nip_distribute_message(void* data, int i){
+  int k, err;
+  nip_schedule_level_struct* level = data;
+  nip_schedule s = level->s;
+  nip_message_struct* m;
+
+  k = s->distribute_order[i + level->first];
+  m = &(s->distribute[k]);
+  if(s->distribute_stale[k]){
+    err = nip_absorb_messages(level->kernel_pool, m->to, &(m->sepset), 1);
+    if(err != 0)
+      return err;
+    s->distribute_stale[k] = 0;
+  }
+  return 0;
+}
+
+
+int nip_collect_schedule(nip_schedule s){
+  int i, n, err;
+  nip_schedule_level_struct level;
+
+  nip_schedule_news(s);
+
+  /* one level at a time, the cliques of a level in parallel (if there 
+   * are threads) */
+  level.s = s;
+  for(i = 0; i < s->num_of_levels; i++){
+    level.first = s->collect_level[i];
+    n = s->collect_level[i + 1] - level.first;
+    /* a lone clique gets all the threads for its potentials */
+    level.kernel_pool = (n == 1) ? s->pool : NULL;
+    err = nip_parallel_for(s->pool, nip_collect_group, &level, n);
+    if(err != 0)
+      return nip_report_error(__FILE__, __LINE__, err, 1);
+  }
+  return 0;
+}
+
+
+double nip_schedule_mass(nip_schedule s){
+  /* all the evidence is in the root after collect */
+  if(s->root)
+    return nip_potential_mass(s->root->p);
+  return 0;
+}
+
+
+int nip_distribute_schedule(nip_schedule s){
+  int i, n, err;
+  nip_schedule_level_struct level;
+
+  nip_schedule_news(s);
+
+  level.s = s;
+  for(i = 0; i < s->num_of_levels; i++){
+    /* 1. each clique of the level projects all its messages at once */
+    level.first = s->distribute_level[i];
+    n = s->distribute_level[i + 1] - level.first;
+    level.kernel_pool = (n == 1) ? s->pool : NULL;
+    err = nip_parallel_for(s->pool, nip_distribute_group, &level, n);
+    if(err != 0)
+      return nip_report_error(__FILE__, __LINE__, err, 1);
+
+    /* 2. the receivers absorb them */
+    level.first = s->distribute_group[s->distribute_level[i]];
+    n = s->distribute_group[s->distribute_level[i + 1]] - level.first;
+    level.kernel_pool = (n == 1) ? s->pool : NULL;
+    err = nip_parallel_for(s->pool, nip_distribute_message, &level, n);
+    if(err != 0)
+      return nip_report_error(__FILE__, __LINE__, err, 1);
+  }
+  return 0;
+}
+
+
+int nip_collect_schedule_to(nip_schedule s, nip_clique c){
+  int i, err;
+  int* on_path;
+  nip_message_struct* m;
+
+  if(c == NULL)
+    return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
+
+  nip_schedule_news(s);
+
+  /* Mark the collect messages on the path from c to the root: 
+   * those point away from c, and their opposites are needed instead. */
+  on_path = s->dirty_count; /* reuse as work space */
+  for(i = 0; i < s->num_of_messages; i++)
+    on_path[i] = 0;
+  for(i = 0; i < s->num_of_messages; i++)
+    if(s->collect[i].from == c)
+      break;
+  if(i == s->num_of_messages && c != s->root)
+    return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
+  for(; i < s->num_of_messages && i >= 0; i = s->parent[i])
+    on_path[i] = 1;
+
+  /* 1. collect the other subtrees towards the path */
+  for(i = 0; i < s->num_of_messages; i++){
+    m = &(s->collect[i]);
+    if(!on_path[i] && s->collect_stale[i]){
+      err = nip_message_pass(s->pool, m->from, m->sepset, m->to);
+      if(err != 0)
+	return nip_report_error(__FILE__, __LINE__, err, 1);
+      s->collect_stale[i] = 0;
+    }
+  }
+
+  /* 2. follow the path from the root to c */
+  for(i = 0; i < s->num_of_messages; i++){
+    m = &(s->distribute[i]);
+    if(on_path[s->collect_index[i]] && s->distribute_stale[i]){
+      err = nip_message_pass(s->pool, m->from, m->sepset, m->to);
+      if(err != 0)
+	return nip_report_error(__FILE__, __LINE__, err, 1);
+      s->distribute_stale[i] = 0;
+    }
+  }
+  return 0;
+}
+
+
 /* TODO: check that this has a correct mapping between p and c! */
 int nip_init_clique(nip_clique c, nip_variable child, 
 		    nip_potential p, int transient){
@@ -753,6 +1482,7 @@ int nip_init_clique(nip_clique c, nip_variable child,
     free(mapping);
     return nip_report_error(__FILE__, __LINE__, err, 1);
   }
+  c->dirty = 1;
 
   /* Some extra work is done here,
    * because only the last initialisation counts. */
@@ -788,9 +1518,29 @@ int nip_marginalise_clique(nip_clique c, nip_variable v, double r[]){
 }
 
 
+int nip_marginalise_clique_variables(nip_thread_pool pool, nip_clique c, 
+				     nip_variable vars[], int n, double* r[]){
+  int i, err;
+  int index[n + 1];
+
+  for(i = 0; i < n; i++){
+    index[i] = nip_clique_var_index(c, vars[i]);
+    /* variable not in this clique => ERROR */
+    if(index[i] < 0)
+      return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
+  }
+
+  err = nip_parallel_total_marginalise(pool, c->p, r, index, n);
+  if(err != 0)
+    nip_report_error(__FILE__, __LINE__, err, 1);
+
+  return err;
+}
+
+
 int nip_global_retraction(nip_variable* vars, int nvars, 
 			  nip_clique* cliques, int ncliques){
-  int i, index;
+  int i, index, state;
   int err;
   nip_variable v;
   nip_clique c;
@@ -812,7 +1562,96 @@ int nip_global_retraction(nip_variable* vars, int nvars,
     err = nip_update_evidence(v->likelihood, NULL, c->p, index);
     if(err != 0)
       return nip_report_error(__FILE__, __LINE__, err, 1);
+    state = nip_single_state(v->likelihood, NIP_CARDINALITY(v));
+    if(state >= 0)
+      nip_slice_clique(c, index, state);
+    c->dirty = 1;
+  }
+  return 0;
+}
+
+
+int nip_save_potentials(nip_clique* cliques, int ncliques, double data[]){
+  int i, n;
+  for(i = 0; i < ncliques; i++){
+    n = cliques[i]->p->size_of_data;
+    memcpy(data, cliques[i]->p->data, n * sizeof(double));
+    data += n;
+  }
+  return 0;
+}
+
+
+void nip_forget_evidence(nip_clique* cliques, int ncliques){
+  int i, j;
+  nip_clique c;
+
+  for(i = 0; i < ncliques; i++){
+    c = cliques[i];
+    for(j = 0; j < NIP_DIMENSIONALITY(c->p); j++)
+      c->slice[j] = -1;
+    c->sliced = 0;
+    c->dirty = 1;
+  }
+}
+
+
+void nip_mark_consistent(nip_schedule s, nip_clique* cliques, int ncliques){
+  int i;
+
+  nip_forget_evidence(cliques, ncliques);
+  for(i = 0; i < ncliques; i++)
+    cliques[i]->dirty = 0;
+  for(i = 0; i < s->num_of_messages; i++){
+    s->collect_stale[i] = 0;
+    s->distribute_stale[i] = 0;
+  }
+}
+
+
+void nip_save_orientation(nip_schedule s, char orientation[]){
+  int i;
+  nip_sepset sep;
+
+  for(i = 0; i < s->num_of_messages; i++){
+    sep = s->collect[i].sepset;
+    orientation[i] = (sep->new->data > sep->old->data);
+  }
+}
+
+
+void nip_restore_orientation(nip_schedule s, char orientation[]){
+  int i;
+  nip_sepset sep;
+  nip_potential temp;
+
+  for(i = 0; i < s->num_of_messages; i++){
+    sep = s->collect[i].sepset;
+    if((sep->new->data > sep->old->data) != orientation[i]){
+      temp = sep->old;
+      sep->old = sep->new;
+      sep->new = temp;
+    }
+  }
+}
+
+
+int nip_restore_potentials(nip_clique* cliques, int ncliques, double data[]){
+  int i, n;
+  nip_clique c;
+  nip_sepset_link l;
+
+  for(i = 0; i < ncliques; i++){
+    c = cliques[i];
+    n = c->p->size_of_data;
+    memcpy(c->p->data, data, n * sizeof(double));
+    data += n;
+
+    /* each sepset twice, but they are small */
+    for(l = c->sepsets; l != NULL; l = l->fwd)
+      nip_retract_sepset(l->data, NULL);
   }
+  nip_forget_evidence(cliques, ncliques);
   return 0;
 }
 
@@ -832,27 +1671,121 @@ int nip_enter_observation(nip_variable* vars, int nvars,
 int nip_enter_index_observation(nip_variable* vars, int nvars, 
 				nip_clique* cliques, int ncliques, 
 				nip_variable v, int index){
-  int i, err;
-  double *evidence;
+  int i, var, err;
+  double old;
+  nip_clique c;
 
   if(index < 0)
     return 0;
+  if(v == NULL)
+    return nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+  if(index >= NIP_CARDINALITY(v))
+    return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
 
-  evidence = (double *) calloc(NIP_CARDINALITY(v), sizeof(double));
-  if(!evidence){
-    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-    return ENOMEM;
-  }
+  c = nip_find_family(cliques, ncliques, v);
+  if(!c)
+    return nip_report_error(__FILE__, __LINE__, EINVAL, 0);
 
+  var = nip_clique_var_index(c, v);
+
+  /* Update likelihood: 1 at index, 0 elsewhere */
+  old = (v->likelihood)[index];
   for(i = 0; i < NIP_CARDINALITY(v); i++)
-    if(i == index)
-      evidence[i] = 1;
-    else
-      evidence[i] = 0;
+    (v->likelihood)[i] = (i == index) ? 1 : 0;
 
-  err = nip_enter_evidence(vars, nvars, cliques, ncliques, v, evidence);
-  free(evidence);
-  return err;
+  if(old == 0){
+    /* an impossible value became possible: global retraction */
+    err = nip_global_retraction(vars, nvars, cliques, ncliques);
+    if(err != 0)
+      return nip_report_error(__FILE__, __LINE__, err, 1);
+    return 0;
+  }
+
+  /* Hard evidence: the update of clique potential without the 
+   * multiplications by 0 and 1 */
+  err = nip_update_hard_evidence(c->p, var, index, old);
+  if(err != 0)
+    return nip_report_error(__FILE__, __LINE__, err, 1);
+  nip_slice_clique(c, var, index);
+  c->dirty = 1;
+
+  return 0;
+}
+
+
+int nip_enter_index_observations(nip_variable* vars, int nvars, 
+				 nip_clique* cliques, int ncliques, 
+				 nip_variable observed[], int index[], int n){
+  int i, j, k, m, err;
+  int retraction = 0;
+  nip_variable v;
+  nip_clique family[n + 1];
+  int var[n + 1];
+  double old[n + 1];
+  int group_var[n + 1];
+  int group_index[n + 1];
+  double group_old[n + 1];
+
+  /* check them all before changing anything */
+  for(i = 0; i < n; i++){
+    v = observed[i];
+    family[i] = NULL;
+    if(index[i] < 0)
+      continue; /* missing */
+    if(v == NULL)
+      return nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+    if(index[i] >= NIP_CARDINALITY(v))
+      return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
+
+    family[i] = nip_find_family(cliques, ncliques, v);
+    if(!family[i])
+      return nip_report_error(__FILE__, __LINE__, EINVAL, 0);
+    var[i] = nip_clique_var_index(family[i], v);
+  }
+
+  /* the likelihoods first: at most one retraction for all of them */
+  for(i = 0; i < n; i++){
+    v = observed[i];
+    if(!family[i])
+      continue; /* missing */
+    old[i] = (v->likelihood)[index[i]];
+    for(j = 0; j < NIP_CARDINALITY(v); j++)
+      (v->likelihood)[j] = (j == index[i]) ? 1 : 0;
+    if(old[i] == 0)
+      retraction = 1; /* an impossible value became possible */
+  }
+
+  if(retraction){
+    err = nip_global_retraction(vars, nvars, cliques, ncliques);
+    if(err != 0)
+      return nip_report_error(__FILE__, __LINE__, err, 1);
+    return 0;
+  }
+
+  /* the observations of each clique in one sweep */
+  for(i = 0; i < n; i++){
+    if(family[i] == NULL)
+      continue; /* missing, or done already */
+    m = 0;
+    for(k = i; k < n; k++){
+      if(family[k] == family[i]){
+	group_var[m] = var[k];
+	group_index[m] = index[k];
+	group_old[m] = old[k];
+	m++;
+	if(k > i)
+	  family[k] = NULL;
+      }
+    }
+    err = nip_update_hard_evidences(family[i]->p, group_var, group_index, 
+				    group_old, m);
+    if(err != 0)
+      return nip_report_error(__FILE__, __LINE__, err, 1);
+    for(k = 0; k < m; k++)
+      nip_slice_clique(family[i], group_var[k], group_index[k]);
+    family[i]->dirty = 1;
+  }
+  return 0;
 }
 
 
@@ -884,6 +1817,10 @@ int nip_enter_evidence(nip_variable* vars, int nvars,
     err = nip_update_evidence(evidence, v->likelihood, c->p, index);
     if(err != 0)
       return nip_report_error(__FILE__, __LINE__, err, 1);
+    i = nip_single_state(evidence, NIP_CARDINALITY(v));
+    if(i >= 0)
+      nip_slice_clique(c, index, i);
+    c->dirty = 1;
   }
 
   /* Update likelihood. Check the return value. */
@@ -936,6 +1873,7 @@ int nip_enter_prior(nip_variable* vars, int nvars,
   e = nip_update_evidence(prior, NULL, c->p, index);
   if(e != 0)
     return nip_report_error(__FILE__, __LINE__, e, 1);
+  c->dirty = 1;
 
   /* Don't update the likelihood... */
 
@@ -964,6 +1902,27 @@ static int nip_clique_var_index(nip_clique c, nip_variable v){
 }
 
 
+static void nip_slice_clique(nip_clique c, int var, int index){
+  if(c->slice[var] >= 0)
+    return; /* already zero elsewhere (or everywhere) */
+  c->slice[var] = index;
+  c->sliced++;
+}
+
+
+static int nip_single_state(double likelihood[], int n){
+  int i, index = -1;
+  for(i = 0; i < n; i++){
+    if(likelihood[i] != 0){
+      if(index >= 0)
+	return -1;
+      index = i;
+    }
+  }
+  return index;
+}
+
+
 nip_clique nip_find_family(nip_clique *cliques, int ncliques, 
 			   nip_variable var){
   int i, n;
@@ -1064,6 +2023,266 @@ nip_clique nip_find_clique(nip_clique *cliques, int ncliques,
 }
 
 
+int nip_order_clique_variables(nip_clique* cliques, int ncliques){
+  int i, j, k, n, m, err;
+  int* order;
+  int* placed;
+  char* used;
+  nip_clique c;
+  nip_sepset s, largest;
+  nip_sepset_link l;
+
+  for(i = 0; i < ncliques; i++){
+    c = cliques[i];
+    n = NIP_DIMENSIONALITY(c->p);
+    order = (int*) calloc(n + 1, sizeof(int));
+    placed = (int*) calloc(n + 1, sizeof(int));
+    for(l = c->sepsets, m = 0; l != NULL; l = l->fwd)
+      m++;
+    used = (char*) calloc(m + 1, sizeof(char));
+    if(!order || !placed || !used){
+      free(order);
+      free(placed);
+      free(used);
+      return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    }
+
+    /* variables of the sepsets from the largest to the smallest, 
+     * each sepset in its own order */
+    k = 0;
+    for(;;){
+      largest = NULL;
+      m = -1;
+      for(l = c->sepsets, j = 0; l != NULL; l = l->fwd, j++){
+	s = l->data;
+	if(!used[j] && 
+	   (!largest || s->old->size_of_data > largest->old->size_of_data)){
+	  largest = s;
+	  m = j;
+	}
+      }
+      if(!largest)
+	break;
+      used[m] = 1;
+      for(j = 0; j < NIP_DIMENSIONALITY(largest->old); j++){
+	err = nip_clique_var_index(c, largest->variables[j]);
+	if(err >= 0 && !placed[err]){
+	  placed[err] = 1;
+	  order[k++] = err;
+	}
+      }
+    }
+
+    /* ...and then the rest */
+    for(j = 0; j < n; j++)
+      if(!placed[j])
+	order[k++] = j;
+
+    err = nip_reorder_clique(c, order);
+    free(order);
+    free(placed);
+    free(used);
+    if(err != 0)
+      return nip_report_error(__FILE__, __LINE__, err, 1);
+  }
+  return 0;
+}
+
+
+static int nip_reorder_clique(nip_clique c, int order[]){
+  int i, n;
+  nip_variable* vars;
+  nip_potential p, original_p;
+  nip_sepset s;
+  nip_sepset_link l;
+  int** mapping;
+  int* stride;
+
+  n = NIP_DIMENSIONALITY(c->p);
+  for(i = 0; i < n && order[i] == i; i++);
+  if(i == n)
+    return 0; /* already in order */
+
+  vars = (nip_variable*) calloc(n, sizeof(nip_variable));
+  p = nip_permute_potential(c->p, order);
+  original_p = nip_permute_potential(c->original_p, order);
+  if(!vars || !p || !original_p){
+    free(vars);
+    nip_free_potential(p);
+    nip_free_potential(original_p);
+    return ENOMEM;
+  }
+  for(i = 0; i < n; i++){
+    vars[i] = c->variables[order[i]];
+    /* the family may be here: find its mapping again when needed */
+    free(vars[i]->family_mapping);
+    vars[i]->family_mapping = NULL;
+  }
+  free(c->variables);
+  c->variables = vars;
+  {
+    int slice[n];
+    for(i = 0; i < n; i++)
+      slice[i] = c->slice[order[i]];
+    for(i = 0; i < n; i++)
+      c->slice[i] = slice[i];
+  }
+  nip_free_potential(c->p);
+  nip_free_potential(c->original_p);
+  c->p = p;
+  c->original_p = original_p;
+
+  /* the message plans of the sepsets */
+  for(l = c->sepsets; l != NULL; l = l->fwd){
+    s = l->data;
+    if(s->first_neighbour == c){
+      mapping = &(s->first_mapping);
+      stride = s->first_stride;
+    }
+    else{
+      mapping = &(s->second_mapping);
+      stride = s->second_stride;
+    }
+    free(*mapping);
+    *mapping = nip_mapper(c->variables, s->variables, n, 
+			  NIP_DIMENSIONALITY(s->old));
+    if(NIP_DIMENSIONALITY(s->old) > 0 && !*mapping)
+      return ENOMEM;
+    nip_mapping_strides(c->p, s->new->cardinality, *mapping, 
+			NIP_DIMENSIONALITY(s->old), stride);
+  }
+  return 0;
+}
+
+
+static nip_potential nip_permute_potential(nip_potential p, int order[]){
+  int i, n;
+  int* cardinality;
+  int* stride;
+  nip_potential q;
+
+  n = NIP_DIMENSIONALITY(p);
+  cardinality = (int*) calloc(n + 1, sizeof(int));
+  stride = (int*) calloc(n + 1, sizeof(int));
+  if(!cardinality || !stride){
+    free(cardinality);
+    free(stride);
+    return NULL;
+  }
+  for(i = 0; i < n; i++)
+    cardinality[i] = p->cardinality[order[i]];
+  q = nip_new_potential(cardinality, n, NULL);
+  if(q){
+    /* a "marginalisation" onto all the variables in a new order */
+    nip_mapping_strides(p, cardinality, order, n, stride);
+    nip_strided_marginalise(p, q, stride);
+  }
+  free(cardinality);
+  free(stride);
+  return q;
+}
+
+
+nip_clique nip_choose_root(nip_clique* cliques, int ncliques, 
+			   nip_clique targets[], int ntargets){
+  int i, j, k, n;
+  int* count;
+  int* best_child;
+  double* weight;
+  double* first;
+  double* second;
+  double* up;
+  double* sum;
+  double cost, best_cost;
+  nip_schedule s;
+  nip_clique best = NULL;
+
+  if(ncliques < 1)
+    return NULL;
+
+  /* The tree as arrays: node j < n sends the collect message j of a 
+   * schedule rooted at the first clique, and node n is the root. */
+  s = nip_new_schedule(cliques, ncliques, cliques[0]);
+  if(!s)
+    return NULL;
+  n = s->num_of_messages;
+  count = (int*) calloc(2 * (n + 1), sizeof(int));
+  weight = (double*) calloc(5 * (n + 1), sizeof(double));
+  if(!count || !weight){
+    free(count);
+    free(weight);
+    nip_free_schedule(s);
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    return NULL;
+  }
+  best_child = count + (n + 1);
+  first = weight + (n + 1);
+  second = first + (n + 1);
+  up = second + (n + 1);
+  sum = up + (n + 1);
+
+  for(j = 0; j < n; j++)
+    weight[j] = (s->collect[j].from->p->size_of_data + 
+		 s->collect[j].sepset->old->size_of_data + 
+		 s->collect[j].to->p->size_of_data);
+  for(i = 0; i < ntargets; i++){
+    if(targets[i] == NULL)
+      continue;
+    for(j = 0; j < n && s->collect[j].from != targets[i]; j++);
+    if(j < n || targets[i] == cliques[0])
+      count[j]++;
+  }
+
+  /* Upwards (children before parents): the two costliest paths down 
+   * from each node, and the number of targets below it. */
+  for(j = 0; j <= n; j++)
+    best_child[j] = -1;
+  for(j = 0; j < n; j++){
+    k = (s->parent[j] < 0) ? n : s->parent[j];
+    cost = weight[j] + first[j];
+    if(cost > first[k]){
+      second[k] = first[k];
+      first[k] = cost;
+      best_child[k] = j;
+    }
+    else if(cost > second[k])
+      second[k] = cost;
+    count[k] += count[j];
+    sum[n] += weight[j] * count[j];
+  }
+
+  /* Downwards (parents before children): the costliest path up from 
+   * each node, and the paths to the targets as seen from it. */
+  for(j = n - 1; j >= 0; j--){
+    k = (s->parent[j] < 0) ? n : s->parent[j];
+    cost = (best_child[k] == j) ? second[k] : first[k];
+    up[j] = weight[j] + ((up[k] > cost) ? up[k] : cost);
+    sum[j] = sum[k] + weight[j] * (count[n] - 2 * count[j]);
+  }
+
+  /* the first of the cheapest ones in the order of cliques */
+  best_cost = HUGE_DOUBLE;
+  for(j = 0; j <= n; j++){
+    cost = ((first[j] > up[j]) ? first[j] : up[j]) + sum[j];
+    if(cost < best_cost)
+      best_cost = cost;
+  }
+  for(i = 0; i < ncliques; i++)
+    nip_unmark_clique(cliques[i]);
+  for(j = 0; j <= n; j++)
+    if(((first[j] > up[j]) ? first[j] : up[j]) + sum[j] == best_cost)
+      ((j < n) ? s->collect[j].from : cliques[0])->mark = NIP_MARK_ON;
+  for(i = 0; i < ncliques && !best; i++)
+    if(nip_clique_marked(cliques[i]))
+      best = cliques[i];
+
+  free(count);
+  free(weight);
+  nip_free_schedule(s);
+  return best;
+}
+
+
 void nip_fprintf_clique(FILE* stream, nip_clique c){
   int i;
   fprintf(stream, "clique ");
@@ -1087,11 +2306,16 @@ void nip_fprintf_sepset(FILE* stream, nip_sepset s){
 
 
 static int nip_retract_clique(nip_clique c, double* ptr){
+  int i;
   if(!c)
     return nip_report_error(__FILE__, __LINE__, EFAULT, 1);
   /* another option: 
    * nip_uniform_potential(c->p, 1.0);
    * nip_init_potential(c->original_p, c->p); */
+  c->dirty = 1; /* and the sepsets are reset too */
+  for(i = 0; i < NIP_DIMENSIONALITY(c->p); i++)
+    c->slice[i] = -1;
+  c->sliced = 0;
   return nip_retract_potential(c->p, c->original_p);
 }
 
@@ -1154,20 +2378,12 @@ static int nip_join_tree_dfs(nip_clique start,
 
 
 static int nip_clique_mass(nip_clique c, double* ptr){
-  int i;
-  double m = 0;
-  for(i = 0; i < c->p->size_of_data; i++)
-    m += c->p->data[i]; /* TODO: nip_potential_mass? */
-  *ptr += m;
+  *ptr += nip_potential_mass(c->p);
   return 0;
 }
 
 static int nip_neg_sepset_mass(nip_sepset s, double* ptr){
-  int i;
-  double m = 0;
-  for(i = 0; i < s->new->size_of_data; i++)
-    m += s->new->data[i]; /* TODO: nip_potential_mass? */
-  *ptr -= m;
+  *ptr -= nip_potential_mass(s->new);
   return 0;
 }
 
@@ -26,6 +26,7 @@
 #include <stdio.h> // FILE
 #include "nipvariable.h"
 #include "nippotential.h"
+#include "nipthreads.h"
 
 /**
  * References to sepsets neighbouring a clique, implemented as a linked list
@@ -47,6 +48,9 @@ typedef struct {
   nip_sepset_link sepsets; ///< list of neighboring sepsets (and other cliques behind each)
   int num_of_sepsets; ///< number of sepsets, TODO: coupled with the list, but efficient?
   char mark; ///< the way to prevent endless loops, either MARK_ON or MARK_OFF
+  int dirty; ///< 1 if the potential has changed since the latest propagation
+  int* slice; ///< for each variable, the only state with nonzero potential, or -1
+  int sliced; ///< number of variables with a slice, i.e. slice[i] >= 0
 } nip_clique_struct;
 typedef nip_clique_struct* nip_clique; ///< clique reference
 
@@ -59,9 +63,47 @@ typedef struct {
   nip_variable* variables; ///< related variables, size == old->num_of_vars
   nip_clique first_neighbour; ///< one of the two (neighbour) cliques
   nip_clique second_neighbour; ///< another of the two (neighbour) cliques
+  int* first_mapping;  ///< places of the sepset variables in first_neighbour
+  int* second_mapping; ///< places of the sepset variables in second_neighbour
+  int* first_stride;   ///< message plan between first_neighbour and sepset
+  int* second_stride;  ///< message plan between second_neighbour and sepset
 } nip_sepset_struct;
 typedef nip_sepset_struct* nip_sepset; ///< sepset reference
 
+/**
+ * One message pass in a propagation schedule: 
+ * from clique \p from through sepset \p sepset to clique \p to */
+typedef struct {
+  nip_clique from;   ///< the clique sending the message
+  nip_sepset sepset; ///< the sepset between the two cliques
+  nip_clique to;     ///< the clique receiving the message
+} nip_message_struct;
+
+/**
+ * A join tree compiled into flat arrays of message passes, so that 
+ * propagation needs no recursion, linked lists, or marking of cliques.
+ */
+typedef struct {
+  nip_clique root; ///< the clique where evidence is collected to
+  int num_of_messages; ///< number of messages in each phase (sepsets)
+  nip_message_struct* collect; ///< message passes in Collect-Evidence order
+  nip_message_struct* distribute; ///< message passes in Distribute order
+  int* parent; ///< for each collect message, the next one from its receiver
+  int* collect_index; ///< for each distribute message, the opposite one
+  int* dirty_count; ///< number of dirty cliques behind each collect message
+  int* collect_stale; ///< for each collect message: news not yet passed
+  int* distribute_stale; ///< for each distribute message: news not yet passed
+  nip_thread_pool pool; ///< workers for parallel propagation, or NULL
+  int num_of_levels; ///< depth of the tree below the root
+  int* collect_order; ///< collect messages grouped by receiver, deepest first
+  int* collect_group; ///< start of each group in collect_order (+ the end)
+  int* collect_level; ///< start of each level in collect_group (+ the end)
+  int* distribute_order; ///< distribute messages by level, root first
+  int* distribute_group; ///< start of each sender in distribute_order (+ end)
+  int* distribute_level; ///< start of each level in distribute_group (+ end)
+} nip_schedule_struct;
+typedef nip_schedule_struct* nip_schedule; ///< schedule reference
+
 /**
  * List item for storing parsed potentials while constructing the graph etc. 
  * (when the cliques don't exist yet) */
@@ -182,6 +224,91 @@ int nip_distribute_evidence(nip_clique c);
  * @see nip_unmark_clique() */
 int nip_collect_evidence(nip_clique c1, nip_sepset s12, nip_clique c2);
 
+/**
+ * Compiles the join tree containing clique \p root into a schedule of 
+ * message passes, in the same order as nip_collect_evidence() and 
+ * nip_distribute_evidence() starting from \p root would pass them. 
+ * NOTE: This marks the cliques, so unmark them before other searches.
+ * @param cliques Array of all the cliques in the join tree
+ * @param ncliques Size of the array \p cliques
+ * @param root The clique to collect the evidence to
+ * @return reference to a new schedule, or NULL if failed
+ * @see nip_free_schedule() */
+nip_schedule nip_new_schedule(nip_clique* cliques, int ncliques, 
+			      nip_clique root);
+
+/**
+ * Makes the schedule propagate in parallel with the threads of \p pool: 
+ * collect processes the messages to different cliques of the same 
+ * level concurrently, and distribute the messages from the cliques of 
+ * the same level. Each clique gets the same messages in the same order 
+ * as in serial propagation, and the large tables are split among the 
+ * threads only where each sum keeps its serial order (see 
+ * nip_parallel_marginalise()), so the results are exactly the same.
+ * @param s The compiled schedule
+ * @param pool Worker threads (not owned by the schedule), or NULL for 
+ * serial propagation */
+void nip_schedule_threads(nip_schedule s, nip_thread_pool pool);
+
+/**
+ * Method for removing a schedule and freeing memory 
+ * (the cliques and sepsets are not touched).
+ * @param s The schedule to be freed */
+void nip_free_schedule(nip_schedule s);
+
+/**
+ * Moves the current potentials of all the cliques and sepsets into one 
+ * arena, in the order of the message passes in \p s: each clique 
+ * next to the sepset it sends its message to.
+ * @param s The schedule of the join tree
+ * @param cliques Array of all the cliques in the join tree
+ * @param ncliques Size of the array \p cliques
+ * @return a reference to the new arena, or NULL if out of memory
+ * @see nip_free_potential_arena() */
+nip_potential_arena nip_new_join_tree_arena(nip_schedule s, 
+					    nip_clique* cliques, int ncliques);
+
+/**
+ * Collects evidence to the root of the schedule, by passing the messages 
+ * of the collect phase. No need to unmark cliques before this. 
+ * Only the messages with dirty cliques behind them (since they were 
+ * last passed) are passed, since the others would not change anything. 
+ * @param s The compiled schedule
+ * @return an error code, or 0 if successful
+ * @see nip_collect_evidence() */
+int nip_collect_schedule(nip_schedule s);
+
+/**
+ * Computes the probability of evidence, i.e. the mass of the root 
+ * potential, after nip_collect_schedule(). Only on request, since 
+ * this is a sweep over the root table.
+ * @param s The compiled schedule
+ * @return the probability mass at the root, or 0 if there is no root */
+double nip_schedule_mass(nip_schedule s);
+
+/**
+ * Distributes evidence from the root of the schedule, by passing the 
+ * messages of the distribute phase. No need to unmark cliques before this.
+ * Call nip_collect_schedule() first: a message is passed only if there 
+ * have been dirty cliques behind it, i.e. outside the subtree it is sent 
+ * to, since it was last passed.
+ * @param s The compiled schedule
+ * @return an error code, or 0 if successful
+ * @see nip_distribute_evidence() */
+int nip_distribute_schedule(nip_schedule s);
+
+/**
+ * Collects evidence to an arbitrary clique \p c of the schedule, and 
+ * stops there: a single inward pass without distribute. Only the 
+ * messages towards \p c with news behind them are passed, so \p c 
+ * becomes up to date while the other cliques may remain stale until 
+ * the next nip_collect_schedule() and nip_distribute_schedule().
+ * Useful for querying the marginals of a single clique.
+ * @param s The compiled schedule
+ * @param c The clique to collect the evidence to
+ * @return an error code, or 0 if successful */
+int nip_collect_schedule_to(nip_schedule s, nip_clique c);
+
 /**
  * Method for finding out the joint probability distribution of arbitrary
  * variables by making a DFS in the join tree. 
@@ -234,6 +361,23 @@ int nip_init_clique(nip_clique c, nip_variable child,
  */
 int nip_marginalise_clique(nip_clique c, nip_variable v, double r[]);
 
+/**
+ * Same as nip_marginalise_clique() for several variables of the same 
+ * clique, in a single sweep over the clique potential, or with all the 
+ * threads of \p pool for each variable if the potential is huge 
+ * (see nip_parallel_total_marginalise()).
+ * @param pool Worker threads, or NULL
+ * @param c Reference to a clique containing all of \p vars
+ * @param vars Array of \p n variables of interest
+ * @param n Number of variables
+ * @param r Array of \p n pointers to arrays of size vars[i]->cardinality, 
+ * where the results get written
+ * @return error code, or 0 if successful
+ * @see nip_marginalise_clique()
+ */
+int nip_marginalise_clique_variables(nip_thread_pool pool, nip_clique c, 
+				     nip_variable vars[], int n, double* r[]);
+
 /**
  * Method for backing away from impossibilities in observations.
  *
@@ -248,6 +392,59 @@ int nip_marginalise_clique(nip_clique c, nip_variable v, double r[]);
 int nip_global_retraction(nip_variable* vars, int nvars, 
 			  nip_clique* cliques, int ncliques);
 
+/**
+ * Copies the current potentials of all the cliques into one array, 
+ * e.g. for restoring a state without evidence quickly.
+ * @param cliques Array of all the cliques in the join tree
+ * @param ncliques Size of the array \p cliques
+ * @param data Array for the sum of the clique sizes
+ * @return error code, or 0 if successful 
+ * @see nip_restore_potentials() */
+int nip_save_potentials(nip_clique* cliques, int ncliques, double data[]);
+
+/**
+ * Marks all the cliques changed and without any evidence, e.g. after 
+ * their potentials have been restored directly.
+ * @param cliques Array of all the cliques in the join tree
+ * @param ncliques Size of the array \p cliques */
+void nip_forget_evidence(nip_clique* cliques, int ncliques);
+
+/**
+ * Marks all the cliques and messages of the schedule up to date and 
+ * the cliques without evidence, e.g. after restoring the tables of 
+ * the join tree saved right after a propagation. Only the cliques 
+ * changed after this are propagated by the next collect and distribute.
+ * @param s The schedule of the join tree
+ * @param cliques Array of all the cliques in the join tree
+ * @param ncliques Size of the array \p cliques */
+void nip_mark_consistent(nip_schedule s, nip_clique* cliques, int ncliques);
+
+/**
+ * Saves which of the two tables of each sepset is the current one. 
+ * Passing a message swaps the tables, so a copy of an arena is valid 
+ * only with the orientation the sepsets had when it was taken.
+ * @param s The schedule of the join tree
+ * @param orientation Array of s->num_of_messages flags to write
+ * @see nip_restore_orientation() */
+void nip_save_orientation(nip_schedule s, char orientation[]);
+
+/**
+ * Swaps the tables of the sepsets back to the orientation saved by 
+ * nip_save_orientation(), e.g. when restoring a copy of the arena.
+ * @param s The schedule of the join tree
+ * @param orientation Array of s->num_of_messages flags */
+void nip_restore_orientation(nip_schedule s, char orientation[]);
+
+/**
+ * Sets the potentials of all the cliques from an array saved by 
+ * nip_save_potentials(), and resets the sepsets. Like 
+ * nip_global_retraction(), but without any evidence.
+ * @param cliques Array of all the cliques in the join tree
+ * @param ncliques Size of the array \p cliques
+ * @param data The saved potentials
+ * @return error code, or 0 if successful */
+int nip_restore_potentials(nip_clique* cliques, int ncliques, double data[]);
+
 /**
  * Computes the so called probability mass of a clique tree.
  * Suitable for evaluating conditional probability of new evidence, 
@@ -291,6 +488,25 @@ int nip_enter_index_observation(nip_variable* vars, int nvars,
 				nip_clique* cliques, int ncliques, 
 				nip_variable v, int index);
 
+/**
+ * Function for entering many observations at once, e.g. all of a 
+ * time step. Same as nip_enter_index_observation() for each, but 
+ * with at most one global retraction, and each clique potential 
+ * updated in one sweep.
+ * @param vars Array of all variables in the model
+ * @param nvars Size of the array \p vars
+ * @param cliques Array of all nodes in the join tree
+ * @param ncliques Size of the array \p cliques
+ * @param observed The observed variables
+ * @param index For each observed variable, the index of its observed 
+ *   state, or -1 if missing
+ * @param n Size of the arrays \p observed and \p index
+ * @return error code, or 0 if successful: nothing is entered if any of 
+ *   the observations is invalid */
+int nip_enter_index_observations(nip_variable* vars, int nvars, 
+				 nip_clique* cliques, int ncliques, 
+				 nip_variable observed[], int index[], int n);
+
 /**
  * Function for entering (hard or soft) evidence to a clique tree. 
  * Retracting the evidence or entering some new evidence about the 
@@ -356,6 +572,40 @@ int* nip_find_family_mapping(nip_clique family, nip_variable child);
 nip_clique nip_find_clique(nip_clique* cliques, int ncliques, 
 			   nip_variable* variables, int nvars);
 
+/**
+ * Reorders the variables (dimensions) of each clique so that the 
+ * variables of its largest sepsets come first, in the same order as in 
+ * the sepsets. The sepset of each clique with the largest table is then 
+ * a prefix of the clique, and marginalisation onto it or absorption 
+ * from it runs through contiguous blocks of the clique potential. 
+ * The clique potentials (with their data), the message plans of the 
+ * sepsets, and the memoized family mappings of the variables are 
+ * updated accordingly.
+ * @param cliques Array of all nodes in the join tree
+ * @param ncliques Size of the array \p cliques
+ * @return an error code, or 0 if successful */
+int nip_order_clique_variables(nip_clique* cliques, int ncliques);
+
+/**
+ * Chooses the root clique for propagation from a simple cost model. 
+ * The cost of a message is the size of the two clique tables and the 
+ * sepset table in between. The cost of a root is the costliest path of 
+ * messages from it to any other clique (the critical path of collect 
+ * and distribute), plus the costs of the paths to each of \p targets 
+ * (e.g. the cliques where the messages between time slices enter and 
+ * leave: the entering one is collected to the root and the leaving 
+ * one updated from there at every time step). 
+ * Ties are broken by the order of \p cliques.
+ * NOTE: This marks the cliques, so unmark them before other searches.
+ * @param cliques Array of all nodes in the join tree
+ * @param ncliques Size of the array \p cliques
+ * @param targets Cliques preferred near the root (NULLs are ignored)
+ * @param ntargets Size of the array \p targets
+ * @return reference to the cheapest root, or NULL if there are no cliques 
+ *         or no memory */
+nip_clique nip_choose_root(nip_clique* cliques, int ncliques, 
+			   nip_clique targets[], int ntargets);
+
 /**
  * Prints the variables of the given clique.
  * @param stream An open output stream for writing
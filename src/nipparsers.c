@@ -41,8 +41,6 @@
 
 /* #define DEBUG_DATAFILE */
 
-static int nip_null_observation(char* token);
-
 static void nip_free_data_file(nip_data_file f);
 
 nip_data_file nip_open_data_file(char* filename, char separator,
@@ -373,11 +371,7 @@ nip_data_file nip_open_data_file(char* filename, char separator,
 }
 
 
-/*
- * Tells if the given token indicates a missing value, a "null observation".
- * The token must be null terminated.
- */
-static int nip_null_observation(char *token){
+int nip_null_observation(char *token){
 
 #ifdef DEBUG_DATAFILE
   printf("nip_null_observation called\n");
@@ -98,6 +98,14 @@ void nip_close_data_file(nip_data_file file);
 int nip_next_line_tokens(nip_data_file f, char separator, char ***tokens);
 
 
+/**
+ * Tells if the given token indicates a missing value, a "null 
+ * observation", such as "null" or "N/A".
+ * @param token A null terminated string
+ * @return non-zero if the token stands for a missing value */
+int nip_null_observation(char* token);
+
+
 /**
  * Gets the next token from an opened hugin .net file.
  * If token_length == 0, there are no more tokens.
@@ -27,6 +27,7 @@
 #include <string.h>
 
 #include "niplists.h"
+#include "nipvector.h"
 #include "niperrorhandler.h"
 
 
@@ -40,19 +41,154 @@
 static double* nip_get_potential_pointer(nip_potential p, int indices[]);
 
 /**
- * Drops the indices that are marginalised or multiplied. 
- * Some constraints:
- * - \p dest_indices must have the same size as mapping[] and
- * - smaller than \p source_indices, and 
- * - mapping has indices to \p source_indices (index of index).
- * @param source_indices Indices to a high-dimensional potential
- * @param dest_indices Indices to a lesser-dimensional potential
- * @param mapping Indices of each lesser dimension in the higher-dim space
- * @param size_of_mapping Dimensionality of dest_indices and mapping
+ * The odometer: advances the multi-index \p counter of potential \p p 
+ * by one step along dimensions 1..n-1 (dimension 0 is the innermost 
+ * loop of the callers) and keeps the offset \p *offset of the mapped 
+ * element in the other potential up to date, without any divisions.
+ * @param p The potential being traversed linearly
+ * @param counter Current index along each dimension of \p p
+ * @param stride Strides given by nip_mapping_strides()
+ * @param offset Flat index in the other potential, updated in place
  */
-static void nip_choose_potential_indices(int source_indices[], 
-					 int dest_indices[], 
-					 int mapping[], int size_of_mapping);
+static void nip_step_odometer(nip_potential p, int counter[], 
+			      int stride[], int* offset);
+
+/* Number of elements swept at a time by the fused kernels */
+#define NIP_FUSED_BLOCK_SIZE 2048
+
+/* Recognise the layouts where the elements mapped to the same element 
+ * of the other potential are contiguous: returns the size of the 
+ * blocks, or 0 if the layout is something else.
+ * Prefix: the mapped dimensions are the first ones in the same order, 
+ * so the other potential matches each block of \p p element by element.
+ * Suffix: the mapped dimensions are the last ones in the same order, 
+ * so each block of \p p maps to a single element (a broadcast). */
+static int nip_prefix_block(nip_potential p, int stride[]);
+static int nip_suffix_block(nip_potential p, int stride[]);
+
+/* A share of the work in a parallel kernel */
+typedef struct {
+  nip_potential source; /* the potential traversed in chunks */
+  nip_potential numerator;
+  nip_potential denominator;
+  double* destination; /* when marginalising */
+  int* stride;
+  int num_of_chunks;
+  int* split;       /* marginalising: the dimensions whose values are split */
+  int lowest;       /* the lowest of them */
+  int num_of_units; /* the combinations of their values */
+} nip_kernel_struct;
+
+static int nip_prefix_block(nip_potential p, int stride[]){
+  int i, block = 1;
+  for(i = 0; i < p->dimensionality && stride[i] == block; i++)
+    block *= p->cardinality[i];
+  if(i == 0)
+    return 0;
+  for(; i < p->dimensionality; i++)
+    if(stride[i] != 0)
+      return 0;
+  return block;
+}
+
+
+static int nip_suffix_block(nip_potential p, int stride[]){
+  int i, block = 1, next = 1;
+  for(i = 0; i < p->dimensionality && stride[i] == 0; i++)
+    block *= p->cardinality[i];
+  if(i == 0)
+    return 0;
+  for(; i < p->dimensionality; i++){
+    if(stride[i] != next)
+      return 0;
+    next *= p->cardinality[i];
+  }
+  return block;
+}
+
+
+/* Sets the odometer to the beginning of row \p row (a row is a run 
+ * along dimension 0) and returns the corresponding offset */
+static int nip_start_odometer(nip_potential p, int row, 
+			      int counter[], int stride[]);
+
+/* The free dimensions of a slice of p (see nip_sliced_marginalise()): 
+ * their sizes, strides in p and in the other potential, and the offsets 
+ * of the first element of the slice. Returns the number of them. */
+static int nip_slice_view(nip_potential p, int stride[], int slice[], 
+			  int card[], int pstride[], int ostride[], 
+			  int* poffset, int* ooffset);
+
+/* Size of the blocks swept by the fused kernels: a multiple of the 
+ * rows and of the contiguous blocks of each layout */
+static int nip_fused_block(nip_potential p, int* stride[], int n, 
+			   int prefix[], int suffix[]);
+
+/* A slice of a potential (see nip_sliced_marginalise()) as runs of 
+ * contiguous elements: the free dimensions of the slice that follow 
+ * each other from dimension 0 make up a run, an odometer steps over 
+ * the rest. The layouts of nip_prefix_block() and nip_suffix_block() 
+ * are recognised within a run, so the vector kernels still apply. */
+typedef struct {
+  int n;          /* number of the other potentials */
+  int width;      /* dimensionality of the sliced potential */
+  int dims;       /* free dimensions of the slice */
+  int f;          /* the first f of them make up a run */
+  int run;        /* elements in a run */
+  int piece;      /* elements taken at a time from a longer run */
+  int* card;      /* sizes of the free dimensions */
+  int* pstride;   /* their strides in the sliced potential */
+  int* ostride;   /* [n * width] their strides in each of the others */
+  int* prefix;    /* [n] prefix block within a run, or 0 */
+  int* suffix;    /* [n] suffix block within a run, or 0 */
+  int poffset;    /* the first element of the slice */
+  int* ooffset;   /* [n] and its place in each of the others */
+  double* data;   /* the sliced potential */
+  double** num;   /* [n] the others: destinations or numerators */
+  double** den;   /* [n] denominators, when updating */
+  const nip_vector_kernels* vec;
+} nip_run_struct;
+
+/* Most runs swept at a time by the sliced fused kernels */
+#define NIP_FUSED_RUNS 256
+
+/* Fills in r for the slice of p, mapped to n others by stride[]. 
+ * Returns the number of free dimensions. */
+static int nip_slice_runs(nip_potential p, int* stride[], int n, 
+			  int slice[], nip_run_struct* r);
+
+/* Sweeps the slice one group of runs (or one piece of a long run) at 
+ * a time, giving it to each of the others in turn: every element goes 
+ * through the same operations in the same order as when the others 
+ * are taken one by one. kernel(r, m, p, o, a, len) does elements 
+ * a..a+len-1 of the run at p for the other potential m (at o). */
+static void nip_sweep_runs(nip_run_struct* r, 
+			   void (*kernel)(nip_run_struct*, int, int, int, 
+					  int, int));
+static void nip_marginalise_run(nip_run_struct* r, int m, int p, int o, 
+				int a, int len);
+static void nip_update_run(nip_run_struct* r, int m, int p, int o, 
+			   int a, int len);
+
+/* Sets the odometer of a run to element a (a multiple of the first 
+ * dimension) and returns its offset in the other potential m */
+static int nip_start_run(nip_run_struct* r, int m, int a, int counter[]);
+
+/* Rows of chunk i out of n */
+static void nip_chunk_rows(nip_potential p, int i, int n, 
+			   int* first, int* last);
+
+/* Chooses the dimensions for splitting a marginalisation among n 
+ * threads: the highest ones kept in the destination, until there are 
+ * at least n combinations of their values (units). Each unit sums into 
+ * elements of its own, so the split is exact. Returns the number of 
+ * units, and marks the dimensions in split[]. */
+static int nip_split_units(nip_potential p, int stride[], int n, 
+			   int split[], int* lowest);
+
+/* Parallel tasks: one chunk of the table each */
+static int nip_marginalise_chunk(void* data, int i);
+static int nip_update_chunk(void* data, int i);
 
 
 static double* nip_get_potential_pointer(nip_potential p, int indices[]){
@@ -68,15 +204,34 @@ static double* nip_get_potential_pointer(nip_potential p, int indices[]){
 }
 
 
-/* TODO: this could be a macro... */
-static void nip_choose_potential_indices(int source_indices[], 
-					 int dest_indices[], 
-					 int mapping[], 
-					 int size_of_mapping){
+void nip_mapping_strides(nip_potential p, int cardinality[], 
+			 int mapping[], int size_of_mapping, int stride[]){
+  int i;
+  int card_temp = 1;
+  for(i = 0; i < p->dimensionality; i++)
+    stride[i] = 0; /* marginalised dimensions don't move in q */
+  /* the same multipliers as in nip_get_potential_pointer(q, ...) */
+  for(i = 0; i < size_of_mapping; i++){
+    stride[mapping[i]] = card_temp;
+    card_temp *= cardinality[i];
+  }
+  return;
+}
+
+
+static void nip_step_odometer(nip_potential p, int counter[], 
+			      int stride[], int* offset){
   int i;
-  /* Warning: Write Only Code (TM) */
-  for(i = 0; i < size_of_mapping; i++)
-    dest_indices[i] = source_indices[mapping[i]];
+  /* dimension 0 has just wrapped around: rewind it */
+  *offset -= stride[0] * p->cardinality[0];
+  for(i = 1; i < p->dimensionality; i++){
+    counter[i]++;
+    *offset += stride[i];
+    if(counter[i] < p->cardinality[i])
+      return; /* no carry */
+    counter[i] = 0;
+    *offset -= stride[i] * p->cardinality[i];
+  }
   return;
 }
 
@@ -86,7 +241,7 @@ nip_potential nip_new_potential(int cardinality[], int dimensionality,
 
   /* JJ NOTE: what if dimensionality = 0 i.e. dsize = 1 ???
    * Fixed 23.1.2011 */
-  int i;
+  int i, n;
   int dsize;
   double* dpointer = NULL;
   nip_potential p;
@@ -96,26 +251,19 @@ nip_potential nip_new_potential(int cardinality[], int dimensionality,
     return NULL;
   }
 
-  p = (nip_potential) malloc(sizeof(nip_potential_struct));
+  /* the struct and its small arrays in one allocation */
+  n = (dimensionality > 0 ? dimensionality : 1);
+  p = (nip_potential) calloc(1, sizeof(nip_potential_struct) + 
+			     3 * n * sizeof(int));
   if(!p){
     nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
     return NULL;
   }  
-
-  if(dimensionality > 0){
-    p->cardinality = (int *) calloc(dimensionality, sizeof(int));
-    p->temp_index = (int *) calloc(dimensionality, sizeof(int));
-  }
-  else {
-    p->cardinality = (int *) calloc(1, sizeof(int));
-    p->temp_index = (int *) calloc(1, sizeof(int));
-  }
-  if(!p->cardinality || !p->temp_index){
-    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
-    free(p->cardinality); // TODO: consider goto for exceptions?
-    free(p);
-    return NULL;
-  }
+  p->cardinality = (int *) (p + 1);
+  p->temp_index = p->cardinality + n;
+  p->temp_stride = p->temp_index + n;
+  p->in_arena = 0;
+  p->application_specific_properties = NULL; /* until needed */
 
   p->dimensionality = dimensionality;
   dsize = 1;
@@ -145,7 +293,6 @@ nip_potential nip_new_potential(int cardinality[], int dimensionality,
       p->data[i] = data[i];
   }
 
-  p->application_specific_properties = nip_new_string_pair_list();
   return p;
 }
 
@@ -154,6 +301,11 @@ int nip_set_potential_property(nip_potential p, char* key, char* value){
   int err;
   if (!p || !key || !value)
     return nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+  if(!p->application_specific_properties){
+    p->application_specific_properties = nip_new_string_pair_list();
+    if(!p->application_specific_properties)
+      return nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+  }
   err = nip_append_string_pair(p->application_specific_properties, 
 			       key, value);
   return err;
@@ -200,10 +352,55 @@ int nip_retract_potential(nip_potential p, nip_potential ref){
 void nip_free_potential(nip_potential p){
   if(p){
     nip_free_string_pair_list(p->application_specific_properties);
-    free(p->cardinality);
-    free(p->temp_index);
-    free(p->data);
-    free(p);
+    if(!p->in_arena)
+      free(p->data);
+    free(p); /* and the arrays after it */
+  }
+  return;
+}
+
+
+nip_potential_arena nip_new_potential_arena(nip_potential p[], int n){
+  int i, size, align;
+  double* data;
+  nip_potential_arena a;
+
+  a = (nip_potential_arena) malloc(sizeof(nip_potential_arena_struct));
+  if(!a){
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    return NULL;
+  }
+
+  /* each table padded to whole cache lines */
+  align = NIP_ARENA_ALIGNMENT / sizeof(double);
+  size = 0;
+  for(i = 0; i < n; i++)
+    size += (p[i]->size_of_data + align - 1) / align * align;
+  if(posix_memalign((void**) &(a->data), NIP_ARENA_ALIGNMENT, 
+		    (size + align) * sizeof(double)) != 0){
+    free(a);
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    return NULL;
+  }
+  a->size = size;
+  memset(a->data, 0, size * sizeof(double));
+
+  data = a->data;
+  for(i = 0; i < n; i++){
+    memcpy(data, p[i]->data, p[i]->size_of_data * sizeof(double));
+    free(p[i]->data);
+    p[i]->data = data;
+    p[i]->in_arena = 1;
+    data += (p[i]->size_of_data + align - 1) / align * align;
+  }
+  return a;
+}
+
+
+void nip_free_potential_arena(nip_potential_arena a){
+  if(a){
+    free(a->data);
+    free(a);
   }
   return;
 }
@@ -266,12 +463,26 @@ void nip_inverse_mapping(nip_potential p, int flat_index, int indices[]){
 
 int nip_general_marginalise(nip_potential source, nip_potential destination, 
 			    int mapping[]){
-  int i;
-  double *potvalue;
-
   if(destination->dimensionality > source->dimensionality)
     return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
 
+  /* Where each step in the source takes us in the destination, 
+   * eg. if mapping = { 0, 2, 4 }, then source indices { 2, 6, 7, 5, 3 } 
+   * correspond to destination indices { 2, 7, 3 } */
+  nip_mapping_strides(source, destination->cardinality, mapping, 
+		      destination->dimensionality, source->temp_stride);
+  return nip_strided_marginalise(source, destination, source->temp_stride);
+}
+
+
+int nip_strided_marginalise(nip_potential source, nip_potential destination, 
+			    int stride[]){
+  int i, j, n, offset;
+  const nip_vector_kernels* vec;
+  int counter[source->dimensionality + 1]; /* source may be shared by 
+					    * threads: no temp_index */
+  double *dst, *src;
+
   /* index arrays  (eg. [5][4][3] <-> { 5, 4, 3 }) */
   if(destination->dimensionality == 0){
     /* the rare event of potential being scalar */
@@ -284,22 +495,36 @@ int nip_general_marginalise(nip_potential source, nip_potential destination,
   /* Remove old garbage */
   nip_uniform_potential(destination, 0.0);
 
-  /* Linear traverse through array for easy access */
-  for(i = 0; i < source->size_of_data; i++){
-    /* flat index i  ->  index array  */
-    nip_inverse_mapping(source, i, source->temp_index);
-
-    /* remove extra indices, eg. if mapping = { 0, 2, 4 }, then
-       source_indices { 2, 6, 7, 5, 3 } becomes dest_indices { 2, 7, 3 }*/
-    nip_choose_potential_indices(source->temp_index, 
-				 destination->temp_index, 
-				 mapping,
-				 destination->dimensionality);
+  /* Contiguous layouts: vector kernels with the same order of sums */
+  if((n = nip_prefix_block(source, stride)) > 0){
+    vec = nip_vector_get_kernels();
+    for(i = 0; i < source->size_of_data; i += n)
+      vec->add(destination->data, source->data + i, n);
+    return 0;
+  }
+  if((n = nip_suffix_block(source, stride)) > 0){
+    nip_vector_run_sums(destination->data, source->data, 
+			source->size_of_data / n, n);
+    return 0;
+  }
 
-    /* get pointer to the destination potential element where the current
-     data should be added */
-    potvalue = nip_get_potential_pointer(destination, destination->temp_index);
-    *potvalue += source->data[i];
+  for(i = 0; i < source->dimensionality; i++)
+    counter[i] = 0;
+
+  /* Linear traverse through the source array: the innermost dimension 
+   * as a tight loop and the rest of the index like an odometer. 
+   * Each destination element gets the same sum in the same order as 
+   * with nip_inverse_mapping(), but without the divisions. */
+  n = source->cardinality[0];
+  src = source->data;
+  dst = destination->data;
+  offset = 0;
+  for(i = 0; i < source->size_of_data; i += n){
+    for(j = 0; j < n; j++){
+      dst[offset] += src[i + j]; /* THE sum */
+      offset += stride[0];
+    }
+    nip_step_odometer(source, counter, stride, &offset);
   }
 
   /* JJ NOTE: What if each potential had a small array called temp_index ??? 
@@ -311,9 +536,269 @@ int nip_general_marginalise(nip_potential source, nip_potential destination,
 }
 
 
+int nip_parallel_marginalise(nip_thread_pool pool, nip_potential source, 
+			     nip_potential destination, int stride[]){
+  int err;
+  int split[source->dimensionality + 1];
+  nip_kernel_struct k;
+
+  if(pool == NULL || pool->num_of_threads < 2 || 
+     source->size_of_data < NIP_PARALLEL_KERNEL_SIZE || 
+     destination->dimensionality == 0)
+    return nip_strided_marginalise(source, destination, stride);
+
+  k.num_of_units = nip_split_units(source, stride, pool->num_of_threads, 
+				   split, &(k.lowest));
+  if(k.num_of_units < 2)
+    return nip_strided_marginalise(source, destination, stride);
+
+  k.source = source;
+  k.numerator = NULL;
+  k.denominator = NULL;
+  k.destination = destination->data;
+  k.stride = stride;
+  k.split = split;
+  k.num_of_chunks = (k.num_of_units < pool->num_of_threads ? 
+		     k.num_of_units : pool->num_of_threads);
+
+  nip_uniform_potential(destination, 0.0);
+  err = nip_parallel_for(pool, nip_marginalise_chunk, &k, k.num_of_chunks);
+  if(err != 0)
+    return nip_report_error(__FILE__, __LINE__, err, 1);
+  return 0;
+}
+
+
+static int nip_split_units(nip_potential p, int stride[], int n, 
+			   int split[], int* lowest){
+  int i, units = 1;
+  *lowest = p->dimensionality;
+  for(i = p->dimensionality - 1; i >= 0; i--){
+    split[i] = (units < n && stride[i] != 0);
+    if(split[i]){
+      units *= p->cardinality[i];
+      *lowest = i;
+    }
+  }
+  return units;
+}
+
+
+static int nip_marginalise_chunk(void* data, int c){
+  nip_kernel_struct* k = data;
+  nip_potential p = k->source;
+  int i, j, u, r, n0, first, last, block, row, src, dst, offset;
+  int counter[p->dimensionality + 1];
+  int size[p->dimensionality + 1]; /* strides of p itself */
+  int* stride = k->stride;
+  double* to = k->destination;
+
+  size[0] = 1;
+  for(i = 0; i < p->dimensionality; i++)
+    size[i + 1] = size[i] * p->cardinality[i];
+  block = size[k->lowest]; /* the elements below the split dimensions */
+  n0 = p->cardinality[0];
+  first = (int)(((long) k->num_of_units * c) / k->num_of_chunks);
+  last = (int)(((long) k->num_of_units * (c + 1)) / k->num_of_chunks);
+
+  for(u = first; u < last; u++){
+    /* the first element of the unit and its place in the destination */
+    src = 0;
+    dst = 0;
+    for(i = k->lowest, r = u; i < p->dimensionality; i++){
+      counter[i] = 0;
+      if(k->split[i]){
+	src += (r % p->cardinality[i]) * size[i];
+	dst += (r % p->cardinality[i]) * stride[i];
+	r /= p->cardinality[i];
+      }
+    }
+
+    /* The blocks of the unit in the order of the source (the dimensions 
+     * in between are summed out), so that each element gets the same 
+     * sum in the same order as in nip_strided_marginalise() */
+    for(;;){
+      if(k->lowest == 0)
+	to[dst] += p->data[src];
+      else{
+	for(i = 1; i < k->lowest; i++)
+	  counter[i] = 0;
+	offset = dst;
+	for(row = src; row < src + block; row += n0){
+	  for(j = 0; j < n0; j++){
+	    to[offset] += p->data[row + j]; /* THE sum */
+	    offset += stride[0];
+	  }
+	  offset -= stride[0] * n0;
+	  for(i = 1; i < k->lowest; i++){
+	    counter[i]++;
+	    offset += stride[i];
+	    if(counter[i] < p->cardinality[i])
+	      break;
+	    counter[i] = 0;
+	    offset -= stride[i] * p->cardinality[i];
+	  }
+	}
+      }
+
+      for(i = k->lowest + 1; i < p->dimensionality; i++){
+	if(k->split[i])
+	  continue;
+	counter[i]++;
+	src += size[i];
+	if(counter[i] < p->cardinality[i])
+	  break;
+	counter[i] = 0;
+	src -= size[i + 1];
+      }
+      if(i >= p->dimensionality)
+	break;
+    }
+  }
+  return 0;
+}
+
+
+int nip_sliced_marginalise(nip_potential source, nip_potential destination, 
+			   int stride[], int slice[]){
+  int i, j, n, src, dst, s, d;
+  int card[source->dimensionality + 1];
+  int sstride[source->dimensionality + 1];
+  int dstride[source->dimensionality + 1];
+  int counter[source->dimensionality + 1];
+
+  n = nip_slice_view(source, stride, slice, card, sstride, dstride, 
+		     &src, &dst);
+  if(n == source->dimensionality)
+    return nip_strided_marginalise(source, destination, stride);
+
+  nip_uniform_potential(destination, 0.0);
+  if(n == 0){
+    destination->data[dst] += source->data[src];
+    return 0;
+  }
+
+  /* The same sums in the same order as in nip_strided_marginalise(), 
+   * just without the zeros */
+  for(i = 0; i < n; i++)
+    counter[i] = 0;
+  for(;;){
+    for(j = 0, s = src, d = dst; j < card[0]; j++){
+      destination->data[d] += source->data[s]; /* THE sum */
+      s += sstride[0];
+      d += dstride[0];
+    }
+    for(i = 1; i < n; i++){
+      counter[i]++;
+      src += sstride[i];
+      dst += dstride[i];
+      if(counter[i] < card[i])
+	break;
+      counter[i] = 0;
+      src -= sstride[i] * card[i];
+      dst -= dstride[i] * card[i];
+    }
+    if(i >= n)
+      break;
+  }
+  return 0;
+}
+
+
+int nip_fused_marginalise(nip_potential source, nip_potential destination[], 
+			  int* stride[], int n){
+  int i, j, m, k, n0, first, last, block, offset;
+  int counter[source->dimensionality + 1];
+  int prefix[n + 1];
+  int suffix[n + 1];
+  double *src, *dst;
+  const nip_vector_kernels* vec;
+
+  if(n < 1)
+    return 0;
+  if(n == 1)
+    return nip_strided_marginalise(source, destination[0], stride[0]);
+
+  for(m = 0; m < n; m++)
+    nip_uniform_potential(destination[m], 0.0);
+
+  /* One block at a time, small enough to stay in the cache while each 
+   * destination takes its share: every destination element gets the 
+   * same sum in the same order as in nip_strided_marginalise() */
+  block = nip_fused_block(source, stride, n, prefix, suffix);
+  vec = nip_vector_get_kernels();
+  n0 = source->cardinality[0];
+  src = source->data;
+  for(first = 0; first < source->size_of_data; first = last){
+    last = first + block;
+    if(last > source->size_of_data)
+      last = source->size_of_data;
+    for(m = 0; m < n; m++){
+      dst = destination[m]->data;
+      if((k = prefix[m]) > 0){
+	for(i = first; i < last; i += k)
+	  vec->add(dst, src + i, k);
+      }
+      else if((k = suffix[m]) > 0){
+	vec->run_sums(dst + first / k, src + first, (last - first) / k, k);
+      }
+      else{
+	offset = nip_start_odometer(source, first / n0, counter, stride[m]);
+	for(i = first; i < last; i += n0){
+	  for(j = 0; j < n0; j++){
+	    dst[offset] += src[i + j];
+	    offset += stride[m][0];
+	  }
+	  nip_step_odometer(source, counter, stride[m], &offset);
+	}
+      }
+    }
+  }
+  return 0;
+}
+
+
+int nip_fused_sliced_marginalise(nip_potential source, 
+				 nip_potential destination[], 
+				 int* stride[], int n, int slice[]){
+  int m;
+  int card[source->dimensionality + 1];
+  int pstride[source->dimensionality + 1];
+  int ostride[n * source->dimensionality + 1];
+  int prefix[n + 1];
+  int suffix[n + 1];
+  int ooffset[n + 1];
+  double* dst[n + 1];
+  nip_run_struct r;
+
+  if(n < 1)
+    return 0;
+
+  r.card = card;
+  r.pstride = pstride;
+  r.ostride = ostride;
+  r.prefix = prefix;
+  r.suffix = suffix;
+  r.ooffset = ooffset;
+  if(nip_slice_runs(source, stride, n, slice, &r) == source->dimensionality)
+    return nip_fused_marginalise(source, destination, stride, n);
+
+  for(m = 0; m < n; m++){
+    nip_uniform_potential(destination[m], 0.0);
+    dst[m] = destination[m]->data;
+  }
+  r.data = source->data;
+  r.num = dst;
+  r.den = NULL;
+  nip_sweep_runs(&r, nip_marginalise_run);
+  return 0;
+}
+
+
 int nip_total_marginalise(nip_potential source, double destination[], 
 			  int variable){
-  int i, j, x, index = 0, flat_index;
+  int i, j, k, block, n;
+  double *src;
 
   if(variable < 0 || variable >= source->dimensionality)
     return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
@@ -327,34 +812,140 @@ int nip_total_marginalise(nip_potential source, double destination[],
   }
  
   /* initialization */
-  for(i = 0; i < source->cardinality[variable]; i++)
+  n = source->cardinality[variable];
+  for(i = 0; i < n; i++)
     destination[i] = 0.0;
 
-  for(i = 0; i < source->size_of_data; i++){
-    /* partial inverse mapping to find out the destination index */
-    flat_index = i;
-    x = source->size_of_data;
-    for(j = source->dimensionality - 1; j >= variable; j--){
-      x /= source->cardinality[j];
-      index = flat_index / x;    /* integer division */
-      flat_index -= index * x;
+  /* The data consists of blocks of consecutive elements sharing 
+   * the same index of the variable, like 
+   * block = prod(cardinality[0 .. variable-1]) */
+  block = 1;
+  for(i = 0; i < variable; i++)
+    block *= source->cardinality[i];
+
+  src = source->data;
+  for(i = 0; i < source->size_of_data; i += block * n){
+    for(k = 0; k < n; k++){
+      for(j = 0; j < block; j++)
+	destination[k] += src[j]; /* THE sum */
+      src += block;
     }
-    destination[index] += source->data[i]; /* THE sum */
   }
 
   return 0;
 }
 
 
-void nip_normalise_array(double result[], int array_size){
+int nip_fused_total_marginalise(nip_potential source, double* destination[], 
+				int variable[], int n){
+  int i, j, m, n0;
+  int counter[source->dimensionality + 1];
+  double sum;
+  double *src, *dst;
+
+  for(m = 0; m < n; m++){
+    if(variable[m] < 0 || variable[m] >= source->dimensionality)
+      return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
+    for(i = 0; i < source->cardinality[variable[m]]; i++)
+      destination[m][i] = 0.0;
+  }
+  if(n < 1)
+    return 0;
+  if(n == 1)
+    return nip_total_marginalise(source, destination[0], variable[0]);
+
+  for(i = 0; i < source->dimensionality; i++)
+    counter[i] = 0;
+
+  /* Row by row (a run along dimension 0): each sum gets the same 
+   * elements in the same order as in nip_total_marginalise() */
+  n0 = source->cardinality[0];
+  src = source->data;
+  for(i = 0; i < source->size_of_data; i += n0){
+    for(m = 0; m < n; m++){
+      dst = destination[m];
+      if(variable[m] == 0){
+	for(j = 0; j < n0; j++)
+	  dst[j] += src[i + j];
+      }
+      else{
+	sum = dst[counter[variable[m]]];
+	for(j = 0; j < n0; j++)
+	  sum += src[i + j];
+	dst[counter[variable[m]]] = sum;
+      }
+    }
+    for(j = 1; j < source->dimensionality; j++){
+      if(++counter[j] < source->cardinality[j])
+	break;
+      counter[j] = 0;
+    }
+  }
+  return 0;
+}
+
+
+int nip_parallel_total_marginalise(nip_thread_pool pool, 
+				   nip_potential source, 
+				   double* destination[], int variable[], 
+				   int n){
+  int i, m, err;
+  int stride[source->dimensionality + 1];
+  int split[source->dimensionality + 1];
+  nip_kernel_struct k;
+
+  if(pool == NULL || pool->num_of_threads < 2 || 
+     source->size_of_data < NIP_PARALLEL_KERNEL_SIZE)
+    return nip_fused_total_marginalise(source, destination, variable, n);
+
+  /* a huge table: all the threads for each variable in turn */
+  for(m = 0; m < n; m++){
+    if(variable[m] < 0 || variable[m] >= source->dimensionality)
+      return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
+    for(i = 0; i < source->dimensionality; i++)
+      stride[i] = 0;
+    stride[variable[m]] = 1;
+    k.num_of_units = nip_split_units(source, stride, pool->num_of_threads, 
+				     split, &(k.lowest));
+    if(k.num_of_units < 2){
+      err = nip_total_marginalise(source, destination[m], variable[m]);
+      if(err != 0)
+	return nip_report_error(__FILE__, __LINE__, err, 1);
+      continue;
+    }
+    k.source = source;
+    k.numerator = NULL;
+    k.denominator = NULL;
+    k.destination = destination[m];
+    k.stride = stride;
+    k.split = split;
+    k.num_of_chunks = (k.num_of_units < pool->num_of_threads ? 
+		       k.num_of_units : pool->num_of_threads);
+    for(i = 0; i < source->cardinality[variable[m]]; i++)
+      destination[m][i] = 0.0;
+    err = nip_parallel_for(pool, nip_marginalise_chunk, &k, k.num_of_chunks);
+    if(err != 0)
+      return nip_report_error(__FILE__, __LINE__, err, 1);
+  }
+  return 0;
+}
+
+
+double nip_potential_mass(nip_potential p){
   int i;
+  double m = 0;
+  for(i = 0; i < p->size_of_data; i++)
+    m += p->data[i];
+  return m;
+}
+
+
+void nip_normalise_array(double result[], int array_size){
   double sum = 0;
-  for(i = 0; i < array_size; i++)
-    sum += result[i];
+  nip_vector_run_sums(&sum, result, 1, array_size);
   if(sum == 0)
     return;
-  for(i = 0; i < array_size; i++)
-    result[i] /= sum;
+  nip_vector_scale(result, NULL, &sum, array_size);
   return;
 }
 
@@ -435,10 +1026,7 @@ int nip_sum_potential(nip_potential sum, nip_potential increment){
 
 int nip_update_potential(nip_potential numerator, nip_potential denominator, 
 			 nip_potential target, int mapping[]){
-  int i;
-  int nvars = 0;
-  double* potvalue;
-  int* source_index;
+  nip_potential source;
 
   if((numerator && denominator && 
       (numerator->dimensionality != denominator->dimensionality)) || 
@@ -447,16 +1035,31 @@ int nip_update_potential(nip_potential numerator, nip_potential denominator,
     return nip_report_error(__FILE__, __LINE__, EFAULT, 1);
   }
 
-  if(numerator){
-    nvars = numerator->dimensionality;
-    source_index = numerator->temp_index;
-  }
-  else{
-    nvars = denominator->dimensionality;
-    source_index = denominator->temp_index;
-  }
+  if(numerator)
+    source = numerator;
+  else
+    source = denominator;
+
+  /* The general idea is the same as in marginalise */
+  nip_mapping_strides(target, source->cardinality, mapping, 
+		      source->dimensionality, target->temp_stride);
+  return nip_strided_update(numerator, denominator, target, 
+			    target->temp_stride);
+}
 
-  if(nvars == 0){ /* when numerator & denominator are scalar */
+
+int nip_strided_update(nip_potential numerator, nip_potential denominator, 
+		       nip_potential target, int stride[]){
+  int i, j, n, offset;
+  int* counter;
+  double *num, *den, *dst;
+  const nip_vector_kernels* vec;
+
+  if(numerator == NULL && denominator == NULL)
+    return nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+
+  if((numerator ? numerator : denominator)->dimensionality == 0){
+    /* when numerator & denominator are scalar */
     for(i = 0; i < target->size_of_data; i++){
       if(numerator)
 	target->data[i] *= numerator->data[0];
@@ -471,51 +1074,700 @@ int nip_update_potential(nip_potential numerator, nip_potential denominator,
     return 0;
   }
 
-  /* The general idea is the same as in marginalise */
-  for(i = 0; i < target->size_of_data; i++){
-    nip_inverse_mapping(target, i, target->temp_index);
-    nip_choose_potential_indices(target->temp_index, 
-				 source_index, 
-				 mapping, nvars);
+  num = (numerator   ? numerator->data   : NULL);
+  den = (denominator ? denominator->data : NULL);
 
-    if(numerator){ /* THE multiplication */
-      potvalue = nip_get_potential_pointer(numerator, source_index);
-      target->data[i] *= *potvalue;
+  /* Contiguous layouts: vector kernels doing the same operations */
+  vec = nip_vector_get_kernels();
+  if((n = nip_prefix_block(target, stride)) > 0){
+    for(i = 0; i < target->size_of_data; i += n)
+      vec->update(target->data + i, num, den, n);
+    return 0;
+  }
+  if((n = nip_suffix_block(target, stride)) > 0){
+    for(i = 0, j = 0; i < target->size_of_data; i += n, j++)
+      vec->scale(target->data + i, (num ? num + j : NULL), 
+		 (den ? den + j : NULL), n);
+    return 0;
+  }
+
+  counter = target->temp_index;
+  for(i = 0; i < target->dimensionality; i++)
+    counter[i] = 0;
+
+  n = target->cardinality[0];
+  dst = target->data;
+  offset = 0;
+  for(i = 0; i < target->size_of_data; i += n){
+    for(j = 0; j < n; j++){
+      if(num) /* THE multiplication */
+	dst[i + j] *= num[offset];
+
+      if(den){ /* THE division */
+	if(den[offset] != 0)
+	  dst[i + j] /= den[offset];
+	else
+	  dst[i + j] = 0;  /* see Procedural Guide p. 20 */
+      }
+      offset += stride[0];
     }
+    nip_step_odometer(target, counter, stride, &offset);
+  }
 
-    if(denominator){ /* THE division */
-      potvalue = nip_get_potential_pointer(denominator, source_index);
-      if(*potvalue != 0)
-	target->data[i] /= *potvalue;
-      else
-	target->data[i] = 0;  /* see Procedural Guide p. 20 */
+  return 0;
+}
+
+
+int nip_sliced_update(nip_potential numerator, nip_potential denominator, 
+		      nip_potential target, int stride[], int slice[]){
+  int i, j, n, dst, src, d, s;
+  int card[target->dimensionality + 1];
+  int tstride[target->dimensionality + 1];
+  int ostride[target->dimensionality + 1];
+  int counter[target->dimensionality + 1];
+  double *num, *den;
+
+  if(numerator == NULL && denominator == NULL)
+    return nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+
+  n = nip_slice_view(target, stride, slice, card, tstride, ostride, 
+		     &dst, &src);
+  if(n == target->dimensionality)
+    return nip_strided_update(numerator, denominator, target, stride);
+
+  num = (numerator   ? numerator->data   : NULL);
+  den = (denominator ? denominator->data : NULL);
+  for(i = 0; i < n; i++)
+    counter[i] = 0;
+  card[n] = 1; /* a single element, if all the dimensions are fixed */
+  tstride[n] = 0;
+  ostride[n] = 0;
+  for(;;){
+    for(j = 0, d = dst, s = src; j < card[0]; j++){
+      if(num) /* THE multiplication */
+	target->data[d] *= num[s];
+      if(den){ /* THE division */
+	if(den[s] != 0)
+	  target->data[d] /= den[s];
+	else
+	  target->data[d] = 0; /* see Procedural Guide p. 20 */
+      }
+      d += tstride[0];
+      s += ostride[0];
+    }
+    for(i = 1; i < n; i++){
+      counter[i]++;
+      dst += tstride[i];
+      src += ostride[i];
+      if(counter[i] < card[i])
+	break;
+      counter[i] = 0;
+      dst -= tstride[i] * card[i];
+      src -= ostride[i] * card[i];
     }
+    if(i >= n)
+      break;
   }
+  return 0;
+}
+
+
+int nip_fused_update(nip_potential numerator[], nip_potential denominator[], 
+		     nip_potential target, int* stride[], int n){
+  int i, j, m, k, n0, first, last, block, offset;
+  int counter[target->dimensionality + 1];
+  int prefix[n + 1];
+  int suffix[n + 1];
+  double *num, *den, *dst;
+  const nip_vector_kernels* vec;
+
+  if(n < 1)
+    return 0;
+  if(n == 1)
+    return nip_strided_update(numerator[0], denominator[0], 
+			      target, stride[0]);
+  for(m = 0; m < n; m++)
+    if(numerator[m] == NULL && denominator[m] == NULL)
+      return nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+
+  /* One block at a time, updated with each pair in turn: every element 
+   * goes through the same operations in the same order as with 
+   * nip_strided_update() for each pair */
+  block = nip_fused_block(target, stride, n, prefix, suffix);
+  vec = nip_vector_get_kernels();
+  n0 = target->cardinality[0];
+  dst = target->data;
+  for(first = 0; first < target->size_of_data; first = last){
+    last = first + block;
+    if(last > target->size_of_data)
+      last = target->size_of_data;
+    for(m = 0; m < n; m++){
+      num = (numerator[m]   ? numerator[m]->data   : NULL);
+      den = (denominator[m] ? denominator[m]->data : NULL);
+      if((k = prefix[m]) > 0){
+	for(i = first; i < last; i += k)
+	  vec->update(dst + i, num, den, k);
+      }
+      else if((k = suffix[m]) > 0){
+	for(i = first, j = first / k; i < last; i += k, j++)
+	  vec->scale(dst + i, (num ? num + j : NULL), 
+		     (den ? den + j : NULL), k);
+      }
+      else{
+	offset = nip_start_odometer(target, first / n0, counter, stride[m]);
+	for(i = first; i < last; i += n0){
+	  for(j = 0; j < n0; j++){
+	    if(num)
+	      dst[i + j] *= num[offset];
+	    if(den){
+	      if(den[offset] != 0)
+		dst[i + j] /= den[offset];
+	      else
+		dst[i + j] = 0; /* see Procedural Guide p. 20 */
+	    }
+	    offset += stride[m][0];
+	  }
+	  nip_step_odometer(target, counter, stride[m], &offset);
+	}
+      }
+    }
+  }
+  return 0;
+}
+
+
+int nip_fused_sliced_update(nip_potential numerator[], 
+			    nip_potential denominator[], 
+			    nip_potential target, int* stride[], int n, 
+			    int slice[]){
+  int m;
+  int card[target->dimensionality + 1];
+  int pstride[target->dimensionality + 1];
+  int ostride[n * target->dimensionality + 1];
+  int prefix[n + 1];
+  int suffix[n + 1];
+  int ooffset[n + 1];
+  double* num[n + 1];
+  double* den[n + 1];
+  nip_run_struct r;
+
+  if(n < 1)
+    return 0;
+  for(m = 0; m < n; m++)
+    if(numerator[m] == NULL && denominator[m] == NULL)
+      return nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+
+  r.card = card;
+  r.pstride = pstride;
+  r.ostride = ostride;
+  r.prefix = prefix;
+  r.suffix = suffix;
+  r.ooffset = ooffset;
+  if(nip_slice_runs(target, stride, n, slice, &r) == target->dimensionality)
+    return nip_fused_update(numerator, denominator, target, stride, n);
+
+  for(m = 0; m < n; m++){
+    num[m] = (numerator[m]   ? numerator[m]->data   : NULL);
+    den[m] = (denominator[m] ? denominator[m]->data : NULL);
+  }
+  r.data = target->data;
+  r.num = num;
+  r.den = den;
+  nip_sweep_runs(&r, nip_update_run);
+  return 0;
+}
+
 
+int nip_parallel_update(nip_thread_pool pool, nip_potential numerator, 
+			nip_potential denominator, nip_potential target, 
+			int stride[]){
+  int err;
+  nip_kernel_struct k;
+
+  if(pool == NULL || pool->num_of_threads < 2 || 
+     target->size_of_data < NIP_PARALLEL_KERNEL_SIZE)
+    return nip_strided_update(numerator, denominator, target, stride);
+
+  if(numerator == NULL && denominator == NULL)
+    return nip_report_error(__FILE__, __LINE__, EFAULT, 1);
+
+  k.source = target;
+  k.numerator = numerator;
+  k.denominator = denominator;
+  k.destination = NULL;
+  k.stride = stride;
+  k.split = NULL;
+  k.num_of_chunks = pool->num_of_threads;
+  err = nip_parallel_for(pool, nip_update_chunk, &k, k.num_of_chunks);
+  if(err != 0)
+    return nip_report_error(__FILE__, __LINE__, err, 1);
+  return 0;
+}
+
+
+static int nip_update_chunk(void* data, int c){
+  nip_kernel_struct* k = data;
+  nip_potential target = k->source;
+  int i, j, n, offset, row, last;
+  int counter[target->dimensionality + 1];
+  int* stride = k->stride;
+  double *num, *den, *dst;
+
+  nip_chunk_rows(target, c, k->num_of_chunks, &row, &last);
+  if(row >= last)
+    return 0;
+  n = target->cardinality[0];
+  num = (k->numerator   ? k->numerator->data   : NULL);
+  den = (k->denominator ? k->denominator->data : NULL);
+  dst = target->data;
+  offset = nip_start_odometer(target, row, counter, stride);
+  for(i = row * n; i < last * n; i += n){
+    for(j = 0; j < n; j++){
+      if(num)
+	dst[i + j] *= num[offset];
+      if(den){
+	if(den[offset] != 0)
+	  dst[i + j] /= den[offset];
+	else
+	  dst[i + j] = 0;  /* see Procedural Guide p. 20 */
+      }
+      offset += stride[0];
+    }
+    nip_step_odometer(target, counter, stride, &offset);
+  }
   return 0;
 }
 
 
+static int nip_start_odometer(nip_potential p, int row, 
+			      int counter[], int stride[]){
+  int i, offset = 0;
+  counter[0] = 0;
+  for(i = 1; i < p->dimensionality; i++){
+    counter[i] = row % p->cardinality[i];
+    row /= p->cardinality[i];
+    offset += counter[i] * stride[i];
+  }
+  return offset;
+}
+
+
+static int nip_slice_view(nip_potential p, int stride[], int slice[], 
+			  int card[], int pstride[], int ostride[], 
+			  int* poffset, int* ooffset){
+  int i, n = 0, step = 1;
+
+  *poffset = 0;
+  *ooffset = 0;
+  for(i = 0; i < p->dimensionality; i++){
+    if(slice != NULL && slice[i] >= 0){
+      *poffset += slice[i] * step;
+      *ooffset += slice[i] * stride[i];
+    }
+    else{
+      card[n] = p->cardinality[i];
+      pstride[n] = step;
+      ostride[n] = stride[i];
+      n++;
+    }
+    step *= p->cardinality[i];
+  }
+  return n;
+}
+
+
+static int nip_fused_block(nip_potential p, int* stride[], int n, 
+			   int prefix[], int suffix[]){
+  int m;
+  long a, b, t;
+  long block = p->cardinality[0];
+
+  for(m = 0; m < n; m++){
+    prefix[m] = nip_prefix_block(p, stride[m]);
+    suffix[m] = (prefix[m] > 0) ? 0 : nip_suffix_block(p, stride[m]);
+    if(prefix[m] + suffix[m] > 0){
+      /* least common multiple (both divide the size of p) */
+      a = block;
+      b = prefix[m] + suffix[m];
+      while(b != 0){
+	t = a % b;
+	a = b;
+	b = t;
+      }
+      block = (block / a) * (prefix[m] + suffix[m]);
+    }
+    if(block >= p->size_of_data)
+      return p->size_of_data;
+  }
+  if(block < NIP_FUSED_BLOCK_SIZE)
+    block *= NIP_FUSED_BLOCK_SIZE / block;
+  return (int)block;
+}
+
+
+static int nip_slice_runs(nip_potential p, int* stride[], int n, 
+			  int slice[], nip_run_struct* r){
+  int i, m, g, next;
+  long a, b, t, block, piece;
+  int* os;
+
+  r->n = n;
+  r->width = p->dimensionality;
+  r->dims = 0;
+  for(m = 0; m < n; m++)
+    r->dims = nip_slice_view(p, stride[m], slice, r->card, r->pstride, 
+			     r->ostride + m * r->width, 
+			     &r->poffset, r->ooffset + m);
+  r->f = 0;
+  r->run = 1;
+  while(r->f < r->dims && r->pstride[r->f] == r->run)
+    r->run *= r->card[r->f++];
+  r->vec = nip_vector_get_kernels();
+
+  /* the layouts within a run, and the pieces as in nip_fused_block() */
+  piece = (r->f > 0) ? r->card[0] : 1;
+  for(m = 0; m < n; m++){
+    os = r->ostride + m * r->width;
+    r->prefix[m] = 0;
+    r->suffix[m] = 0;
+    for(g = 0, next = 1; g < r->f && os[g] == next; g++)
+      next *= r->card[g];
+    for(i = g; i < r->f && os[i] == 0; i++);
+    if(g > 0 && i == r->f)
+      r->prefix[m] = next;
+    else{
+      for(g = 0, block = 1; g < r->f && os[g] == 0; g++)
+	block *= r->card[g];
+      for(i = g, next = 1; i < r->f && os[i] == next; i++)
+	next *= r->card[i];
+      if(g > 0 && i == r->f)
+	r->suffix[m] = (int)block;
+    }
+    if(r->prefix[m] + r->suffix[m] > 0){
+      /* least common multiple (both divide the run) */
+      a = piece;
+      b = r->prefix[m] + r->suffix[m];
+      while(b != 0){
+	t = a % b;
+	a = b;
+	b = t;
+      }
+      piece = (piece / a) * (r->prefix[m] + r->suffix[m]);
+    }
+  }
+  if(piece < NIP_FUSED_BLOCK_SIZE)
+    piece *= NIP_FUSED_BLOCK_SIZE / piece;
+  r->piece = (piece < r->run) ? (int)piece : r->run;
+  return r->dims;
+}
+
+
+static void nip_sweep_runs(nip_run_struct* r, 
+			   void (*kernel)(nip_run_struct*, int, int, int, 
+					  int, int)){
+  int i, m, g, a, len, p, runs, done, group;
+  int counter[r->dims + 1];
+  int o[r->n + 1];
+  int pfirst[NIP_FUSED_RUNS];
+  int ofirst[NIP_FUSED_RUNS * r->n + 1];
+
+  /* short runs are taken in groups, long ones a piece at a time */
+  group = 1;
+  if(r->piece == r->run)
+    group = NIP_FUSED_BLOCK_SIZE / r->run;
+  if(group < 1)
+    group = 1;
+  if(group > NIP_FUSED_RUNS)
+    group = NIP_FUSED_RUNS;
+
+  for(runs = 1, i = r->f; i < r->dims; i++){
+    runs *= r->card[i];
+    counter[i] = 0;
+  }
+  p = r->poffset;
+  for(m = 0; m < r->n; m++)
+    o[m] = r->ooffset[m];
+
+  for(done = 0; done < runs;){
+    for(g = 0; g < group && done < runs; g++, done++){
+      pfirst[g] = p;
+      for(m = 0; m < r->n; m++)
+	ofirst[g * r->n + m] = o[m];
+
+      /* the odometer over the dimensions outside the runs */
+      for(i = r->f; i < r->dims; i++){
+	counter[i]++;
+	p += r->pstride[i];
+	for(m = 0; m < r->n; m++)
+	  o[m] += r->ostride[m * r->width + i];
+	if(counter[i] < r->card[i])
+	  break;
+	counter[i] = 0;
+	p -= r->pstride[i] * r->card[i];
+	for(m = 0; m < r->n; m++)
+	  o[m] -= r->ostride[m * r->width + i] * r->card[i];
+      }
+    }
+
+    for(a = 0; a < r->run; a += r->piece){
+      len = r->run - a;
+      if(len > r->piece)
+	len = r->piece;
+      for(m = 0; m < r->n; m++)
+	for(i = 0; i < g; i++)
+	  kernel(r, m, pfirst[i], ofirst[i * r->n + m], a, len);
+    }
+  }
+  return;
+}
+
+
+static int nip_start_run(nip_run_struct* r, int m, int a, int counter[]){
+  int i, offset = 0;
+  int* os = r->ostride + m * r->width;
+
+  if(r->f > 0)
+    a /= r->card[0];
+  for(i = 1; i < r->f; i++){
+    counter[i] = a % r->card[i];
+    a /= r->card[i];
+    offset += counter[i] * os[i];
+  }
+  return offset;
+}
+
+
+static void nip_marginalise_run(nip_run_struct* r, int m, int p, int o, 
+				int a, int len){
+  int i, j, k, n0, s0, offset;
+  int counter[r->f + 1];
+  int* os = r->ostride + m * r->width;
+  double* src = r->data + p;
+  double* dst = r->num[m] + o;
+
+  if((k = r->prefix[m]) > 0){
+    for(i = a; i < a + len; i += k)
+      r->vec->add(dst, src + i, k);
+  }
+  else if((k = r->suffix[m]) > 0){
+    r->vec->run_sums(dst + a / k, src + a, len / k, k);
+  }
+  else{
+    n0 = (r->f > 0) ? r->card[0] : 1;
+    s0 = (r->f > 0) ? os[0] : 0;
+    offset = nip_start_run(r, m, a, counter);
+    for(i = a; i < a + len; i += n0){
+      for(j = 0; j < n0; j++){
+	dst[offset] += src[i + j]; /* THE sum */
+	offset += s0;
+      }
+      offset -= s0 * n0;
+      for(j = 1; j < r->f; j++){
+	counter[j]++;
+	offset += os[j];
+	if(counter[j] < r->card[j])
+	  break;
+	counter[j] = 0;
+	offset -= os[j] * r->card[j];
+      }
+    }
+  }
+  return;
+}
+
+
+static void nip_update_run(nip_run_struct* r, int m, int p, int o, 
+			   int a, int len){
+  int i, j, k, n0, s0, offset;
+  int counter[r->f + 1];
+  int* os = r->ostride + m * r->width;
+  double* dst = r->data + p;
+  double* num = (r->num[m] ? r->num[m] + o : NULL);
+  double* den = (r->den[m] ? r->den[m] + o : NULL);
+
+  if((k = r->prefix[m]) > 0){
+    for(i = a; i < a + len; i += k)
+      r->vec->update(dst + i, num, den, k);
+  }
+  else if((k = r->suffix[m]) > 0){
+    for(i = a, j = a / k; i < a + len; i += k, j++)
+      r->vec->scale(dst + i, (num ? num + j : NULL), 
+		    (den ? den + j : NULL), k);
+  }
+  else{
+    n0 = (r->f > 0) ? r->card[0] : 1;
+    s0 = (r->f > 0) ? os[0] : 0;
+    offset = nip_start_run(r, m, a, counter);
+    for(i = a; i < a + len; i += n0){
+      for(j = 0; j < n0; j++){
+	if(num) /* THE multiplication */
+	  dst[i + j] *= num[offset];
+	if(den){ /* THE division */
+	  if(den[offset] != 0)
+	    dst[i + j] /= den[offset];
+	  else
+	    dst[i + j] = 0; /* see Procedural Guide p. 20 */
+	}
+	offset += s0;
+      }
+      offset -= s0 * n0;
+      for(j = 1; j < r->f; j++){
+	counter[j]++;
+	offset += os[j];
+	if(counter[j] < r->card[j])
+	  break;
+	counter[j] = 0;
+	offset -= os[j] * r->card[j];
+      }
+    }
+  }
+  return;
+}
+
+
+static void nip_chunk_rows(nip_potential p, int i, int n, 
+			   int* first, int* last){
+  long rows = p->size_of_data / p->cardinality[0];
+  *first = (int)((rows * i) / n);
+  *last = (int)((rows * (i + 1)) / n);
+  return;
+}
+
+
 int nip_update_evidence(double numerator[], double denominator[], 
 			nip_potential target, int var){
-  int i, source_index;
+  int i, k, block, n;
+  double *dst;
+  const nip_vector_kernels* vec = nip_vector_get_kernels();
 
   /* target->dimensionality > 0  always */
 
-  /* The general idea is the same as in marginalise */
-  for(i = 0; i < target->size_of_data; i++){
-    nip_inverse_mapping(target, i, target->temp_index); 
-    /* some of the work above is useless (only one index is used) */
-    source_index = target->temp_index[var];
+  /* Blocks of consecutive elements share the same index of var, 
+   * so there is no need to find out the other indices at all */
+  n = target->cardinality[var];
+  block = 1;
+  for(i = 0; i < var; i++)
+    block *= target->cardinality[i];
+
+  dst = target->data;
+  for(i = 0; i < target->size_of_data; i += block * n){
+    for(k = 0; k < n; k++){
+      /* THE multiplication and THE division */
+      if(denominator != NULL && denominator[k] != 0)
+	vec->scale(dst, &(numerator[k]), &(denominator[k]), block);
+      else
+	vec->scale(dst, &(numerator[k]), NULL, block);
+      /* ----------------------------------------------------------- */
+      /* It is assumed that: denominator[i]==0 => numerator[i]==0 !!!*/
+      /* ----------------------------------------------------------- */
+      dst += block;
+    }
+  }
+
+  return 0;
+}
+
 
-    target->data[i] *= numerator[source_index];  /* THE multiplication */
+int nip_update_hard_evidence(nip_potential target, int var, int index, 
+			     double denominator){
+  int i, j, k, block, n;
+  double *dst;
+  const nip_vector_kernels* vec = nip_vector_get_kernels();
+
+  if(var < 0 || var >= target->dimensionality || 
+     index < 0 || index >= target->cardinality[var])
+    return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
 
-    if(denominator != NULL)
-      if(denominator[source_index] != 0)
-	target->data[i] /= denominator[source_index];  /* THE division */
-    /* ----------------------------------------------------------- */
-    /* It is assumed that: denominator[i]==0 => numerator[i]==0 !!!*/
-    /* ----------------------------------------------------------- */
+  n = target->cardinality[var];
+  block = 1;
+  for(i = 0; i < var; i++)
+    block *= target->cardinality[i];
+
+  dst = target->data;
+  for(i = 0; i < target->size_of_data; i += block * n){
+    for(k = 0; k < n; k++){
+      if(k != index){
+	for(j = 0; j < block; j++)
+	  dst[j] = 0; /* ruled out */
+      }
+      else if(denominator != 1 && denominator != 0){
+	vec->scale(dst, NULL, &denominator, block);
+      }
+      dst += block;
+    }
+  }
+
+  return 0;
+}
+
+
+int nip_update_hard_evidences(nip_potential target, int var[], int index[], 
+			      double denominator[], int n){
+  int i, j, k, d, low, block, mismatch;
+  int fixed[target->dimensionality + 1];
+  int counter[target->dimensionality + 1];
+  double *dst;
+  const nip_vector_kernels* vec = nip_vector_get_kernels();
+
+  low = target->dimensionality;
+  for(d = 0; d < target->dimensionality; d++)
+    fixed[d] = -1;
+  for(k = 0; k < n; k++){
+    if(var[k] < 0 || var[k] >= target->dimensionality || 
+       index[k] < 0 || index[k] >= target->cardinality[var[k]])
+      return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
+    if(fixed[var[k]] >= 0 && fixed[var[k]] != index[k]){
+      nip_uniform_potential(target, 0.0); /* nothing is possible */
+      return 0;
+    }
+    fixed[var[k]] = index[k];
+    if(var[k] < low)
+      low = var[k];
+  }
+  if(n == 0)
+    return 0;
+
+  /* contiguous blocks of the dimensions below the observed ones */
+  block = 1;
+  for(d = 0; d < low; d++)
+    block *= target->cardinality[d];
+
+  /* number of observed dimensions where the block is not at the 
+   * observed value */
+  mismatch = 0;
+  for(d = low; d < target->dimensionality; d++){
+    counter[d] = 0;
+    if(fixed[d] > 0)
+      mismatch++;
+  }
+
+  dst = target->data;
+  for(i = 0; i < target->size_of_data; i += block){
+    if(mismatch){
+      for(j = 0; j < block; j++)
+	dst[j] = 0; /* ruled out */
+    }
+    else{
+      for(k = 0; k < n; k++)
+	if(denominator[k] != 1 && denominator[k] != 0)
+	  vec->scale(dst, NULL, &(denominator[k]), block);
+    }
+    dst += block;
+
+    /* the next block */
+    for(d = low; d < target->dimensionality; d++){
+      if(counter[d] == fixed[d])
+	mismatch++;
+      counter[d]++;
+      if(counter[d] < target->cardinality[d]){
+	if(counter[d] == fixed[d])
+	  mismatch--;
+	break;
+      }
+      counter[d] = 0;
+      if(fixed[d] == 0)
+	mismatch--;
+    }
   }
 
   return 0;
@@ -528,7 +1780,7 @@ int nip_init_potential(nip_potential probs, nip_potential target,
   /* probs is assumed to be normalised */
 
   int i;
-  double *potvalue;
+  int* stride;
 
   if(!mapping){
     if(probs->size_of_data != target->size_of_data){
@@ -549,18 +1801,10 @@ int nip_init_potential(nip_potential probs, nip_potential target,
    ** number of variables DOES NOT imply that the elements are 
    ** in the same order! (Had funny effects with the EM-algorithm :) 
    **/
-  for(i = 0; i < target->size_of_data; i++){
-    nip_inverse_mapping(target, i, target->temp_index);
-    nip_choose_potential_indices(target->temp_index, 
-				 probs->temp_index, 
-				 mapping, 
-				 probs->dimensionality);    
-
-    potvalue = nip_get_potential_pointer(probs, probs->temp_index);
-    target->data[i] *= *potvalue;  /* THE multiplication */
-  }
-  
-  return 0;
+  stride = target->temp_stride;
+  nip_mapping_strides(target, probs->cardinality, mapping, 
+		      probs->dimensionality, stride);
+  return nip_strided_update(probs, NULL, target, stride);
 }
 
 
@@ -32,6 +32,7 @@
 #include <math.h> // HUGE_VAL
 #include <stdio.h> // FILE
 #include "niplists.h" // nip_string_pair_list
+#include "nipthreads.h" // nip_thread_pool
 
 #ifndef HUGE_DOUBLE
 #ifndef HUGE_VAL
@@ -42,6 +43,12 @@
 
 #define NIP_DIMENSIONALITY(p) ((p)->dimensionality) ///< get number of dims
 
+/** Potentials smaller than this are processed by a single thread */
+#define NIP_PARALLEL_KERNEL_SIZE 1000000
+
+/** Alignment of the tables in an arena: a cache line, in bytes */
+#define NIP_ARENA_ALIGNMENT 64
+
 /**
  * Structure for storing multidimensional tables of probabilities
  */
@@ -49,13 +56,25 @@ typedef struct nip_pot_array {
   int dimensionality; ///< number of dimensions
   int* cardinality; ///< dimensions of the data
   int* temp_index; ///< space for index calculations
+  int* temp_stride; ///< space for stride calculations
   int size_of_data; ///< total number of data elements, prod(cardinality)
   double* data; ///< data array: the probability of each combination
-  nip_string_pair_list application_specific_properties; ///< external data
+  int in_arena; ///< 1 if data is a part of an arena, not freed with this
+  nip_string_pair_list application_specific_properties; ///< external data, or NULL if none
 } nip_potential_struct;
 
 typedef nip_potential_struct* nip_potential; ///< potential reference
 
+/**
+ * One block of memory for the tables of many potentials
+ */
+typedef struct {
+  double* data; ///< the tables, each aligned to NIP_ARENA_ALIGNMENT
+  int size; ///< number of elements in data, including the padding
+} nip_potential_arena_struct;
+
+typedef nip_potential_arena_struct* nip_potential_arena; ///< arena reference
+
 /**
  * Make a potential array of certain dimensionality. 
  * The potential array \p data can be null, if it is not known, and then 
@@ -106,6 +125,23 @@ int nip_retract_potential(nip_potential p, nip_potential ref);
  * Free the memory used by potential \p p. */
 void nip_free_potential(nip_potential p);
 
+/**
+ * Moves the tables of potentials into one contiguous block of memory 
+ * in the given order, each table aligned to a cache line. The data of 
+ * the potentials stays the same, but e.g. all of it can then be saved 
+ * or restored with one memcpy(). 
+ * @param p Array of potentials, none of which is in an arena yet
+ * @param n Size of the array \p p
+ * @return a reference to the new arena, or NULL if out of memory
+ * @see nip_free_potential_arena() */
+nip_potential_arena nip_new_potential_arena(nip_potential p[], int n);
+
+/**
+ * Frees an arena, either before or after the potentials in it are 
+ * freed. Its potentials must not be used after this.
+ * @param a The arena to free */
+void nip_free_potential_arena(nip_potential_arena a);
+
 /**
  * Sets all the elements to the specified value (usually 0 or 1)
  * @param p The potential to modify
@@ -162,6 +198,52 @@ void nip_inverse_mapping(nip_potential p, int flat_index, int indices[]);
 int nip_general_marginalise(nip_potential source, nip_potential destination, 
 			    int mapping[]);
 
+/**
+ * Computes how far a step along each dimension of the potential \p p 
+ * moves in the flat data of a lesser-dimensional potential with the 
+ * given \p cardinality (e.g. a marginal of \p p). Dimensions of \p p 
+ * not mapped get zero stride. The result can be computed once and 
+ * reused with nip_strided_marginalise() and nip_strided_update().
+ * EXAMPLE: if cardinality = {3, 4} and mapping = {2, 0}, then 
+ *          a five-dimensional \p p gets strides {3, 0, 1, 0, 0}.
+ * @param p The higher-dimensional potential
+ * @param cardinality Size of each dimension of the lesser potential
+ * @param mapping Placement of the lesser dimensions in \p p
+ * @param size_of_mapping Dimensionality of the lesser potential
+ * @param stride Array of p->dimensionality where the strides are written
+ */
+void nip_mapping_strides(nip_potential p, int cardinality[], 
+			 int mapping[], int size_of_mapping, int stride[]);
+
+/**
+ * Same as nip_general_marginalise(), but with strides precomputed 
+ * by nip_mapping_strides() instead of the mapping.
+ * @param source The potential to be marginalised
+ * @param destination The potential to put the answer into
+ * @param stride Strides of \p source dimensions in \p destination
+ * @return an error code, or 0 on success
+ */
+int nip_strided_marginalise(nip_potential source, nip_potential destination, 
+			    int stride[]);
+
+/**
+ * Same as nip_strided_marginalise(), but splits \p source among the 
+ * threads of \p pool along the values of the highest dimensions kept 
+ * in \p destination (wherever they are), so that each thread sums into 
+ * elements of its own. Each element gets the same sum in the same 
+ * order as in the serial version, so the results are exactly the same. 
+ * Falls back to nip_strided_marginalise() without a pool, if \p source 
+ * has less than NIP_PARALLEL_KERNEL_SIZE elements, or if there is 
+ * nothing to split (\p destination has a single element).
+ * @param pool Worker threads, or NULL
+ * @param source The potential to be marginalised
+ * @param destination The potential to put the answer into
+ * @param stride Strides of \p source dimensions in \p destination
+ * @return an error code, or 0 on success
+ */
+int nip_parallel_marginalise(nip_thread_pool pool, nip_potential source, 
+			     nip_potential destination, int stride[]);
+
 /**
  * Method for finding out the probability distribution of a single variable 
  * according to a clique potential. This one is a marginalisation too, but 
@@ -175,6 +257,44 @@ int nip_general_marginalise(nip_potential source, nip_potential destination,
 int nip_total_marginalise(nip_potential source, double destination[], 
 			  int variable);
 
+/**
+ * Same as nip_total_marginalise() for several variables at once, 
+ * in a single sweep over \p source. The results are exactly the same.
+ * @param source The potential to be marginalised
+ * @param destination Array of \p n arrays for the answers, each of the 
+ *   size of the corresponding variable
+ * @param variable Array of \p n 0-based indices of the variables
+ * @param n Number of variables
+ * @return an error code, or 0 on success
+ */
+int nip_fused_total_marginalise(nip_potential source, double* destination[], 
+				int variable[], int n);
+
+/**
+ * Same as nip_fused_total_marginalise(), but a \p source of at least 
+ * NIP_PARALLEL_KERNEL_SIZE elements is split among the threads of 
+ * \p pool for each variable in turn, along the values of the variable 
+ * as in nip_parallel_marginalise(). The results are exactly the same.
+ * @param pool Worker threads, or NULL
+ * @param source The potential to be marginalised
+ * @param destination Array of \p n arrays for the answers, each of the 
+ *   size of the corresponding variable
+ * @param variable Array of \p n 0-based indices of the variables
+ * @param n Number of variables
+ * @return an error code, or 0 on success
+ */
+int nip_parallel_total_marginalise(nip_thread_pool pool, 
+				   nip_potential source, 
+				   double* destination[], int variable[], 
+				   int n);
+
+/**
+ * Computes the sum of all the elements, i.e. the probability mass.
+ * @param p The potential to sum
+ * @return Sum of the elements of \p p
+ */
+double nip_potential_mass(nip_potential p);
+
 /**
  * Normalises an array. Divides every member by their sum.
  * The function modifies the given array.
@@ -241,6 +361,120 @@ int nip_sum_potential(nip_potential sum, nip_potential increment);
 int nip_update_potential(nip_potential numerator, nip_potential denominator, 
 			 nip_potential target, int mapping[]);
 
+/**
+ * Same as nip_update_potential(), but with strides precomputed 
+ * by nip_mapping_strides() instead of the mapping.
+ * @param numerator Multiplier, or NULL
+ * @param denominator Divider, or NULL
+ * @param target The potential whose values are updated
+ * @param stride Strides of \p target dimensions in \p numerator 
+ *   (and \p denominator)
+ * @return an error code, or 0 on success */
+int nip_strided_update(nip_potential numerator, nip_potential denominator, 
+		       nip_potential target, int stride[]);
+
+/**
+ * Same as nip_strided_update(), but splits \p target into chunks 
+ * processed by the threads of \p pool. Each element is computed as 
+ * in the serial version, so the results are exactly the same. 
+ * Falls back to nip_strided_update() without a pool or if \p target 
+ * has less than NIP_PARALLEL_KERNEL_SIZE elements.
+ * @param pool Worker threads, or NULL
+ * @param numerator Multiplier, or NULL
+ * @param denominator Divider, or NULL
+ * @param target The potential whose values are updated
+ * @param stride Strides of \p target dimensions in \p numerator 
+ *   (and \p denominator)
+ * @return an error code, or 0 on success */
+int nip_parallel_update(nip_thread_pool pool, nip_potential numerator, 
+			nip_potential denominator, nip_potential target, 
+			int stride[]);
+
+/**
+ * Same as nip_strided_marginalise(), but only over a slice of 
+ * \p source: the dimensions with slice[i] >= 0 are fixed to that index, 
+ * so the rest of \p source is skipped as if it were all zeros. 
+ * When it is, the result is exactly the same as from the whole.
+ * @param source The potential to be marginalised
+ * @param destination The potential to put the answer into
+ * @param stride Strides of \p source dimensions in \p destination
+ * @param slice For each dimension of \p source, a fixed index or -1
+ * @return an error code, or 0 on success */
+int nip_sliced_marginalise(nip_potential source, nip_potential destination, 
+			   int stride[], int slice[]);
+
+/**
+ * Marginalises \p source into several potentials in one sweep: the 
+ * same as nip_strided_marginalise() for each of them in turn, but 
+ * without traversing \p source again for each. Gives exactly the same 
+ * results. Useful for a clique sending messages to many sepsets.
+ * @param source The potential to be marginalised
+ * @param destination Array of \p n potentials to put the answers into
+ * @param stride Array of \p n stride arrays, one for each destination
+ * @param n Number of destination potentials
+ * @return an error code, or 0 on success */
+int nip_fused_marginalise(nip_potential source, nip_potential destination[], 
+			  int* stride[], int n);
+
+/**
+ * Same as nip_sliced_marginalise() for each of the \p n destinations 
+ * in turn, but in one sweep over the slice of \p source, as in 
+ * nip_fused_marginalise(). Gives exactly the same results.
+ * @param source The potential to be marginalised
+ * @param destination Array of \p n potentials to put the answers into
+ * @param stride Array of \p n stride arrays, one for each destination
+ * @param n Number of destination potentials
+ * @param slice For each dimension of \p source, a fixed index or -1
+ * @return an error code, or 0 on success */
+int nip_fused_sliced_marginalise(nip_potential source, 
+				 nip_potential destination[], 
+				 int* stride[], int n, int slice[]);
+
+/**
+ * Same as nip_strided_update(), but only for a slice of \p target: 
+ * the dimensions with slice[i] >= 0 are fixed to that index. 
+ * The rest of \p target is left as it is, which is exactly the same 
+ * result when it is all zeros.
+ * @param numerator Multiplier, or NULL
+ * @param denominator Divider, or NULL
+ * @param target The potential whose values are updated
+ * @param stride Strides of \p target dimensions in \p numerator 
+ *   (and \p denominator)
+ * @param slice For each dimension of \p target, a fixed index or -1
+ * @return an error code, or 0 on success */
+int nip_sliced_update(nip_potential numerator, nip_potential denominator, 
+		      nip_potential target, int stride[], int slice[]);
+
+/**
+ * Updates \p target with several potentials in one sweep: the same as 
+ * nip_strided_update() for each numerator / denominator pair in turn, 
+ * but without traversing \p target again for each. Gives exactly the 
+ * same results. Useful for a clique absorbing messages from many sepsets.
+ * @param numerator Array of \p n multipliers (each can be NULL)
+ * @param denominator Array of \p n dividers (each can be NULL)
+ * @param target The potential whose values are updated
+ * @param stride Array of \p n stride arrays, one for each pair
+ * @param n Number of numerator / denominator pairs
+ * @return an error code, or 0 on success */
+int nip_fused_update(nip_potential numerator[], nip_potential denominator[], 
+		     nip_potential target, int* stride[], int n);
+
+/**
+ * Same as nip_sliced_update() for each numerator / denominator pair in 
+ * turn, but in one sweep over the slice of \p target, as in 
+ * nip_fused_update(). Gives exactly the same results.
+ * @param numerator Array of \p n multipliers (each can be NULL)
+ * @param denominator Array of \p n dividers (each can be NULL)
+ * @param target The potential whose values are updated
+ * @param stride Array of \p n stride arrays, one for each pair
+ * @param n Number of numerator / denominator pairs
+ * @param slice For each dimension of \p target, a fixed index or -1
+ * @return an error code, or 0 on success */
+int nip_fused_sliced_update(nip_potential numerator[], 
+			    nip_potential denominator[], 
+			    nip_potential target, int* stride[], int n, 
+			    int slice[]);
+
 /**
  * Method for updating potential according to new evidence.
  * Precondition: numerator[i] > 0 => denominator[i] > 0, for all i
@@ -255,6 +489,33 @@ int nip_update_potential(nip_potential numerator, nip_potential denominator,
 int nip_update_evidence(double numerator[], double denominator[], 
 			nip_potential target, int var);
 
+/**
+ * Same as nip_update_evidence() with hard evidence, i.e. a numerator 
+ * with 1 at \p index and 0 elsewhere: zeroes the other slices of 
+ * \p target along dimension \p var without any multiplications, and 
+ * divides the slice at \p index by \p denominator unless it is 1 or 0.
+ * @param target The potential to be updated
+ * @param var The 0-based index of the dimension that gets new evidence
+ * @param index The observed value (state index) of the variable
+ * @param denominator Old likelihood of the observed value
+ * @return an error code, or 0 on success
+ */
+int nip_update_hard_evidence(nip_potential target, int var, int index, 
+			     double denominator);
+
+/**
+ * Same as calling nip_update_hard_evidence() for each of the \p n 
+ * observations in turn, but in one sweep over \p target.
+ * @param target The potential to be updated
+ * @param var The 0-based indices of the observed dimensions
+ * @param index The observed values (state indices)
+ * @param denominator Old likelihoods of the observed values
+ * @param n Number of observations
+ * @return an error code, or 0 on success
+ */
+int nip_update_hard_evidences(nip_potential target, int var[], int index[], 
+			      double denominator[], int n);
+
 /**
  * This one implements the initialisation with observations. 
  * See [Huang & Darwiche 1994] the Procedural Guide page 25, step 2.
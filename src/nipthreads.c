@@ -0,0 +1,182 @@
+/**
+ * @file
+ * @brief A small pool of worker threads for running independent tasks
+ * (e.g. message passes in separate branches of a join tree) in parallel.
+ *
+ * @author Janne Toivola
+ * @copyright &copy; 2007,2012 Janne Toivola <br>
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version. <br>
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. <br>
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nipthreads.h"
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "niperrorhandler.h"
+
+/* Takes and runs tasks until there are none left.
+ * Called (and returns) with the lock held. */
+static void nip_run_tasks(nip_thread_pool pool);
+
+/* The main loop of a worker thread */
+static void* nip_worker(void* arg);
+
+
+nip_thread_pool nip_new_thread_pool(int num_of_threads){
+  int i;
+  nip_thread_pool pool;
+
+  if(num_of_threads < 1){
+    nip_report_error(__FILE__, __LINE__, EINVAL, 1);
+    return NULL;
+  }
+
+  pool = (nip_thread_pool) malloc(sizeof(nip_thread_pool_struct));
+  if(!pool){
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    return NULL;
+  }
+  pool->num_of_threads = 1; /* until the workers are running */
+  pool->task = NULL;
+  pool->data = NULL;
+  pool->num_of_tasks = 0;
+  pool->next_task = 0;
+  pool->tasks_done = 0;
+  pool->error = 0;
+  pool->quit = 0;
+  pool->workers = (pthread_t*) calloc(num_of_threads, sizeof(pthread_t));
+  if(!pool->workers){
+    free(pool);
+    nip_report_error(__FILE__, __LINE__, ENOMEM, 1);
+    return NULL;
+  }
+  pthread_mutex_init(&(pool->lock), NULL);
+  pthread_cond_init(&(pool->work_available), NULL);
+  pthread_cond_init(&(pool->work_done), NULL);
+
+  for(i = 0; i < num_of_threads - 1; i++){
+    if(pthread_create(&(pool->workers[i]), NULL, nip_worker, pool) != 0){
+      nip_free_thread_pool(pool);
+      nip_report_error(__FILE__, __LINE__, EAGAIN, 1);
+      return NULL;
+    }
+    pool->num_of_threads++;
+  }
+  return pool;
+}
+
+
+void nip_free_thread_pool(nip_thread_pool pool){
+  int i;
+  if(!pool)
+    return;
+
+  pthread_mutex_lock(&(pool->lock));
+  pool->quit = 1;
+  pthread_cond_broadcast(&(pool->work_available));
+  pthread_mutex_unlock(&(pool->lock));
+  for(i = 0; i < pool->num_of_threads - 1; i++)
+    pthread_join(pool->workers[i], NULL);
+
+  pthread_cond_destroy(&(pool->work_done));
+  pthread_cond_destroy(&(pool->work_available));
+  pthread_mutex_destroy(&(pool->lock));
+  free(pool->workers);
+  free(pool);
+  return;
+}
+
+
+int nip_parallel_for(nip_thread_pool pool, nip_task task, void* data, int n){
+  int i, err;
+
+  if(pool == NULL || pool->num_of_threads < 2 || n < 2){
+    /* nothing to share */
+    for(i = 0; i < n; i++){
+      err = task(data, i);
+      if(err != 0)
+	return err;
+    }
+    return 0;
+  }
+
+  pthread_mutex_lock(&(pool->lock));
+  pool->task = task;
+  pool->data = data;
+  pool->num_of_tasks = n;
+  pool->next_task = 0;
+  pool->tasks_done = 0;
+  pool->error = 0;
+  pthread_cond_broadcast(&(pool->work_available));
+
+  /* work together with the others... */
+  nip_run_tasks(pool);
+
+  /* ...and wait until the last one is done */
+  while(pool->tasks_done < pool->num_of_tasks)
+    pthread_cond_wait(&(pool->work_done), &(pool->lock));
+  err = pool->error;
+  pool->num_of_tasks = 0;
+  pool->next_task = 0;
+  pthread_mutex_unlock(&(pool->lock));
+  return err;
+}
+
+
+int nip_requested_threads(){
+  char* value = getenv(NIP_THREADS_ENV);
+  int n;
+  if(value == NULL)
+    return 1;
+  n = atoi(value);
+  return (n > 1 ? n : 1);
+}
+
+
+static void nip_run_tasks(nip_thread_pool pool){
+  int i, err;
+  nip_task task;
+  void* data;
+
+  while(pool->next_task < pool->num_of_tasks){
+    i = pool->next_task++;
+    task = pool->task;
+    data = pool->data;
+    pthread_mutex_unlock(&(pool->lock));
+
+    err = task(data, i);
+
+    pthread_mutex_lock(&(pool->lock));
+    if(err != 0 && pool->error == 0)
+      pool->error = err;
+    pool->tasks_done++;
+    if(pool->tasks_done == pool->num_of_tasks)
+      pthread_cond_broadcast(&(pool->work_done));
+  }
+  return;
+}
+
+
+static void* nip_worker(void* arg){
+  nip_thread_pool pool = (nip_thread_pool) arg;
+
+  pthread_mutex_lock(&(pool->lock));
+  while(!pool->quit){
+    if(pool->next_task < pool->num_of_tasks)
+      nip_run_tasks(pool);
+    else
+      pthread_cond_wait(&(pool->work_available), &(pool->lock));
+  }
+  pthread_mutex_unlock(&(pool->lock));
+  return NULL;
+}
@@ -0,0 +1,82 @@
+/**
+ * @file
+ * @brief A small pool of worker threads for running independent tasks
+ * (e.g. message passes in separate branches of a join tree) in parallel.
+ *
+ * @author Janne Toivola
+ * @copyright &copy; 2007,2012 Janne Toivola <br>
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version. <br>
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. <br>
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __NIPTHREADS_H__
+#define __NIPTHREADS_H__
+
+#include <pthread.h>
+
+#define NIP_THREADS_ENV "NIP_NUM_THREADS" ///< environment variable
+
+/**
+ * A task is called with the shared data and the index of the task,
+ * and returns an error code or 0 */
+typedef int (*nip_task)(void* data, int i);
+
+/**
+ * Structure for a pool of worker threads. The thread calling
+ * nip_parallel_for() takes part in the work too.
+ */
+typedef struct {
+  int num_of_threads; ///< number of threads, including the caller
+  pthread_t* workers; ///< the num_of_threads-1 other threads
+  pthread_mutex_t lock; ///< protects everything below
+  pthread_cond_t work_available; ///< signaled when tasks are given
+  pthread_cond_t work_done; ///< signaled when the last task is done
+  nip_task task; ///< the current kind of task
+  void* data; ///< shared data for the current tasks
+  int num_of_tasks; ///< number of the current tasks
+  int next_task; ///< index of the next task to take
+  int tasks_done; ///< number of finished tasks
+  int error; ///< the first error code returned by a task
+  int quit; ///< 1 if the workers should exit
+} nip_thread_pool_struct;
+typedef nip_thread_pool_struct* nip_thread_pool; ///< thread pool reference
+
+/**
+ * Creates a pool of \p num_of_threads threads (including the caller).
+ * @param num_of_threads Number of threads working in parallel
+ * @return reference to a new pool, or NULL if failed
+ * @see nip_free_thread_pool() */
+nip_thread_pool nip_new_thread_pool(int num_of_threads);
+
+/**
+ * Stops the worker threads and frees the memory.
+ * @param pool The pool to be freed, or NULL */
+void nip_free_thread_pool(nip_thread_pool pool);
+
+/**
+ * Runs tasks 0..n-1 so that the threads of the pool take the next
+ * task whenever they are free, and returns when all of them are done.
+ * The order of the tasks is undefined, so they must be independent.
+ * With a NULL pool, the tasks are simply run in order by the caller.
+ * @param pool The worker threads, or NULL
+ * @param task The function doing task i
+ * @param data The data shared by all the tasks
+ * @param n Number of tasks
+ * @return the first error code returned by a task, or 0 */
+int nip_parallel_for(nip_thread_pool pool, nip_task task, void* data, int n);
+
+/**
+ * Number of threads requested in the environment variable
+ * NIP_NUM_THREADS, or 1 if not set.
+ * @return Requested number of threads (at least 1) */
+int nip_requested_threads();
+
+#endif /* __NIPTHREADS_H__ */
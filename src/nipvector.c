@@ -0,0 +1,349 @@
+/**
+ * @file
+ * @brief Vectorised inner loops of the potential kernels, for the cases
+ * where the elements involved are contiguous in memory
+ *
+ * @author Janne Toivola
+ * @copyright &copy; 2007,2012 Janne Toivola <br>
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version. <br>
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. <br>
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nipvector.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "niperrorhandler.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NIP_VECTOR_X86 ///< SSE2 & AVX2 versions can be compiled
+#include <immintrin.h>
+#endif
+
+static void nip_add_scalar(double* dst, double* src, int n);
+static void nip_run_sums_scalar(double* dst, double* src, int n, int run);
+static void nip_update_scalar(double* dst, double* num, double* den, int n);
+static void nip_scale_scalar(double* dst, double* num, double* den, int n);
+
+static const nip_vector_kernels nip_scalar_kernels = {
+  nip_add_scalar, nip_run_sums_scalar, nip_update_scalar, nip_scale_scalar
+};
+
+#ifdef NIP_VECTOR_X86
+static void nip_add_sse2(double* dst, double* src, int n);
+static void nip_run_sums_sse2(double* dst, double* src, int n, int run);
+static void nip_update_sse2(double* dst, double* num, double* den, int n);
+static void nip_scale_sse2(double* dst, double* num, double* den, int n);
+
+static const nip_vector_kernels nip_sse2_kernels = {
+  nip_add_sse2, nip_run_sums_sse2, nip_update_sse2, nip_scale_sse2
+};
+
+static void nip_add_avx2(double* dst, double* src, int n);
+static void nip_run_sums_avx2(double* dst, double* src, int n, int run);
+static void nip_update_avx2(double* dst, double* num, double* den, int n);
+static void nip_scale_avx2(double* dst, double* num, double* den, int n);
+
+static const nip_vector_kernels nip_avx2_kernels = {
+  nip_add_avx2, nip_run_sums_avx2, nip_update_avx2, nip_scale_avx2
+};
+#endif
+
+/* The kernels in use, chosen once according to the CPU */
+static const nip_vector_kernels* nip_kernels = NULL;
+static nip_vector_isa nip_isa = NIP_VECTOR_SCALAR;
+static pthread_once_t nip_vector_once = PTHREAD_ONCE_INIT;
+
+static void nip_vector_init();
+
+
+nip_vector_isa nip_vector_best_isa(){
+#ifdef NIP_VECTOR_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    return NIP_VECTOR_AVX2;
+  if(__builtin_cpu_supports("sse2"))
+    return NIP_VECTOR_SSE2;
+#endif
+  return NIP_VECTOR_SCALAR;
+}
+
+
+nip_vector_isa nip_vector_get_isa(){
+  pthread_once(&nip_vector_once, nip_vector_init);
+  return nip_isa;
+}
+
+
+int nip_vector_set_isa(nip_vector_isa isa){
+  pthread_once(&nip_vector_once, nip_vector_init);
+  if(isa > nip_vector_best_isa())
+    return nip_report_error(__FILE__, __LINE__, EINVAL, 1);
+  switch(isa){
+#ifdef NIP_VECTOR_X86
+  case NIP_VECTOR_AVX2: nip_kernels = &nip_avx2_kernels; break;
+  case NIP_VECTOR_SSE2: nip_kernels = &nip_sse2_kernels; break;
+#endif
+  default: nip_kernels = &nip_scalar_kernels; isa = NIP_VECTOR_SCALAR;
+  }
+  nip_isa = isa;
+  return 0;
+}
+
+
+const nip_vector_kernels* nip_vector_get_kernels(){
+  pthread_once(&nip_vector_once, nip_vector_init);
+  return nip_kernels;
+}
+
+
+const char* nip_vector_isa_name(nip_vector_isa isa){
+  switch(isa){
+  case NIP_VECTOR_AVX2: return "avx2";
+  case NIP_VECTOR_SSE2: return "sse2";
+  default: return "scalar";
+  }
+}
+
+
+static void nip_vector_init(){
+  nip_kernels = &nip_scalar_kernels;
+  nip_isa = NIP_VECTOR_SCALAR;
+#ifdef NIP_VECTOR_X86
+  nip_isa = nip_vector_best_isa();
+  if(nip_isa == NIP_VECTOR_AVX2)
+    nip_kernels = &nip_avx2_kernels;
+  else if(nip_isa == NIP_VECTOR_SSE2)
+    nip_kernels = &nip_sse2_kernels;
+#endif
+  return;
+}
+
+
+void nip_vector_add(double dst[], double src[], int n){
+  pthread_once(&nip_vector_once, nip_vector_init);
+  nip_kernels->add(dst, src, n);
+}
+
+
+void nip_vector_run_sums(double dst[], double src[], int n, int run){
+  pthread_once(&nip_vector_once, nip_vector_init);
+  nip_kernels->run_sums(dst, src, n, run);
+}
+
+
+void nip_vector_update(double dst[], double num[], double den[], int n){
+  pthread_once(&nip_vector_once, nip_vector_init);
+  nip_kernels->update(dst, num, den, n);
+}
+
+
+void nip_vector_scale(double dst[], double* num, double* den, int n){
+  pthread_once(&nip_vector_once, nip_vector_init);
+  nip_kernels->scale(dst, num, den, n);
+}
+
+
+/* The scalar versions: also the reference for the others */
+
+static void nip_add_scalar(double* dst, double* src, int n){
+  int i;
+  for(i = 0; i < n; i++)
+    dst[i] += src[i];
+}
+
+
+static void nip_run_sums_scalar(double* dst, double* src, int n, int run){
+  int i, k;
+  double sum;
+  for(i = 0; i < n; i++){
+    sum = dst[i];
+    for(k = 0; k < run; k++)
+      sum += src[k];
+    dst[i] = sum;
+    src += run;
+  }
+}
+
+
+static void nip_update_scalar(double* dst, double* num, double* den, int n){
+  int i;
+  for(i = 0; i < n; i++){
+    if(num)
+      dst[i] *= num[i];
+    if(den){
+      if(den[i] != 0)
+	dst[i] /= den[i];
+      else
+	dst[i] = 0; /* see Procedural Guide p. 20 */
+    }
+  }
+}
+
+
+static void nip_scale_scalar(double* dst, double* num, double* den, int n){
+  int i;
+  if(den && *den == 0){
+    for(i = 0; i < n; i++)
+      dst[i] = 0;
+    return;
+  }
+  for(i = 0; i < n; i++){
+    if(num)
+      dst[i] *= *num;
+    if(den)
+      dst[i] /= *den;
+  }
+}
+
+
+#ifdef NIP_VECTOR_X86
+
+/* SSE2: two doubles at a time */
+
+static void nip_add_sse2(double* dst, double* src, int n){
+  int i;
+  for(i = 0; i + 2 <= n; i += 2)
+    _mm_storeu_pd(dst + i, _mm_add_pd(_mm_loadu_pd(dst + i),
+				      _mm_loadu_pd(src + i)));
+  nip_add_scalar(dst + i, src + i, n - i);
+}
+
+
+static void nip_run_sums_sse2(double* dst, double* src, int n, int run){
+  int i, k;
+  __m128d sum;
+  /* two independent sums at a time, each in the original order */
+  for(i = 0; i + 2 <= n; i += 2){
+    sum = _mm_loadu_pd(dst + i);
+    for(k = 0; k < run; k++)
+      sum = _mm_add_pd(sum, _mm_set_pd(src[(i + 1) * run + k],
+				       src[i * run + k]));
+    _mm_storeu_pd(dst + i, sum);
+  }
+  nip_run_sums_scalar(dst + i, src + i * run, n - i, run);
+}
+
+
+static void nip_update_sse2(double* dst, double* num, double* den, int n){
+  int i;
+  __m128d x, d;
+  __m128d zero = _mm_setzero_pd();
+  for(i = 0; i + 2 <= n; i += 2){
+    x = _mm_loadu_pd(dst + i);
+    if(num)
+      x = _mm_mul_pd(x, _mm_loadu_pd(num + i));
+    if(den){
+      d = _mm_loadu_pd(den + i);
+      x = _mm_and_pd(_mm_div_pd(x, d), _mm_cmpneq_pd(d, zero));
+    }
+    _mm_storeu_pd(dst + i, x);
+  }
+  nip_update_scalar(dst + i, (num ? num + i : NULL),
+		    (den ? den + i : NULL), n - i);
+}
+
+
+static void nip_scale_sse2(double* dst, double* num, double* den, int n){
+  int i;
+  __m128d x;
+  if(den && *den == 0){
+    nip_scale_scalar(dst, num, den, n);
+    return;
+  }
+  for(i = 0; i + 2 <= n; i += 2){
+    x = _mm_loadu_pd(dst + i);
+    if(num)
+      x = _mm_mul_pd(x, _mm_set1_pd(*num));
+    if(den)
+      x = _mm_div_pd(x, _mm_set1_pd(*den));
+    _mm_storeu_pd(dst + i, x);
+  }
+  nip_scale_scalar(dst + i, num, den, n - i);
+}
+
+
+/* AVX2: four doubles at a time */
+
+__attribute__((target("avx2")))
+static void nip_add_avx2(double* dst, double* src, int n){
+  int i;
+  for(i = 0; i + 4 <= n; i += 4)
+    _mm256_storeu_pd(dst + i, _mm256_add_pd(_mm256_loadu_pd(dst + i),
+					    _mm256_loadu_pd(src + i)));
+  _mm256_zeroupper(); /* no penalty in the (SSE) scalar code */
+  nip_add_scalar(dst + i, src + i, n - i);
+}
+
+
+__attribute__((target("avx2")))
+static void nip_run_sums_avx2(double* dst, double* src, int n, int run){
+  int i, k;
+  __m256d sum;
+  __m128i index = _mm_set_epi32(3 * run, 2 * run, run, 0);
+  /* four independent sums at a time, each in the original order */
+  for(i = 0; i + 4 <= n; i += 4){
+    sum = _mm256_loadu_pd(dst + i);
+    for(k = 0; k < run; k++)
+      sum = _mm256_add_pd(sum, _mm256_i32gather_pd(src + i * run + k,
+						   index, 8));
+    _mm256_storeu_pd(dst + i, sum);
+  }
+  _mm256_zeroupper();
+  nip_run_sums_scalar(dst + i, src + i * run, n - i, run);
+}
+
+
+__attribute__((target("avx2")))
+static void nip_update_avx2(double* dst, double* num, double* den, int n){
+  int i;
+  __m256d x, d;
+  __m256d zero = _mm256_setzero_pd();
+  for(i = 0; i + 4 <= n; i += 4){
+    x = _mm256_loadu_pd(dst + i);
+    if(num)
+      x = _mm256_mul_pd(x, _mm256_loadu_pd(num + i));
+    if(den){
+      d = _mm256_loadu_pd(den + i);
+      x = _mm256_and_pd(_mm256_div_pd(x, d),
+			_mm256_cmp_pd(d, zero, _CMP_NEQ_UQ));
+    }
+    _mm256_storeu_pd(dst + i, x);
+  }
+  _mm256_zeroupper();
+  nip_update_scalar(dst + i, (num ? num + i : NULL),
+		    (den ? den + i : NULL), n - i);
+}
+
+
+__attribute__((target("avx2")))
+static void nip_scale_avx2(double* dst, double* num, double* den, int n){
+  int i;
+  __m256d x;
+  if(den && *den == 0){
+    nip_scale_scalar(dst, num, den, n);
+    return;
+  }
+  for(i = 0; i + 4 <= n; i += 4){
+    x = _mm256_loadu_pd(dst + i);
+    if(num)
+      x = _mm256_mul_pd(x, _mm256_set1_pd(*num));
+    if(den)
+      x = _mm256_div_pd(x, _mm256_set1_pd(*den));
+    _mm256_storeu_pd(dst + i, x);
+  }
+  _mm256_zeroupper();
+  nip_scale_scalar(dst + i, num, den, n - i);
+}
+
+#endif /* NIP_VECTOR_X86 */
@@ -0,0 +1,106 @@
+/**
+ * @file
+ * @brief Vectorised inner loops of the potential kernels, for the cases
+ * where the elements involved are contiguous in memory
+ *
+ * The instruction set is chosen at run time according to the CPU,
+ * and every version computes each element with exactly the same
+ * operations in the same order, so the results do not depend on it.
+ *
+ * @author Janne Toivola
+ * @copyright &copy; 2007,2012 Janne Toivola <br>
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version. <br>
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. <br>
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __NIPVECTOR_H__
+#define __NIPVECTOR_H__
+
+/**
+ * Instruction sets for the vector kernels
+ */
+enum nip_vector_isa_type {NIP_VECTOR_SCALAR, NIP_VECTOR_SSE2, NIP_VECTOR_AVX2};
+typedef enum nip_vector_isa_type nip_vector_isa; ///< hide enum notation
+
+/**
+ * One version of each kernel, for calling them in a loop without 
+ * finding out the instruction set again for each call
+ */
+typedef struct {
+  void (*add)(double* dst, double* src, int n); ///< nip_vector_add()
+  void (*run_sums)(double* dst, double* src, int n, int run); ///< nip_vector_run_sums()
+  void (*update)(double* dst, double* num, double* den, int n); ///< nip_vector_update()
+  void (*scale)(double* dst, double* num, double* den, int n); ///< nip_vector_scale()
+} nip_vector_kernels;
+
+/**
+ * Finds out the best instruction set supported by the CPU.
+ * @return The instruction set used by default */
+nip_vector_isa nip_vector_best_isa();
+
+/**
+ * Tells which instruction set the kernels use currently.
+ * @return The instruction set in use */
+nip_vector_isa nip_vector_get_isa();
+
+/**
+ * Changes the instruction set of the kernels, e.g. for benchmarking.
+ * @param isa The instruction set to use
+ * @return an error code if the CPU does not support \p isa, or 0 */
+int nip_vector_set_isa(nip_vector_isa isa);
+
+/**
+ * The kernels in use, for the loops calling them block by block: 
+ * fetch them once before the loop.
+ * @return The kernels of the current instruction set */
+const nip_vector_kernels* nip_vector_get_kernels();
+
+/**
+ * Name of an instruction set, e.g. for printing.
+ * @param isa The instruction set
+ * @return A constant string */
+const char* nip_vector_isa_name(nip_vector_isa isa);
+
+/**
+ * Adds element by element: dst[i] += src[i]
+ * @param dst Array of \p n elements to add into
+ * @param src Array of \p n elements to add
+ * @param n Number of elements */
+void nip_vector_add(double dst[], double src[], int n);
+
+/**
+ * Adds up consecutive runs of elements: dst[i] += src[i*run + k]
+ * for k = 0..run-1 in this order.
+ * @param dst Array of \p n sums
+ * @param src Array of \p n * \p run elements
+ * @param n Number of sums
+ * @param run Number of elements in each sum */
+void nip_vector_run_sums(double dst[], double src[], int n, int run);
+
+/**
+ * Multiplies and divides element by element: dst[i] *= num[i], and
+ * dst[i] /= den[i] or dst[i] = 0 if den[i] == 0.
+ * @param dst Array of \p n elements to update
+ * @param num Array of \p n multipliers, or NULL
+ * @param den Array of \p n divisors, or NULL
+ * @param n Number of elements */
+void nip_vector_update(double dst[], double num[], double den[], int n);
+
+/**
+ * Like nip_vector_update(), but with the same multiplier and divisor
+ * for all the elements.
+ * @param dst Array of \p n elements to update
+ * @param num Reference to the multiplier, or NULL
+ * @param den Reference to the divisor, or NULL
+ * @param n Number of elements */
+void nip_vector_scale(double dst[], double* num, double* den, int n);
+
+#endif /* __NIPVECTOR_H__ */
@@ -22,12 +22,19 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
 #include "nipjointree.h"
 
 
 int main(){
   int i;
+  int failed = 0;
   double result[3]; /* note1 */
+  double result2[3];
+  double probE[] = {0.1, 0.9};
+  double probA[] = {0.3, 0.5, 0.2};
+  nip_thread_pool pool;
+  nip_schedule schedule;
 
   /* create the variables 
    * normally this information would be found in a file and parsed */
@@ -210,6 +217,150 @@ int main(){
   printf("Normalised probability of A:\n");
   for(i = 0; i < 3; i++) /* note1 */
     printf("result[%d] = %g\n", i, result[i]);
+
+  /* The same with a compiled schedule, and then incrementally 
+   * after new evidence in a leaf clique */
+  schedule = nip_new_schedule(clique_pile, 3, clique_pile[0]);
+  nip_collect_schedule(schedule);
+  nip_distribute_schedule(schedule);
+  nip_enter_evidence(variables, 5, clique_pile, 3, variables[4], probE);
+  printf("Dirty cliques: %d %d %d\n", clique_pile[0]->dirty, 
+	 clique_pile[1]->dirty, clique_pile[2]->dirty);
+  nip_collect_schedule(schedule);
+  nip_distribute_schedule(schedule);
+  nip_marginalise_clique(clique_pile[0], variables[0], result);
+  nip_normalise_array(result, 3);
+
+  /* ...should be the same as passing all the messages */
+  for(i = 0; i < 3; i++)
+    clique_pile[i]->dirty = 1;
+  nip_collect_schedule(schedule);
+  nip_distribute_schedule(schedule);
+  nip_marginalise_clique(clique_pile[0], variables[0], result2);
+  nip_normalise_array(result2, 3);
+  for(i = 0; i < 3; i++){
+    printf("incremental[%d] = %g, full[%d] = %g\n", 
+	   i, result[i], i, result2[i]);
+    if(fabs(result[i] - result2[i]) > 1e-12)
+      failed = 1;
+  }
+  printf("Incremental propagation: %s\n", (failed ? "FAILED" : "OK"));
+
+  /* Evidence at the root, collected only to the leaf clique DE */
+  nip_enter_evidence(variables, 5, clique_pile, 3, variables[0], probA);
+  nip_collect_schedule_to(schedule, clique_pile[2]);
+  nip_marginalise_clique(clique_pile[2], variables[4], result);
+  nip_normalise_array(result, 2);
+
+  /* ...should be the same as the full propagation */
+  nip_collect_schedule(schedule);
+  nip_distribute_schedule(schedule);
+  for(i = 0; i < 3; i++)
+    clique_pile[i]->dirty = 1;
+  nip_collect_schedule(schedule);
+  nip_distribute_schedule(schedule);
+  nip_marginalise_clique(clique_pile[2], variables[4], result2);
+  nip_normalise_array(result2, 2);
+  for(i = 0; i < 2; i++){
+    printf("partial[%d] = %g, full[%d] = %g\n", 
+	   i, result[i], i, result2[i]);
+    if(fabs(result[i] - result2[i]) > 1e-12)
+      failed = 1;
+  }
+  printf("Query-directed propagation: %s\n", (failed ? "FAILED" : "OK"));
+
+  /* ...and the same with worker threads */
+  pool = nip_new_thread_pool(2);
+  nip_schedule_threads(schedule, pool);
+  for(i = 0; i < 3; i++)
+    clique_pile[i]->dirty = 1;
+  nip_collect_schedule(schedule);
+  nip_distribute_schedule(schedule);
+  nip_marginalise_clique(clique_pile[2], variables[4], result);
+  nip_normalise_array(result, 2);
+  for(i = 0; i < 2; i++)
+    if(fabs(result[i] - result2[i]) > 1e-12)
+      failed = 1;
+  printf("Parallel propagation: %s\n", (failed ? "FAILED" : "OK"));
+  nip_schedule_threads(schedule, NULL);
+  nip_free_thread_pool(pool);
+
+  /* The sepset {B,C} should come first in clique ABC: same result? */
+  nip_marginalise_clique(clique_pile[0], variables[0], result2);
+  nip_normalise_array(result2, 3);
+  nip_order_clique_variables(clique_pile, 3);
+  if(!nip_equal_variables(clique_pile[0]->variables[0], variables[1]) ||
+     !nip_equal_variables(clique_pile[0]->variables[2], variables[0]))
+    failed = 1;
+  for(i = 0; i < 3; i++)
+    clique_pile[i]->dirty = 1;
+  nip_collect_schedule(schedule);
+  nip_distribute_schedule(schedule);
+  nip_marginalise_clique(clique_pile[0], variables[0], result);
+  nip_normalise_array(result, 3);
+  for(i = 0; i < 3; i++)
+    if(fabs(result[i] - result2[i]) > 1e-12)
+      failed = 1;
+  printf("Sepset-aware ordering: %s\n", (failed ? "FAILED" : "OK"));
+
+  /* Hard evidence about D: the rest of the tables is zeros, which 
+   * the other cliques with D should know after propagation */
+  nip_enter_index_observation(variables, 5, clique_pile, 3, variables[3], 1);
+  nip_collect_schedule(schedule);
+  nip_distribute_schedule(schedule);
+  for(i = 1; i < 3; i++){
+    if(clique_pile[i]->sliced != 1)
+      failed = 1;
+  }
+  nip_marginalise_clique(clique_pile[2], variables[3], result);
+  if(result[0] != 0 || result[1] == 0 || result[2] != 0)
+    failed = 1;
+  printf("Evidence slicing: %s\n", (failed ? "FAILED" : "OK"));
+
+  /* A batch with an invalid observation is not entered at all */
+  {
+    nip_variable observed[2];
+    int index[2] = {2, 5};
+    observed[0] = variables[3];
+    observed[1] = variables[4];
+    if(nip_enter_index_observations(variables, 5, clique_pile, 3, 
+				    observed, index, 2) == 0)
+      failed = 1;
+    if(variables[3]->likelihood[1] != 1 || variables[3]->likelihood[2] != 0)
+      failed = 1;
+  }
+  printf("Invalid evidence: %s\n", (failed ? "FAILED" : "OK"));
+
+  /* ...and then another state of D: a retraction */
+  nip_enter_index_observation(variables, 5, clique_pile, 3, variables[3], 2);
+  nip_collect_schedule(schedule);
+  nip_distribute_schedule(schedule);
+  nip_marginalise_clique(clique_pile[2], variables[3], result);
+  if(result[0] != 0 || result[1] != 0 || result[2] == 0)
+    failed = 1;
+  nip_marginalise_clique(clique_pile[0], variables[0], result);
+  nip_normalise_array(result, 3);
+
+  /* ...should be the same as entering the same evidence afresh */
+  for(i = 0; i < 5; i++)
+    nip_reset_likelihood(variables[i]);
+  nip_global_retraction(variables, 5, clique_pile, 3);
+  nip_enter_evidence(variables, 5, clique_pile, 3, variables[1], probB);
+  nip_enter_evidence(variables, 5, clique_pile, 3, variables[4], probE);
+  nip_enter_evidence(variables, 5, clique_pile, 3, variables[0], probA);
+  nip_enter_index_observation(variables, 5, clique_pile, 3, variables[3], 2);
+  nip_collect_schedule(schedule);
+  nip_distribute_schedule(schedule);
+  nip_marginalise_clique(clique_pile[0], variables[0], result2);
+  nip_normalise_array(result2, 3);
+  for(i = 0; i < 3; i++){
+    printf("retracted[%d] = %g, fresh[%d] = %g\n", 
+	   i, result[i], i, result2[i]);
+    if(fabs(result[i] - result2[i]) > 1e-12)
+      failed = 1;
+  }
+  printf("Evidence retraction: %s\n", (failed ? "FAILED" : "OK"));
+  nip_free_schedule(schedule);
   /* To be continued... */
 
   /* free the join tree */
@@ -222,5 +373,5 @@ int main(){
   for(i = 0; i < 5; i++)
     nip_free_variable(variables[i]);
 
-  return 0;
+  return failed;
 }
@@ -19,7 +19,10 @@
  *
  * Experimental code for handling the inference with time slices. 
  * Prints marginal posterior probability distributions for each variable 
- * during the first time series in the given data file. 
+ * during the first time series in the given data file, and checks 
+ * that the online filter and fixed-lag smoother agree with the offline 
+ * inference, and that the memory policies of forward-backward inference 
+ * agree, also with some of the observations hidden. 
  *
  * SYNOPSIS: HTMTEST <MODEL.NET> <DATA.TXT>
  * 
@@ -39,11 +42,63 @@
 
 #define VAR_OF_INTEREST(m,x) (((m)->variables[(x)]->interface_status & NIP_INTERFACE_OLD_OUTGOING) == 0)
 
+/* The fixed-lag smoother is checked with lags 0..MAX_LAG, in the first 
+ * SMOOTHER_CHECK_LENGTH steps (each of them a forward-backward run) */
+#define MAX_LAG 3
+#define SMOOTHER_CHECK_LENGTH 50
+
+/* The largest difference in a probability allowed between the methods */
+#define TOLERANCE 1e-9
+
+/* Points results[i] to the place of vars[i] in a step of data */
+static void point_results(double* results[], double data[], 
+			  nip_variable vars[], int nvars){
+  int i;
+  for(i = 0; i < nvars; i++){
+    results[i] = data;
+    data += NIP_CARDINALITY(vars[i]);
+  }
+}
+
+/* Number of probabilities in step a of vars that differ from step b */
+static int compare_step(double* a[], double* b[], 
+			nip_variable vars[], int nvars){
+  int i, j, errors = 0;
+  for(i = 0; i < nvars; i++)
+    for(j = 0; j < NIP_CARDINALITY(vars[i]); j++)
+      if(fabs(a[i][j] - b[i][j]) > TOLERANCE)
+	errors++;
+  return errors;
+}
+
+/* Number of probabilities in series a that differ from series b 
+ * (or 1 if b is missing) */
+static int compare_series(uncertain_series a, uncertain_series b){
+  int t, errors = 0;
+  if(!b)
+    return 1;
+  for(t = 0; t < UNCERTAIN_SERIES_LENGTH(a); t++)
+    errors += compare_step(a->data[t], b->data[t], 
+			   a->variables, a->num_of_vars);
+  return errors;
+}
+
 int main(int argc, char *argv[]){
 
   int i, j, n, t = 0;
+  int lag, len, width, length;
+  int errors = 0;
+  int scan_errors = 0;
+  int filter_errors = 0;
+  int smoother_errors = 0;
+  int policy_errors = 0;
+  int cache_errors = 0;
+  int missing_errors = 0;
+  nip_memory_policy policy;
+  size_t budget;
 
   double loglikelihood = 0;
+  double loglikelihood2 = 0;
 
   nip_model model = NULL;
   nip_variable temp = NULL;
@@ -53,6 +108,11 @@ int main(int argc, char *argv[]){
   time_series ts = NULL;
   time_series *ts_set = NULL;
   uncertain_series ucs = NULL;
+  uncertain_series ucs2 = NULL;
+  forward_filter filter = NULL;
+  fixed_lag_smoother smoother = NULL;
+  double* smoothed = NULL;
+  double** results = NULL;
 
   /*****************************************/
   /* Parse the model from a Hugin NET file */
@@ -99,6 +159,20 @@ int main(int argc, char *argv[]){
   }
   assert(j == nvars);
 
+  /* Room for the online results */
+  width = 0;
+  for(i = 0; i < nvars; i++)
+    width += NIP_CARDINALITY(vars[i]);
+  len = (ts->length < SMOOTHER_CHECK_LENGTH ? 
+	 ts->length : SMOOTHER_CHECK_LENGTH);
+  results = (double**) calloc(nvars + 1, sizeof(double*));
+  smoothed = (double*) calloc((size_t)(MAX_LAG + 1) * (len + 1) * width, 
+			      sizeof(double));
+  if(!(results && smoothed)){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    return -1;
+  }
+
 
   /** DEBUG **/
   printf("Observed variables:\n  ");
@@ -148,6 +222,37 @@ int main(int argc, char *argv[]){
   printf("  ln p(y(1:%d)) = %g\n\n", 
 	 UNCERTAIN_SERIES_LENGTH(ucs), 
 	 loglikelihood);
+
+  /* The same results as a parallel scan */
+  ucs2 = forward_inference_scan(ts, vars, nvars, &loglikelihood2);
+  scan_errors += compare_series(ucs, ucs2);
+  if(fabs(loglikelihood2 - loglikelihood) > 1e-6)
+    scan_errors++;
+  free_uncertainseries(ucs2);
+  if(scan_errors)
+    printf("Parallel scan: %d FAILED\n", scan_errors);
+  else
+    printf("Parallel scan: OK\n\n");
+
+  /* ...and online, one time step at a time */
+  filter = new_forward_filter(model);
+  point_results(results, smoothed, vars, nvars);
+  for(t = 0; t < ts->length; t++){
+    if(filter_step(filter, ts->observed, ts->data[t], 
+		   ts->num_of_observed) != NIP_NO_ERROR || 
+       filter_probabilities(filter, vars, nvars, results) != NIP_NO_ERROR){
+      filter_errors++;
+      continue;
+    }
+    filter_errors += compare_step(results, ucs->data[t], vars, nvars);
+  }
+  if(fabs(pop_filter_loglikelihood(filter) - loglikelihood) > 1e-6)
+    filter_errors++;
+  free_forward_filter(filter);
+  if(filter_errors)
+    printf("Forward filter: %d FAILED\n", filter_errors);
+  else
+    printf("Forward filter: OK\n\n");
   
   /******************/
   /* Backward phase */
@@ -173,12 +278,136 @@ int main(int argc, char *argv[]){
     }
   }
 
+  /*************************************************/
+  /* The same results with the other memory policies */
+  /*************************************************/
+
+  for(policy = NIP_MEMORY_CHECKPOINTS; policy <= NIP_MEMORY_TIMESLICES; 
+      policy++){
+    set_memory_policy(model, policy, 0);
+    ucs2 = forward_backward_inference(ts, vars, nvars, NULL);
+    policy_errors += compare_series(ucs, ucs2);
+    free_uncertainseries(ucs2);
+  }
+
+  /* NIP_MEMORY_AUTO: the fastest policy that fits in the budget */
+  budget = sizeof(double) * TIME_SERIES_LENGTH(ts);
+  for(i = 0; i < model->outgoing_interface_size; i++)
+    budget *= NIP_CARDINALITY(model->outgoing_interface[i]);
+  set_memory_policy(model, NIP_MEMORY_AUTO, 0);
+  if(get_memory_policy(model, TIME_SERIES_LENGTH(ts)) != 
+     NIP_MEMORY_CHECKPOINTS)
+    policy_errors++;
+  set_memory_policy(model, NIP_MEMORY_AUTO, budget);
+  if(get_memory_policy(model, TIME_SERIES_LENGTH(ts)) != 
+     NIP_MEMORY_INTERFACES)
+    policy_errors++;
+  set_memory_policy(model, NIP_MEMORY_AUTO, (size_t) -1);
+  if(get_memory_policy(model, TIME_SERIES_LENGTH(ts)) != 
+     NIP_MEMORY_TIMESLICES)
+    policy_errors++;
+  set_memory_policy(model, NIP_MEMORY_INTERFACES, 0);
+  if(policy_errors)
+    printf("Memory policies: %d FAILED\n", policy_errors);
+  else
+    printf("Memory policies: OK\n");
+
+  /* ...and with the time slices compiled into matrices */
+  if(set_transfer_cache(model, 100) == NIP_NO_ERROR){
+    ucs2 = forward_backward_inference(ts, vars, nvars, NULL);
+    cache_errors += compare_series(ucs, ucs2);
+    free_uncertainseries(ucs2);
+    set_transfer_cache(model, 0);
+    if(cache_errors)
+      printf("Transfer cache: %d FAILED\n", cache_errors);
+    else
+      printf("Transfer cache: OK\n");
+  }
+
+  /* ...and online with a fixed lag L: step t given the steps up to t+L 
+   * is step t of the series ending at t+L, and the last L steps flushed 
+   * at the end are the steps of the whole series */
+  length = ts->length;
+  ts->length = len;
+  for(lag = 0; lag <= MAX_LAG; lag++){
+    smoother = new_fixed_lag_smoother(model, lag);
+    for(t = 0; t < len; t++){
+      if(smoother_step(smoother, ts->observed, ts->data[t], 
+		       ts->num_of_observed) != NIP_NO_ERROR || 
+	 smoother->t != (t >= lag ? t - lag : -1)){
+	smoother_errors++;
+	continue;
+      }
+      if(smoother->t < 0)
+	continue;
+      point_results(results, smoothed + 
+		    ((size_t) lag * len + smoother->t) * width, vars, nvars);
+      smoother_probabilities(smoother, vars, nvars, results);
+    }
+    while(smoother->t < len - 1){
+      t = smoother->t;
+      if(smoother_flush(smoother) != NIP_NO_ERROR || smoother->t != t + 1){
+	smoother_errors++;
+	break;
+      }
+      point_results(results, smoothed + 
+		    ((size_t) lag * len + smoother->t) * width, vars, nvars);
+      smoother_probabilities(smoother, vars, nvars, results);
+    }
+    free_fixed_lag_smoother(smoother);
+  }
+  for(ts->length = 1; ts->length <= len; ts->length++){
+    ucs2 = forward_backward_inference(ts, vars, nvars, NULL);
+    for(lag = 0; lag <= MAX_LAG; lag++){
+      for(t = ts->length - 1 - lag; t < ts->length; t++){
+	if(t < 0)
+	  continue;
+	if(ts->length < len && t > ts->length - 1 - lag)
+	  break; /* not the end of the series yet */
+	point_results(results, smoothed + ((size_t) lag * len + t) * width, 
+		      vars, nvars);
+	smoother_errors += compare_step(results, ucs2->data[t], vars, nvars);
+      }
+    }
+    free_uncertainseries(ucs2);
+  }
+  ts->length = length;
+  if(smoother_errors)
+    printf("Fixed-lag smoother: %d FAILED\n", smoother_errors);
+  else
+    printf("Fixed-lag smoother: OK\n");
+
+  /* ...and when some of the observations are missing: then the message 
+   * passes within a time slice depend on the data of each step */
+  for(t = 0; t < ts->length; t++)
+    for(i = 0; i < ts->num_of_observed; i++)
+      if((3 * t + 7 * i) % 5 < 2)
+	ts->data[t][i] = -1;
+  free_uncertainseries(ucs);
+  ucs = forward_backward_inference(ts, vars, nvars, NULL);
+  for(policy = NIP_MEMORY_CHECKPOINTS; policy <= NIP_MEMORY_TIMESLICES; 
+      policy++){
+    set_memory_policy(model, policy, 0);
+    ucs2 = forward_backward_inference(ts, vars, nvars, NULL);
+    missing_errors += compare_series(ucs, ucs2);
+    free_uncertainseries(ucs2);
+  }
+  set_memory_policy(model, NIP_MEMORY_INTERFACES, 0);
+  if(missing_errors)
+    printf("Missing data: %d FAILED\n", missing_errors);
+  else
+    printf("Missing data: OK\n");
+
   for(i = 0; i < n; i++)
     free_timeseries(ts_set[i]);
   free(ts_set);
   free_uncertainseries(ucs);
   free(vars);
+  free(results);
+  free(smoothed);
   free_model(model);
   
-  return 0;
+  errors = scan_errors + filter_errors + policy_errors + cache_errors + 
+    smoother_errors + missing_errors;
+  return errors;
 }
@@ -0,0 +1,126 @@
+/*  NIP - Dynamic Bayesian Network library
+    Copyright (C) 2012  Janne Toivola
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* kernelbench.c
+ *
+ * Microbenchmark for the potential kernels: times a message pass
+ * (marginalisation of a clique into a sepset and an update of a clique
+ * with a sepset) for typical sepset layouts with each instruction set
+ * the CPU supports, and checks that the results are the same.
+ *
+ * Usage: kernelbench [repetitions]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "nippotential.h"
+#include "nipvector.h"
+
+#define NUM_OF_DIMS 8
+
+/* A clique of eight variables (~300k elements) */
+static int clique_card[NUM_OF_DIMS] = {4, 3, 5, 2, 6, 4, 3, 6};
+
+/* Sepset layouts: where the sepset variables are in the clique */
+static int prefix_mapping[] = {0, 1, 2};
+static int suffix_mapping[] = {5, 6, 7};
+static int other_mapping[]  = {6, 2, 0};
+
+static double seconds(){
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+/* Returns the time per message pass and leaves the results in q and t */
+static double bench(nip_potential p, nip_potential q, nip_potential r,
+		    nip_potential t, int stride[], int reps){
+  int i;
+  double start = seconds();
+  for(i = 0; i < reps; i++){
+    nip_strided_marginalise(p, q, stride);
+    memcpy(t->data, p->data, p->size_of_data * sizeof(double));
+    nip_strided_update(q, r, t, stride);
+  }
+  return (seconds() - start) / reps;
+}
+
+static int layout(char* name, int mapping[], int reps){
+  int i, isa, errors = 0;
+  int card[3];
+  int stride[NUM_OF_DIMS];
+  double time, scalar_time = 0;
+  nip_potential p, q, r, t, q0, t0;
+
+  for(i = 0; i < 3; i++)
+    card[i] = clique_card[mapping[i]];
+  p = nip_new_potential(clique_card, NUM_OF_DIMS, NULL);
+  t = nip_new_potential(clique_card, NUM_OF_DIMS, NULL);
+  q = nip_new_potential(card, 3, NULL);
+  r = nip_new_potential(card, 3, NULL);
+  nip_random_potential(p);
+  nip_random_potential(r);
+  r->data[0] = 0; /* the zero guard */
+  nip_mapping_strides(p, card, mapping, 3, stride);
+
+  q0 = NULL;
+  t0 = NULL;
+  for(isa = NIP_VECTOR_SCALAR; isa <= nip_vector_best_isa(); isa++){
+    nip_vector_set_isa(isa);
+    time = bench(p, q, r, t, stride, reps);
+    if(isa == NIP_VECTOR_SCALAR){
+      scalar_time = time;
+      q0 = nip_copy_potential(q);
+      t0 = nip_copy_potential(t);
+    }
+    else if(memcmp(q->data, q0->data, q->size_of_data * sizeof(double)) ||
+	    memcmp(t->data, t0->data, t->size_of_data * sizeof(double)))
+      errors++;
+    printf("%-8s %-8s %10.1f us  speedup %.2f\n", name,
+	   nip_vector_isa_name(isa), time * 1e6, scalar_time / time);
+  }
+
+  nip_free_potential(p);
+  nip_free_potential(q);
+  nip_free_potential(r);
+  nip_free_potential(t);
+  nip_free_potential(q0);
+  nip_free_potential(t0);
+  return errors;
+}
+
+int main(int argc, char* argv[]){
+  int reps = 50;
+  int errors = 0;
+  nip_vector_isa best = nip_vector_best_isa();
+
+  if(argc > 1)
+    reps = atoi(argv[1]);
+  srand(1);
+
+  printf("Best instruction set: %s\n", nip_vector_isa_name(best));
+  errors += layout("prefix", prefix_mapping, reps);
+  errors += layout("suffix", suffix_mapping, reps);
+  errors += layout("other", other_mapping, reps);
+  nip_vector_set_isa(best);
+
+  if(errors)
+    printf("Results: %d FAILED\n", errors);
+  else
+    printf("Results: OK\n");
+  return errors;
+}
@@ -22,7 +22,405 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include "nippotential.h" 
+#include "nipvector.h"
+
+/* Straightforward reference versions of the kernels, computed element 
+ * by element through nip_inverse_mapping() in the same order. 
+ * The optimised kernels must give exactly the same numbers. */
+static void ref_marginalise(nip_potential p, nip_potential q, int mapping[]){
+  int i, j;
+  int big[5], small[5];
+  nip_uniform_potential(q, 0.0);
+  for(i = 0; i < p->size_of_data; i++){
+    nip_inverse_mapping(p, i, big);
+    for(j = 0; j < q->dimensionality; j++)
+      small[j] = big[mapping[j]];
+    nip_set_potential_value(q, small, nip_get_potential_value(q, small) + 
+			    p->data[i]);
+  }
+}
+
+static void ref_update(nip_potential num, nip_potential den, 
+		       nip_potential target, int mapping[]){
+  int i, j;
+  int big[5], small[5];
+  double v;
+  for(i = 0; i < target->size_of_data; i++){
+    nip_inverse_mapping(target, i, big);
+    for(j = 0; j < num->dimensionality; j++)
+      small[j] = big[mapping[j]];
+    target->data[i] *= nip_get_potential_value(num, small);
+    if(den){
+      v = nip_get_potential_value(den, small);
+      if(v != 0)
+	target->data[i] /= v;
+      else
+	target->data[i] = 0;
+    }
+  }
+}
+
+static void ref_evidence(double num[], double den[], 
+			 nip_potential target, int var){
+  int i;
+  int big[5];
+  for(i = 0; i < target->size_of_data; i++){
+    nip_inverse_mapping(target, i, big);
+    target->data[i] *= num[big[var]];
+    if(den != NULL && den[big[var]] != 0)
+      target->data[i] /= den[big[var]];
+  }
+}
+
+static void ref_total(nip_potential p, double result[], int var){
+  int i;
+  int big[5];
+  for(i = 0; i < p->cardinality[var]; i++)
+    result[i] = 0;
+  for(i = 0; i < p->size_of_data; i++){
+    nip_inverse_mapping(p, i, big);
+    result[big[var]] += p->data[i];
+  }
+}
+
+static int same_data(nip_potential a, nip_potential b){
+  int i;
+  for(i = 0; i < a->size_of_data; i++)
+    if(a->data[i] != b->data[i])
+      return 0;
+  return 1;
+}
+
+/* Compares the kernels against the reference versions. 
+ * Returns the number of mismatches. */
+static int compare_kernels(nip_potential p, nip_potential q, int mapping[]){
+  int i, errors = 0;
+  double a[6], b[6], num[6], den[6];
+  double all_data[5][6];
+  double* all[5];
+  int variables[5];
+  int slice[5], stride[5], states[5];
+  nip_potential r, t1, t2, denominator;
+
+  r = nip_copy_potential(q);
+  nip_general_marginalise(p, q, mapping);
+  ref_marginalise(p, r, mapping);
+  if(!same_data(q, r)){
+    printf("general_marginalise: FAILED\n");
+    errors++;
+  }
+
+  /* denominator with some zeros in it */
+  denominator = nip_copy_potential(q);
+  for(i = 0; i < denominator->size_of_data; i += 3)
+    denominator->data[i] = 0;
+  nip_random_potential(r);
+
+  t1 = nip_copy_potential(p);
+  t2 = nip_copy_potential(p);
+  nip_update_potential(r, denominator, t1, mapping);
+  ref_update(r, denominator, t2, mapping);
+  if(!same_data(t1, t2)){
+    printf("update_potential: FAILED\n");
+    errors++;
+  }
+
+  nip_init_potential(r, t1, mapping);
+  ref_update(r, NULL, t2, mapping);
+  if(!same_data(t1, t2)){
+    printf("init_potential: FAILED\n");
+    errors++;
+  }
+
+  for(i = 0; i < p->dimensionality; i++){
+    nip_total_marginalise(t1, a, i);
+    ref_total(t2, b, i);
+    if(memcmp(a, b, p->cardinality[i] * sizeof(double))){
+      printf("total_marginalise(%d): FAILED\n", i);
+      errors++;
+    }
+  }
+
+  /* all the variables in one go */
+  for(i = 0; i < p->dimensionality; i++){
+    all[i] = all_data[i];
+    variables[i] = p->dimensionality - 1 - i;
+  }
+  nip_fused_total_marginalise(t1, all, variables, p->dimensionality);
+  for(i = 0; i < p->dimensionality; i++){
+    ref_total(t2, b, variables[i]);
+    if(memcmp(all[i], b, p->cardinality[variables[i]] * sizeof(double))){
+      printf("fused_total_marginalise(%d): FAILED\n", variables[i]);
+      errors++;
+    }
+  }
+
+  for(i = 0; i < 6; i++){
+    num[i] = (double)rand() / RAND_MAX;
+    den[i] = (i % 2) ? (double)rand() / RAND_MAX : 0.0;
+  }
+  for(i = 0; i < p->dimensionality; i++){
+    nip_update_evidence(num, den, t1, i);
+    ref_evidence(num, den, t2, i);
+    if(!same_data(t1, t2)){
+      printf("update_evidence(%d): FAILED\n", i);
+      errors++;
+    }
+  }
+
+  /* hard evidence: observed value 1, old likelihood den */
+  for(i = 0; i < p->dimensionality; i++){
+    memset(num, 0, sizeof(num));
+    num[1] = 1;
+    den[1] = (i % 2) ? 0.5 : 1.0;
+    nip_update_hard_evidence(t1, i, 1, den[1]);
+    ref_evidence(num, den, t2, i);
+    if(!same_data(t1, t2)){
+      printf("update_hard_evidence(%d): FAILED\n", i);
+      errors++;
+    }
+  }
+
+  /* ...so any of the dimensions can be sliced at 1 */
+  for(i = 0; i < p->dimensionality; i++)
+    slice[i] = (i == 0 || i == p->dimensionality - 1) ? 1 : -1;
+  nip_mapping_strides(p, q->cardinality, mapping, q->dimensionality, stride);
+  nip_sliced_marginalise(t1, q, stride, slice);
+  nip_strided_marginalise(t2, r, stride);
+  if(!same_data(q, r)){
+    printf("sliced_marginalise: FAILED\n");
+    errors++;
+  }
+  nip_sliced_update(r, denominator, t1, stride, slice);
+  nip_strided_update(r, denominator, t2, stride);
+  if(!same_data(t1, t2)){
+    printf("sliced_update: FAILED\n");
+    errors++;
+  }
+
+  /* many observations in one sweep */
+  memcpy(t1->data, p->data, p->size_of_data * sizeof(double));
+  memcpy(t2->data, p->data, p->size_of_data * sizeof(double));
+  for(i = 0; i < p->dimensionality; i++){
+    variables[i] = p->dimensionality - 1 - i;
+    states[i] = i % p->cardinality[variables[i]];
+    num[i] = (i % 2) ? 1.0 : 0.5;
+    nip_update_hard_evidence(t2, variables[i], states[i], num[i]);
+  }
+  nip_update_hard_evidences(t1, variables, states, num, p->dimensionality);
+  if(!same_data(t1, t2)){
+    printf("update_hard_evidences: FAILED\n");
+    errors++;
+  }
+
+  nip_free_potential(r);
+  nip_free_potential(denominator);
+  nip_free_potential(t1);
+  nip_free_potential(t2);
+  return errors;
+}
+
+/* Compares the parallel kernels against the serial ones with a 
+ * potential large enough to be split among threads (over 10^6 
+ * elements): the results must be exactly the same. 
+ * Returns the number of mismatches. */
+static int compare_parallel(nip_thread_pool pool){
+  int i, errors = 0;
+  int variables[] = {4, 2, 0};
+  double serial[16 + 9 + 80];
+  double parallel[16 + 9 + 80];
+  double* r_serial[3];
+  double* r_parallel[3];
+  int card_big[] = {16, 12, 9, 8, 80};
+  int card_small[] = {80, 12};
+  int card_inner[] = {16, 9};
+  int mapping[] = {4, 1};
+  int inner_mapping[] = {0, 2};
+  int stride[5];
+  int inner_stride[5];
+  nip_potential p, q1, q2, r1, r2, t1, t2;
+
+  p = nip_new_potential(card_big, 5, NULL);
+  q1 = nip_new_potential(card_small, 2, NULL);
+  q2 = nip_new_potential(card_small, 2, NULL);
+  r1 = nip_new_potential(card_inner, 2, NULL);
+  r2 = nip_new_potential(card_inner, 2, NULL);
+  nip_random_potential(p);
+  nip_mapping_strides(p, card_small, mapping, 2, stride);
+  nip_mapping_strides(p, card_inner, inner_mapping, 2, inner_stride);
+
+  /* the outermost dimension kept */
+  nip_strided_marginalise(p, q1, stride);
+  nip_parallel_marginalise(pool, p, q2, stride);
+  if(!same_data(q1, q2)){
+    printf("parallel_marginalise: FAILED\n");
+    errors++;
+  }
+  /* the outermost dimension summed out: split along an inner one */
+  nip_strided_marginalise(p, r1, inner_stride);
+  nip_parallel_marginalise(pool, p, r2, inner_stride);
+  if(!same_data(r1, r2)){
+    printf("parallel_marginalise (summed out): FAILED\n");
+    errors++;
+  }
+
+  /* single variables, the innermost one included */
+  r_serial[0] = serial;
+  r_parallel[0] = parallel;
+  for(i = 1; i < 3; i++){
+    r_serial[i] = r_serial[i - 1] + card_big[variables[i - 1]];
+    r_parallel[i] = r_parallel[i - 1] + card_big[variables[i - 1]];
+  }
+  nip_fused_total_marginalise(p, r_serial, variables, 3);
+  nip_parallel_total_marginalise(pool, p, r_parallel, variables, 3);
+  if(memcmp(serial, parallel, sizeof(serial)) != 0){
+    printf("parallel_total_marginalise: FAILED\n");
+    errors++;
+  }
+
+  /* the updates must be exactly the same */
+  for(i = 0; i < q2->size_of_data; i += 5)
+    q2->data[i] = 0;
+  t1 = nip_copy_potential(p);
+  t2 = nip_copy_potential(p);
+  nip_strided_update(q1, q2, t1, stride);
+  nip_parallel_update(pool, q1, q2, t2, stride);
+  if(!same_data(t1, t2)){
+    printf("parallel_update: FAILED\n");
+    errors++;
+  }
+
+  nip_free_potential(p);
+  nip_free_potential(q1);
+  nip_free_potential(q2);
+  nip_free_potential(r1);
+  nip_free_potential(r2);
+  nip_free_potential(t1);
+  nip_free_potential(t2);
+  return errors;
+}
+
+/* Compares the fused kernels against one strided kernel at a time, 
+ * with three different layouts at once. 
+ * Returns the number of mismatches. */
+static int compare_fused(nip_potential p){
+  int i, errors = 0;
+  int card[3][4] = {{3, 5, 4, 2}, {2, 3}, {6, 4}};
+  int mapping[3][4] = {{1, 3, 2, 0}, {0, 1}, {4, 2}};
+  int size[3] = {4, 2, 2};
+  int stride_data[3][5];
+  int* stride[3];
+  nip_potential q[3], r[3], den[3], t1, t2;
+
+  for(i = 0; i < 3; i++){
+    q[i] = nip_new_potential(card[i], size[i], NULL);
+    r[i] = nip_new_potential(card[i], size[i], NULL);
+    stride[i] = stride_data[i];
+    nip_mapping_strides(p, card[i], mapping[i], size[i], stride[i]);
+    nip_strided_marginalise(p, r[i], stride[i]);
+  }
+  nip_fused_marginalise(p, q, stride, 3);
+  for(i = 0; i < 3; i++){
+    if(!same_data(q[i], r[i])){
+      printf("fused_marginalise(%d): FAILED\n", i);
+      errors++;
+    }
+  }
+
+  /* denominators with some zeros, one of them missing */
+  for(i = 0; i < 3; i++){
+    den[i] = nip_copy_potential(q[i]);
+    den[i]->data[i] = 0;
+    nip_random_potential(q[i]);
+  }
+  nip_free_potential(den[1]);
+  den[1] = NULL;
+  t1 = nip_copy_potential(p);
+  t2 = nip_copy_potential(p);
+  nip_fused_update(q, den, t1, stride, 3);
+  for(i = 0; i < 3; i++)
+    nip_strided_update(q[i], den[i], t2, stride[i]);
+  if(!same_data(t1, t2)){
+    printf("fused_update: FAILED\n");
+    errors++;
+  }
+
+  for(i = 0; i < 3; i++){
+    nip_free_potential(q[i]);
+    nip_free_potential(r[i]);
+    nip_free_potential(den[i]);
+  }
+  nip_free_potential(t1);
+  nip_free_potential(t2);
+  return errors;
+}
+
+/* Compares the sliced fused kernels against one sliced kernel at a 
+ * time, with four layouts at once and slices of different shapes 
+ * (p has five dimensions). Returns the number of mismatches. */
+static int compare_sliced(nip_potential p){
+  int i, j, k, errors = 0;
+  int mapping[4][4] = {{0, 1}, {1, 3, 2, 0}, {4, 2}, {2, 3}};
+  int size[4] = {2, 4, 2, 2};
+  int slices[5][5] = {{-1, -1, -1, 1, -1}, {1, -1, -1, -1, -1}, 
+		      {-1, -1, 2, -1, 1}, {-1, -1, -1, -1, 2}, 
+		      {-1, -1, -1, -1, -1}};
+  int card[4][4];
+  int stride_data[4][6];
+  int* stride[4];
+  nip_potential q[4], r[4], den[4], t1, t2;
+
+  for(i = 0; i < 4; i++){
+    for(j = 0; j < size[i]; j++)
+      card[i][j] = p->cardinality[mapping[i][j]];
+    q[i] = nip_new_potential(card[i], size[i], NULL);
+    r[i] = nip_new_potential(card[i], size[i], NULL);
+    stride[i] = stride_data[i];
+    nip_mapping_strides(p, card[i], mapping[i], size[i], stride[i]);
+  }
+
+  for(k = 0; k < 5; k++){
+    nip_fused_sliced_marginalise(p, q, stride, 4, slices[k]);
+    for(i = 0; i < 4; i++){
+      nip_sliced_marginalise(p, r[i], stride[i], slices[k]);
+      if(!same_data(q[i], r[i])){
+	printf("fused_sliced_marginalise(%d, %d): FAILED\n", k, i);
+	errors++;
+      }
+    }
+
+    /* denominators with some zeros, one of them missing */
+    for(i = 0; i < 4; i++){
+      den[i] = nip_copy_potential(r[i]);
+      den[i]->data[i] = 0;
+      nip_random_potential(q[i]);
+    }
+    nip_free_potential(den[2]);
+    den[2] = NULL;
+    t1 = nip_copy_potential(p);
+    t2 = nip_copy_potential(p);
+    nip_fused_sliced_update(q, den, t1, stride, 4, slices[k]);
+    for(i = 0; i < 4; i++)
+      nip_sliced_update(q[i], den[i], t2, stride[i], slices[k]);
+    if(!same_data(t1, t2)){
+      printf("fused_sliced_update(%d): FAILED\n", k);
+      errors++;
+    }
+    for(i = 0; i < 4; i++)
+      nip_free_potential(den[i]);
+    nip_free_potential(t1);
+    nip_free_potential(t2);
+  }
+
+  for(i = 0; i < 4; i++){
+    nip_free_potential(q[i]);
+    nip_free_potential(r[i]);
+  }
+  return errors;
+}
 
 /* Main function for testing */
 int main(){
@@ -32,9 +430,17 @@ int main(){
   int card2[] = {3, 5, 4, 2};
   int num_of_vars = 5;
   int margin_mapping[] = {1, 3, 2, 0}; /* maps variables p -> q */
+  int card3[2];
+  int other_mapping[] = {0, 1}; /* a prefix of p */
+  int suffix_mapping[] = {3, 4}; /* a suffix of p */
+  int last_mapping[] = {4, 2};  /* reversed order */
+  int card_big[] = {16, 12, 4, 5, 6};
   int indices[5], i, j, k, l, m, x = 0;
+  int errors = 0;
   double value;
-  nip_potential p, q;
+  nip_potential p, q, s, big;
+  nip_thread_pool pool;
+  int isa;
   p = nip_new_potential(cardinality, num_of_vars, NULL);
   q = nip_new_potential(card2, num_of_vars - 1, NULL);
 
@@ -107,8 +513,47 @@ int main(){
     }
   }
 
+  /* compare the optimised kernels to the straightforward ones, 
+   * with each instruction set the CPU supports */
+  for(isa = NIP_VECTOR_SCALAR; isa <= nip_vector_best_isa(); isa++){
+    nip_vector_set_isa(isa);
+    srand(1);
+    nip_random_potential(p);
+    errors += compare_kernels(p, q, margin_mapping);
+    card3[0] = cardinality[0]; card3[1] = cardinality[1];
+    s = nip_new_potential(card3, 2, NULL);
+    errors += compare_kernels(p, s, other_mapping);
+    nip_free_potential(s);
+    card3[0] = cardinality[3]; card3[1] = cardinality[4];
+    s = nip_new_potential(card3, 2, NULL);
+    errors += compare_kernels(p, s, suffix_mapping);
+    nip_free_potential(s);
+    card3[0] = cardinality[4]; card3[1] = cardinality[2];
+    s = nip_new_potential(card3, 2, NULL);
+    errors += compare_kernels(p, s, last_mapping);
+    nip_free_potential(s);
+    errors += compare_fused(p);
+    errors += compare_sliced(p);
+
+    /* runs longer than the fused blocks, too */
+    big = nip_new_potential(card_big, num_of_vars, NULL);
+    nip_random_potential(big);
+    errors += compare_sliced(big);
+    nip_free_potential(big);
+  }
+  /* with more threads than values in a dimension, split along two */
+  for(i = 3; i <= 16; i += 13){
+    pool = nip_new_thread_pool(i);
+    errors += compare_parallel(pool);
+    nip_free_thread_pool(pool);
+  }
+  if(errors)
+    printf("Kernels: %d FAILED\n", errors);
+  else
+    printf("Kernels: OK\n");
+
   nip_free_potential(p);
   nip_free_potential(q);
 
-  return 0;
+  return errors;
 }
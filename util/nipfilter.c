@@ -0,0 +1,215 @@
+/*  NIP - Dynamic Bayesian Network library
+    Copyright (C) 2012  Janne Toivola
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* nipfilter.c
+ *
+ * SYNOPSIS:
+ * NIPFILTER <MODEL.NET> <VARIABLE> [INPUT_STREAM]
+ *
+ * Online forward inference: reads a data stream (in the format of
+ * the data files) from stdin, or from a file or a named pipe, and
+ * writes the filtered probabilities of the selected variable to stdout
+ * as soon as each time step has arrived. An empty line ends a time
+ * series, and the log. likelihood of the series is written to stderr.
+ *
+ * EXAMPLE: tail -f data.txt | ./nipfilter filter.net A
+ *
+ * Author: Janne Toivola
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nip.h"
+#include "nipstring.h"
+
+
+/* Splits a line of data into tokens, returns their number or -1 */
+static int line_tokens(char* line, char*** tokens){
+  char separator = NIP_FIELD_SEPARATOR;
+  int* bounds;
+  int n;
+
+  n = nip_count_tokens(line, NULL, 0, &separator, 1, 0, 1);
+  *tokens = NULL;
+  if(n < 1)
+    return 0;
+  bounds = nip_tokenise(line, n, 0, &separator, 1, 0, 1);
+  if(!bounds)
+    return -1;
+  *tokens = nip_split(line, bounds, n);
+  free(bounds);
+  if(!*tokens)
+    return -1;
+  return n;
+}
+
+
+static void free_tokens(char** tokens, int n){
+  int i;
+  for(i = 0; i < n; i++)
+    free(tokens[i]);
+  free(tokens);
+}
+
+
+int main(int argc, char *argv[]){
+
+  int i, m, n = 0;
+  char line[MAX_LINELENGTH];
+  char** tokens = NULL;
+  nip_variable* columns = NULL;
+  int* states = NULL;
+  double* result = NULL;
+
+  FILE* input = stdin;
+  nip_model model = NULL;
+  nip_variable v = NULL;
+  forward_filter f = NULL;
+
+  if(argc < 3){
+    printf("Specify the names of the net file, variable, ");
+    printf("and optionally the input file or pipe (default: stdin).\n");
+    return 0;
+  }
+
+  /*****************************************/
+  /* Parse the model from a Hugin NET file */
+  /*****************************************/
+  model = parse_model(argv[1]);
+  if(model == NULL)
+    return -1;
+
+  v = model_variable(model, argv[2]);
+  if(!v){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_INVALID_ARGUMENT, 1);
+    fprintf(stderr, "No such variable (%s) in the model.\n", argv[2]);
+    free_model(model);
+    return -1;
+  }
+
+  if(argc > 3){
+    input = fopen(argv[3], "r");
+    if(!input){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_FILENOTFOUND, 1);
+      fprintf(stderr, "%s\n", argv[3]);
+      free_model(model);
+      return -1;
+    }
+  }
+
+  /************************************/
+  /* The first line names the columns */
+  /************************************/
+  do{
+    if(fgets(line, MAX_LINELENGTH, input) == NULL){
+      fprintf(stderr, "No data.\n");
+      free_model(model);
+      return -1;
+    }
+    n = line_tokens(line, &tokens);
+  }while(n == 0);
+
+  f = new_forward_filter(model);
+  result = (double*) calloc(NIP_CARDINALITY(v), sizeof(double));
+  if(n > 0){
+    columns = (nip_variable*) calloc(n, sizeof(nip_variable));
+    states = (int*) calloc(n, sizeof(int));
+  }
+  if(n < 0 || !(f && result && columns && states)){
+    nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+    if(n > 0)
+      free_tokens(tokens, n);
+    free(columns);
+    free(states);
+    free(result);
+    free_forward_filter(f);
+    free_model(model);
+    return -1;
+  }
+  for(i = 0; i < n; i++)
+    columns[i] = model_variable(model, tokens[i]); /* NULL if unknown */
+  free_tokens(tokens, n);
+
+  /* the same header as in write_uncertainseries() */
+  for(i = 0; i < NIP_CARDINALITY(v); i++){
+    if(i > 0)
+      printf("%c", NIP_FIELD_SEPARATOR);
+    printf("%s", nip_variable_state_name(v, i));
+  }
+  printf("\n");
+  fflush(stdout);
+
+  /*****************************************/
+  /* The inference, one time step per line */
+  /*****************************************/
+  while(fgets(line, MAX_LINELENGTH, input) != NULL){
+    m = line_tokens(line, &tokens);
+    if(m < 0){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_OUTOFMEMORY, 1);
+      break;
+    }
+
+    if(m == 0){ /* end of a time series */
+      if(f->t > 0){
+	fprintf(stderr, "%g\n", pop_filter_loglikelihood(f));
+	printf("\n");
+	fflush(stdout);
+	restart_forward_filter(f);
+      }
+      continue;
+    }
+
+    if(m != n)
+      fprintf(stderr, "Warning: %d tokens, %d expected instead.\n", m, n);
+    for(i = 0; i < n; i++){
+      states[i] = -1; /* missing */
+      if(i < m && columns[i]){
+	states[i] = nip_variable_state_index(columns[i], tokens[i]);
+	if(states[i] < 0 && !nip_null_observation(tokens[i]))
+	  fprintf(stderr, "Warning: unknown state %s of %s taken as missing.\n",
+		  tokens[i], nip_variable_symbol(columns[i]));
+      }
+    }
+    free_tokens(tokens, m);
+
+    if(filter_step(f, columns, states, n) != NIP_NO_ERROR ||
+       filter_probabilities(f, &v, 1, &result) != NIP_NO_ERROR){
+      nip_report_error(__FILE__, __LINE__, NIP_ERROR_GENERAL, 1);
+      break;
+    }
+
+    for(i = 0; i < NIP_CARDINALITY(v); i++){
+      if(i > 0)
+	printf("%c", NIP_FIELD_SEPARATOR);
+      printf("%f", result[i]);
+    }
+    printf("\n");
+    fflush(stdout); /* right away, not when the buffer is full */
+  }
+  if(f->t > 0)
+    fprintf(stderr, "%g\n", pop_filter_loglikelihood(f));
+
+  if(input != stdin)
+    fclose(input);
+  free(columns);
+  free(states);
+  free(result);
+  free_forward_filter(f);
+  free_model(model);
+  return 0;
+}